@@ -7,29 +7,399 @@
 #include <sstream>
 #include <iostream>
 #include <fstream>
+#include <iomanip>
+#include <atomic>
+#include <chrono>
+#include <cmath>
 
 using namespace std;
 using namespace cv;
 
-void createArucoMarkers()
+// What to generate, from the command line
+struct GeneratorOptions
 {
-    Mat outputMarker;
-    Ptr<aruco::Dictionary> markerDictionary = aruco::getPredefinedDictionary(aruco::PREDEFINED_DICTIONARY_NAME::DICT_4X4_50);
-    //Ptr<aruco::Dictionary> markerDictionary = aruco::getPredefinedDictionary(aruco.DICT_4X4_50)
-    for(int i = 0; i < 50; i++)
+    string dictionary = "DICT_4X4_50";
+    int firstId = 0;
+    int lastId = -1;                // -1 for the last marker of the dictionary
+    int markerPixels = 500;         // side of a marker image
+    int borderBits = 1;
+    string format = "png";          // png, pgm or jpg
+    string outputDirectory = ".";
+    string prefix;                  // <n>x<n>Marker when not given
+    int threads = 0;                // 0 lets OpenCV choose
+
+    // Atlas sheets instead of one image per marker
+    bool atlas = false;
+    double pageWidth = 210.0, pageHeight = 297.0;   // millimeters
+    double dpi = 300.0;
+    double margin = 10.0;           // millimeters between the page edge and the markers
+    double spacing = 5.0;           // millimeters between two markers
+    double markerSide = 50.0;       // millimeters
+};
+
+// Where a marker was put on an atlas sheet
+struct AtlasPlacement
+{
+    int sheet = 0;
+    int id = 0;
+    Rect pixels;
+    double x = 0.0, y = 0.0, side = 0.0;    // millimeters from the sheet's top left corner
+};
+
+bool parseGeneratorOptions(int argc, char **argv, GeneratorOptions& options);
+bool dictionaryFromName(const string& name, Ptr<aruco::Dictionary>& dictionary);
+string markerFileName(const GeneratorOptions& options, const string& name);
+vector<int> imageWriteParameters(const string& format);
+bool writeMarkerImages(const GeneratorOptions& options, const Ptr<aruco::Dictionary>& dictionary, const vector<int>& ids);
+bool layoutAtlas(const GeneratorOptions& options, const vector<int>& ids, vector<AtlasPlacement>& placements, int& sheetCount, Size& sheetPixels);
+bool writeAtlas(const GeneratorOptions& options, const Ptr<aruco::Dictionary>& dictionary, const vector<int>& ids);
+
+// The predefined dictionaries by the name of their enum value
+bool dictionaryFromName(const string& name, Ptr<aruco::Dictionary>& dictionary)
+{
+    struct NamedDictionary
     {
-        aruco::drawMarker(markerDictionary, i, 500, outputMarker, 1);
-        ostringstream convert;
+        const char* name;
+        aruco::PREDEFINED_DICTIONARY_NAME value;
+    };
 
-        string imageName = "4x4Marker_";
-        convert << imageName << i << ".jpg";
+    static const NamedDictionary dictionaries[] =
+    {
+        { "DICT_4X4_50", aruco::DICT_4X4_50 }, { "DICT_4X4_100", aruco::DICT_4X4_100 },
+        { "DICT_4X4_250", aruco::DICT_4X4_250 }, { "DICT_4X4_1000", aruco::DICT_4X4_1000 },
+        { "DICT_5X5_50", aruco::DICT_5X5_50 }, { "DICT_5X5_100", aruco::DICT_5X5_100 },
+        { "DICT_5X5_250", aruco::DICT_5X5_250 }, { "DICT_5X5_1000", aruco::DICT_5X5_1000 },
+        { "DICT_6X6_50", aruco::DICT_6X6_50 }, { "DICT_6X6_100", aruco::DICT_6X6_100 },
+        { "DICT_6X6_250", aruco::DICT_6X6_250 }, { "DICT_6X6_1000", aruco::DICT_6X6_1000 },
+        { "DICT_7X7_50", aruco::DICT_7X7_50 }, { "DICT_7X7_100", aruco::DICT_7X7_100 },
+        { "DICT_7X7_250", aruco::DICT_7X7_250 }, { "DICT_7X7_1000", aruco::DICT_7X7_1000 },
+        { "DICT_ARUCO_ORIGINAL", aruco::DICT_ARUCO_ORIGINAL },
+        { "DICT_APRILTAG_16h5", aruco::DICT_APRILTAG_16h5 }, { "DICT_APRILTAG_25h9", aruco::DICT_APRILTAG_25h9 },
+        { "DICT_APRILTAG_36h10", aruco::DICT_APRILTAG_36h10 }, { "DICT_APRILTAG_36h11", aruco::DICT_APRILTAG_36h11 }
+    };
 
-        imwrite(convert.str(), outputMarker);
+    for(size_t d = 0; d < sizeof(dictionaries) / sizeof(dictionaries[0]); d++)
+    {
+        if(name == dictionaries[d].name)
+        {
+            dictionary = aruco::getPredefinedDictionary(dictionaries[d].value);
+            return true;
+        }
     }
+
+    cerr << "Unknown dictionary " << name << endl;
+    return false;
 }
 
-int main(int argv, char **argc)
+string markerFileName(const GeneratorOptions& options, const string& name)
 {
-    createArucoMarkers();
+    return options.outputDirectory + "/" + options.prefix + "_" + name + "." + options.format;
 }
 
+// PNG at a low compression level, it stays lossless and encodes several times faster than the default
+vector<int> imageWriteParameters(const string& format)
+{
+    vector<int> parameters;
+
+    if(format == "png")
+    {
+        parameters.push_back(IMWRITE_PNG_COMPRESSION);
+        parameters.push_back(1);
+    }
+    else if(format == "pgm")
+    {
+        parameters.push_back(IMWRITE_PXM_BINARY);
+        parameters.push_back(1);
+    }
+    else if(format == "jpg")
+    {
+        parameters.push_back(IMWRITE_JPEG_QUALITY);
+        parameters.push_back(100);
+    }
+
+    return parameters;
+}
+
+/*
+ * One image per marker, <prefix>_<id>.<format>. The markers are rendered and encoded in parallel,
+ * every thread drawing into its own image, and listed in <prefix>_manifest.csv.
+ */
+bool writeMarkerImages(const GeneratorOptions& options, const Ptr<aruco::Dictionary>& dictionary, const vector<int>& ids)
+{
+    vector<int> parameters = imageWriteParameters(options.format);
+    atomic<int> failures(0);
+
+    parallel_for_(Range(0, int(ids.size())), [&](const Range& range)
+    {
+        Mat outputMarker;
+
+        for(int i = range.start; i < range.end; i++)
+        {
+            aruco::drawMarker(dictionary, ids[i], options.markerPixels, outputMarker, options.borderBits);
+
+            if(!imwrite(markerFileName(options, to_string(ids[i])), outputMarker, parameters))
+                failures++;
+        }
+    });
+
+    if(failures.load() > 0)
+    {
+        cerr << "Could not write " << failures.load() << " marker images to " << options.outputDirectory << endl;
+        return false;
+    }
+
+    string manifestName = options.outputDirectory + "/" + options.prefix + "_manifest.csv";
+    ofstream manifest(manifestName);
+    if(!manifest)
+    {
+        cerr << "Could not write " << manifestName << endl;
+        return false;
+    }
+
+    manifest << "id,file,dictionary,size_px,border_bits" << endl;
+    for(size_t i = 0; i < ids.size(); i++)
+    {
+        manifest << ids[i] << "," << options.prefix << "_" << ids[i] << "." << options.format << "," << options.dictionary << ","
+                 << options.markerPixels << "," << options.borderBits << endl;
+    }
+
+    return true;
+}
+
+/*
+ * Places the markers row by row on as many sheets as they need. Positions are rounded to whole
+ * pixels at the chosen DPI, the millimeters in the placements are those of the rounded pixels so
+ * they match the printed sheet exactly.
+ */
+bool layoutAtlas(const GeneratorOptions& options, const vector<int>& ids, vector<AtlasPlacement>& placements, int& sheetCount, Size& sheetPixels)
+{
+    double pixelsPerMillimeter = options.dpi / 25.4;
+
+    sheetPixels = Size(int(round(options.pageWidth * pixelsPerMillimeter)), int(round(options.pageHeight * pixelsPerMillimeter)));
+    int marginPixels = int(round(options.margin * pixelsPerMillimeter));
+    int spacingPixels = int(round(options.spacing * pixelsPerMillimeter));
+    int markerPixels = int(round(options.markerSide * pixelsPerMillimeter));
+
+    int columns = (sheetPixels.width - 2 * marginPixels + spacingPixels) / max(1, markerPixels + spacingPixels);
+    int rows = (sheetPixels.height - 2 * marginPixels + spacingPixels) / max(1, markerPixels + spacingPixels);
+
+    if(markerPixels <= 0 || columns <= 0 || rows <= 0)
+    {
+        cerr << "A " << options.markerSide << " mm marker does not fit on a " << options.pageWidth << "x" << options.pageHeight
+             << " mm page with " << options.margin << " mm margins" << endl;
+        return false;
+    }
+
+    int perSheet = columns * rows;
+    sheetCount = int((ids.size() + perSheet - 1) / perSheet);
+
+    placements.resize(ids.size());
+    for(size_t i = 0; i < ids.size(); i++)
+    {
+        int slot = int(i) % perSheet;
+
+        AtlasPlacement& placement = placements[i];
+        placement.sheet = int(i) / perSheet;
+        placement.id = ids[i];
+        placement.pixels = Rect(marginPixels + (slot % columns) * (markerPixels + spacingPixels),
+                                marginPixels + (slot / columns) * (markerPixels + spacingPixels), markerPixels, markerPixels);
+        placement.x = placement.pixels.x / pixelsPerMillimeter;
+        placement.y = placement.pixels.y / pixelsPerMillimeter;
+        placement.side = markerPixels / pixelsPerMillimeter;
+    }
+
+    return true;
+}
+
+/*
+ * Printable sheets <prefix>_sheet<n>.<format>, rendered and encoded in parallel, one sheet per task.
+ * <prefix>_atlas.csv lists where every marker is, in pixels and millimeters. Every sheet also gets
+ * <prefix>_sheet<n>_layout.txt with the 3D corners of its markers in meters, x to the right, y up and
+ * z out of the sheet from its top left corner, which the tracker reads as a rigid board.
+ */
+bool writeAtlas(const GeneratorOptions& options, const Ptr<aruco::Dictionary>& dictionary, const vector<int>& ids)
+{
+    vector<AtlasPlacement> placements;
+    int sheetCount = 0;
+    Size sheetPixels;
+    if(!layoutAtlas(options, ids, placements, sheetCount, sheetPixels))
+        return false;
+
+    vector<int> parameters = imageWriteParameters(options.format);
+    atomic<int> failures(0);
+
+    parallel_for_(Range(0, sheetCount), [&](const Range& range)
+    {
+        Mat sheet, outputMarker;
+
+        for(int s = range.start; s < range.end; s++)
+        {
+            sheet.create(sheetPixels, CV_8UC1);
+            sheet.setTo(Scalar::all(255));
+
+            ostringstream layoutName;
+            layoutName << options.outputDirectory << "/" << options.prefix << "_sheet" << s << "_layout.txt";
+            ofstream layout(layoutName.str());
+            layout << "# " << options.dictionary << " markers of sheet " << s << ": id, then the 4 corners x y z in meters" << endl;
+            layout << setprecision(9);
+
+            for(size_t i = 0; i < placements.size(); i++)
+            {
+                const AtlasPlacement& placement = placements[i];
+                if(placement.sheet != s)
+                    continue;
+
+                aruco::drawMarker(dictionary, placement.id, placement.pixels.width, outputMarker, options.borderBits);
+                outputMarker.copyTo(sheet(placement.pixels));
+
+                // Top left, top right, bottom right, bottom left, the order the detector returns the corners in
+                double left = placement.x * 1e-3, top = -placement.y * 1e-3, side = placement.side * 1e-3;
+                layout << placement.id << "  " << left << " " << top << " 0  " << left + side << " " << top << " 0  "
+                       << left + side << " " << top - side << " 0  " << left << " " << top - side << " 0" << endl;
+            }
+
+            ostringstream sheetName;
+            sheetName << "sheet" << s;
+            if(!imwrite(markerFileName(options, sheetName.str()), sheet, parameters) || !layout)
+                failures++;
+        }
+    });
+
+    if(failures.load() > 0)
+    {
+        cerr << "Could not write " << failures.load() << " atlas sheets to " << options.outputDirectory << endl;
+        return false;
+    }
+
+    string manifestName = options.outputDirectory + "/" + options.prefix + "_atlas.csv";
+    ofstream manifest(manifestName);
+    if(!manifest)
+    {
+        cerr << "Could not write " << manifestName << endl;
+        return false;
+    }
+
+    manifest << "sheet,id,x_px,y_px,size_px,x_mm,y_mm,size_mm,dpi" << endl;
+    manifest << fixed << setprecision(3);
+    for(size_t i = 0; i < placements.size(); i++)
+    {
+        const AtlasPlacement& placement = placements[i];
+        manifest << placement.sheet << "," << placement.id << "," << placement.pixels.x << "," << placement.pixels.y << ","
+                 << placement.pixels.width << "," << placement.x << "," << placement.y << "," << placement.side << "," << options.dpi << endl;
+    }
+
+    cout << sheetCount << " sheets of " << sheetPixels.width << "x" << sheetPixels.height << " pixels at " << options.dpi << " dpi" << endl;
+    return true;
+}
+
+/*
+ * Command line:
+ *   --dictionary <name>   any predefined dictionary, DICT_4X4_50 ... DICT_7X7_1000, DICT_ARUCO_ORIGINAL
+ *                         or DICT_APRILTAG_16h5/25h9/36h10/36h11 (DICT_4X4_50)
+ *   --ids <first>-<last>  range of marker ids (the whole dictionary)
+ *   --size <pixels>       side of a marker image (500)
+ *   --border-bits <n>     width of the black border in cells (1)
+ *   --format <name>       png or pgm, both lossless, or jpg (png)
+ *   --output <directory>  where the files go (.)
+ *   --prefix <name>       file name prefix (<n>x<n>Marker)
+ *   --threads <n>         rendering and encoding threads (all the cores)
+ *   --atlas               printable sheets instead of one image per marker, with:
+ *   --page <w>x<h>        sheet size in millimeters (210x297)
+ *   --dpi <n>             printer resolution (300)
+ *   --margin <mm>         between the sheet edge and the markers (10)
+ *   --spacing <mm>        between two markers (5)
+ *   --marker-size <mm>    printed side of a marker (50)
+ */
+bool parseGeneratorOptions(int argc, char **argv, GeneratorOptions& options)
+{
+    for(int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if(arg == "--dictionary" && hasValue)
+            options.dictionary = argv[++i];
+        else if(arg == "--ids" && hasValue && sscanf(argv[i + 1], "%d-%d", &options.firstId, &options.lastId) == 2)
+            i++;
+        else if(arg == "--size" && hasValue)
+            options.markerPixels = atoi(argv[++i]);
+        else if(arg == "--border-bits" && hasValue)
+            options.borderBits = atoi(argv[++i]);
+        else if(arg == "--format" && hasValue)
+            options.format = argv[++i];
+        else if(arg == "--output" && hasValue)
+            options.outputDirectory = argv[++i];
+        else if(arg == "--prefix" && hasValue)
+            options.prefix = argv[++i];
+        else if(arg == "--threads" && hasValue)
+            options.threads = atoi(argv[++i]);
+        else if(arg == "--atlas")
+            options.atlas = true;
+        else if(arg == "--page" && hasValue && sscanf(argv[i + 1], "%lfx%lf", &options.pageWidth, &options.pageHeight) == 2)
+            i++;
+        else if(arg == "--dpi" && hasValue)
+            options.dpi = atof(argv[++i]);
+        else if(arg == "--margin" && hasValue)
+            options.margin = atof(argv[++i]);
+        else if(arg == "--spacing" && hasValue)
+            options.spacing = atof(argv[++i]);
+        else if(arg == "--marker-size" && hasValue)
+            options.markerSide = atof(argv[++i]);
+        else
+        {
+            cerr << "Unknown or incomplete option " << arg << endl;
+            return false;
+        }
+    }
+
+    if(options.format != "png" && options.format != "pgm" && options.format != "jpg")
+    {
+        cerr << "The format must be png, pgm or jpg" << endl;
+        return false;
+    }
+
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    GeneratorOptions options;
+    if(!parseGeneratorOptions(argc, argv, options))
+        return 1;
+
+    Ptr<aruco::Dictionary> dictionary;
+    if(!dictionaryFromName(options.dictionary, dictionary))
+        return 1;
+
+    int markerCount = dictionary->bytesList.rows;
+    if(options.lastId < 0)
+        options.lastId = markerCount - 1;
+
+    if(options.firstId < 0 || options.lastId >= markerCount || options.firstId > options.lastId)
+    {
+        cerr << options.dictionary << " has the ids 0 to " << markerCount - 1 << endl;
+        return 1;
+    }
+
+    if(options.prefix.empty())
+        options.prefix = to_string(dictionary->markerSize) + "x" + to_string(dictionary->markerSize) + "Marker";
+
+    if(options.threads > 0)
+        setNumThreads(options.threads);
+
+    vector<int> ids;
+    for(int id = options.firstId; id <= options.lastId; id++)
+        ids.push_back(id);
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    bool written = options.atlas ? writeAtlas(options, dictionary, ids) : writeMarkerImages(options, dictionary, ids);
+    if(!written)
+        return 1;
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << ids.size() << " " << options.dictionary << " markers written to " << options.outputDirectory << " in "
+         << fixed << setprecision(2) << seconds << " s" << endl;
+
+    return 0;
+}
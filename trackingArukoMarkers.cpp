@@ -3,207 +3,6188 @@
 #include "opencv2/calib3d.hpp"
 #include "opencv2/imgcodecs.hpp"
 #include "opencv2/imgproc.hpp"
+#include "opencv2/video.hpp"
 
 #include <sstream>
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <atomic>
+#include <thread>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <cstdint>
+#include <cfloat>
+#include <type_traits>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <new>
+#include <csignal>
+#include <cstddef>
+#include <cerrno>
+
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 using namespace std;
 using namespace cv;
 
+/*
+ * Heap allocation counting for --count-allocations. operator new is replaced for the whole program
+ * and the Mat buffers, which OpenCV does not take from operator new, are counted by a MatAllocator
+ * installed as the default one. Until startAllocationCounting the hooks only test a flag.
+ * Threads that only feed or show the frames (capture, preview, pose stream) mark themselves as
+ * background threads, the allocations of the others are the ones a frame's marks are taken from.
+ */
+atomic<bool> allocationCounting(false);
+atomic<size_t> heapAllocations(0);
+atomic<size_t> matAllocations(0);
+atomic<size_t> frameAllocations(0);
+thread_local bool backgroundThread = false;
+
+inline void countAllocation(atomic<size_t>& total)
+{
+    total.fetch_add(1, memory_order_relaxed);
+    if(!backgroundThread)
+        frameAllocations.fetch_add(1, memory_order_relaxed);
+}
+
+void* operator new(size_t size)
+{
+    if(allocationCounting.load(memory_order_relaxed))
+        countAllocation(heapAllocations);
+
+    void* memory = malloc(size == 0 ? 1 : size);
+    if(memory == NULL)
+        throw bad_alloc();
+
+    return memory;
+}
+
+void operator delete(void* memory) noexcept
+{
+    free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept
+{
+    free(memory);
+}
+
+// Hands every request to OpenCV's standard allocator, counting the ones that need new memory
+class CountingMatAllocator : public MatAllocator
+{
+public:
+    UMatData* allocate(int dims, const int* sizes, int type, void* data, size_t* step, int flags, UMatUsageFlags usageFlags) const
+    {
+        if(data == NULL)
+            countAllocation(matAllocations);
+
+        return Mat::getStdAllocator()->allocate(dims, sizes, type, data, step, flags, usageFlags);
+    }
+
+    bool allocate(UMatData* data, int accessFlags, UMatUsageFlags usageFlags) const
+    {
+        return Mat::getStdAllocator()->allocate(data, accessFlags, usageFlags);
+    }
+
+    void deallocate(UMatData* data) const
+    {
+        Mat::getStdAllocator()->deallocate(data);
+    }
+};
+
+// Allocations of the threads that are not background threads, heap and Mat buffers together
+inline size_t allocationCount()
+{
+    return frameAllocations.load(memory_order_relaxed);
+}
+
 const float calibrationSquareDimension = 0.01905f; // meters
 const float arucoSquareDimension = 0.1016f;
 const Size chessboardDimensions = Size(6,9);
 bool saveCameraCalibration(string name, Mat cameraMatrix, Mat distanceCoeffients);
 void createArucoMarkers();
 void createKnownBoardPosition(Size boardSize, float squareEdgeLength, vector<Point3f>& corners);
-void getChessboardCorners(vector<Mat> images, vector<vector<Point2f>>& allFoundCorners, bool showResult );
-void cameraCalibration(vector<Mat> calibrationImages, Size boardSize, float squareEdgeLength, Mat& cameraMatrix, Mat& distanceCoefficients );
+struct ChessboardDetection;
+void getChessboardCorners(const vector<Mat>& images, Size boardSize, vector<vector<Point2f>>& allFoundCorners, vector<ChessboardDetection>& detections, bool showResult );
+void printChessboardDetections(const vector<ChessboardDetection>& detections);
+bool findChessboardCornersScaled(const Mat& gray, Size boardSize, int searchWidth, Mat& small, vector<Point2f>& corners);
+bool cameraCalibration(const vector<Mat>& calibrationImages, Size boardSize, float squareEdgeLength, Mat& cameraMatrix, Mat& distanceCoefficients );
 void cameraCalibrationProcess(Mat& cameraMatrix, Mat& distanceCoefficients);
+struct IncrementalCalibration;
+bool addCalibrationKeyframe(IncrementalCalibration& calibration, const vector<Point2f>& corners);
+void solveIncrementalCalibration(IncrementalCalibration& calibration);
+void drawCalibrationStatus(Mat& frame, const IncrementalCalibration& calibration);
 bool loadCameraCalibration(string name, Mat& cameraMatrix, Mat& distanceCoeffients);
-int startWebCameraMonitoring(const Mat& cameraMatrix, const Mat& distanceCoefficients, float arucoSquareDimensions);
 
-// This function will print 50 aruco markers
-void createArucoMarkers()
+/*
+ * Binary calibration file, written by saveCameraCalibrationBinary and memory mapped by
+ * mapCameraCalibration. All values are stored in the machine's byte order. The header is followed by
+ * the undistortion maps of initUndistortRectifyMap in remap's fast fixed point form, each starting
+ * on a 64 byte boundary. Readers reject any other version.
+ */
+const char calibrationFileMagic[8] = { 'A', 'R', 'U', 'C', 'A', 'L', 'I', 'B' };
+const uint32_t calibrationFileVersion = 1;
+
+struct CalibrationFileHeader
 {
-    // We initialize the output image and the markers ( 50 different markers)
-    Mat outputMarker;
-    Ptr<aruco::Dictionary> markerDictionary = aruco::getPredefinedDictionary(aruco::PREDEFINED_DICTIONARY_NAME::DICT_4X4_50);
+    char magic[8];
+    uint32_t version;
+    uint32_t headerBytes;
+    int32_t width, height;              // resolution the maps were built for
+    double cameraMatrix[9];
+    int32_t distortionCount;
+    int32_t reserved;
+    double distortion[14];
+    uint64_t mapOffset, mapBytes;                       // CV_16SC2, integer source pixel of every pixel
+    uint64_t interpolationOffset, interpolationBytes;   // CV_16UC1, fractional part as remap's table index
+};
+
+// A calibration as mapped from a binary file, the Mats point into the mapping that storage keeps alive
+struct CameraCalibration
+{
+    Size resolution;
+    Mat cameraMatrix, distanceCoefficients;
+    Mat undistortMap, undistortInterpolation;
+    shared_ptr<void> storage;
+};
+
+bool saveCameraCalibrationBinary(const string& name, const Mat& cameraMatrix, const Mat& distanceCoefficients, Size resolution);
+bool mapCameraCalibration(const string& name, CameraCalibration& calibration);
+
+// How the pose of each detected marker is computed
+enum PoseEngine
+{
+    POSE_ITERATIVE,         // aruco::estimatePoseSingleMarkers, one iterative solvePnP per marker
+    POSE_BATCHED            // closed-form planar solver (IPPE) for all the markers of a frame together
+};
+
+// Options given on the command line
+struct TrackerOptions
+{
+    string input;           // video file or image directory, empty for the webcam
+    bool headless = false;  // no window, no drawing, no frame pacing
+    string timingsFile;     // per-frame timings written as CSV by the headless replay
+    bool pipeline = false;  // run capture, detection, pose and rendering on separate threads
+    int detectionWorkers = 2;
+    int queueDepth = 8;     // frames each pipeline queue holds before the stage in front of it waits
+    string detectionMode = "full";
+    int fullSweepInterval = 10;
+    bool verifyDetection = false;
+    int pyramidScale = 0;   // downscale factor of the pyramid mode, 0 picks it per frame
+    int maxMarkerSide = 0;  // pixels, largest marker the tiled mode must find whole in a tile, 0 to follow the markers seen
+    string detector = "aruco";
+    string quadFinder = "runs";     // contours or runs, how the integral detector finds quads
+    PoseEngine poseEngine = POSE_ITERATIVE;
+    bool comparePoseEngines = false;
+    bool benchmark = false; // synthetic scenes from the marker images instead of a camera or a replay
+    int benchmarkFrames = 10;       // frames per resolution, marker count and degradation
+    uint64 benchmarkSeed = 1;
+    vector<string> cameras;         // "source[,calibration file]" per camera of the multi-camera mode
+    string calibrationMode;         // batch or incremental, calibrates the camera instead of tracking
+    string calibrationFile = "CameraCalibrationFile.txt";  // text or binary, binary files are memory mapped
+    bool undistort = false; // remap the frames with the maps of a binary calibration before detection
+    string writeCalibration;        // binary calibration file to write from calibrationFile, then exit
+    Size calibrationResolution = Size(640, 480);    // resolution of the maps written with writeCalibration
+    string metricsFile;     // stage latency histograms exported as JSON, or CSV when the name ends in .csv
+    double metricsInterval = 10.0;  // seconds between two exports while running
+    bool countAllocations = false;  // count the heap allocations of each stage of the live loop
+    bool luma = false;      // capture and detect on the luma channel only, BGR is only built to draw the overlay
+    vector<string> boardLayouts;    // layout files of rigid boards, each posed with one solve over all its markers
+    string streamTarget;    // file, named pipe, udp:<host>:<port> or unix:<path> the poses are streamed to
+    string streamFormat = "ndjson";     // or binary, PoseRecords as they are in memory
+    int streamCapacity = 4096;          // records the stream buffers before dropping the oldest
+    bool preview = true;    // live loop window, drawn on its own thread
+    double previewRate = 0.0;           // frames/s the preview is drawn at, 0 for every new frame the display takes
+};
+
+// How markers are searched for in each frame
+enum DetectionMode
+{
+    DETECT_FULL_FRAME,      // aruco::detectMarkers on the whole frame every time
+    DETECT_ROI_TRACKING,    // only around the markers of the previous frame, with periodic full-frame sweeps
+    DETECT_PYRAMID,         // on a downscaled frame, corners refined at full resolution
+    DETECT_FLOW_TRACKING,   // full detection every few frames, optical flow and Kalman filters in between
+    DETECT_TILED            // overlapping tiles of the frame detected in parallel
+};
+
+// What finds the markers inside the image a detection mode hands over
+enum MarkerDetectorBackend
+{
+    DETECTOR_ARUCO,         // aruco::detectMarkers
+    DETECTOR_INTEGRAL       // our own pipeline, all adaptive thresholds from one integral image
+};
+
+// How the integral detector finds quads in its thresholded images
+enum QuadFinder
+{
+    QUADS_CONTOURS,         // findContours and approxPolyDP
+    QUADS_RUNS              // run-length encoded rows joined into components, in parallel row bands
+};
+
+// Pixels [start, end) of one row that are set in a binary image
+struct PixelRun
+{
+    int y, start, end;
+};
+
+// Scratch of the run-length quad finder that its threads fill band by band, owned by the caller
+struct RunBands
+{
+    vector<vector<PixelRun>> runs;
+    vector<vector<int>> parents;
+    vector<int> rowFirst;           // index of the first run of each row
+};
+
+// Quad candidates of a frame, the corner vectors stay allocated from frame to frame and count says how many are in use
+struct QuadCandidates
+{
+    vector<vector<Point2f>> corners;
+    vector<int> perimeters;
+    vector<uchar> removed;          // scratch of filterTooCloseCandidates
+    size_t count = 0;
+
+    void add(const vector<Point2f>& quad, int perimeter);
+};
+
+// Bit pattern lookup of the integral detector, one per marker size
+template <int MarkerSize, int MaxCorrection = 1, bool Direct = (MarkerSize * MarkerSize <= 16)>
+class BitDecoder;
+
+// A marker followed by the flow mode between two detections
+struct MarkerTrack
+{
+    int id = -1;
+    vector<Point2f> corners;
+    KalmanFilter filter;            // constant velocity model of the four corners
+};
+
+// Detection settings and whatever a tracking mode carries from one frame to the next
+struct MarkerTracker
+{
+    DetectionMode mode = DETECT_FULL_FRAME;
+    MarkerDetectorBackend detector = DETECTOR_ARUCO;
+    QuadFinder quadFinder = QUADS_RUNS;
+    Ptr<aruco::Dictionary> dictionary;
+    Ptr<aruco::DetectorParameters> parameters;
+
+    // Set for the marker size of the dictionary when the integral detector is used, shared by the copies of a tracker
+    shared_ptr<const BitDecoder<4>> decoder4x4;
+    shared_ptr<const BitDecoder<5>> decoder5x5;
+    shared_ptr<const BitDecoder<6>> decoder6x6;
+
+    int fullSweepInterval = 10;     // frames between two full-frame sweeps of the ROI mode
+    float roiPadding = 0.5f;        // ROI margin around a marker, as a fraction of its size
+    int minRoiPadding = 16;         // pixels
+
+    int pyramidScale = 0;           // 1, 2 or 4, 0 chooses from the recent marker sizes
+    int maxPyramidScale = 4;
+    float minScaledMarkerSide = 28.0f;  // pixels a marker side keeps at the chosen scale, enough for the 6x6 cells
+
+    int maxMarkerSide = 0;          // pixels, tiles overlap by this much, 0 to follow the largest marker seen lately
+    int defaultMaxMarkerSide = 256; // pixels, the overlap never gets smaller, at most a quarter of the frame's shorter side
+
+    size_t frameIndex = 0;
+    vector<int> lastIds;
+    vector<vector<Point2f>> lastCorners;
+    float recentMarkerSide = 0.0f;  // smoothed smallest marker side of the last frames, 0 when unknown
+    float recentLargestMarkerSide = 0.0f;   // the same for the largest side, followed by the tiled mode
+    size_t framesWithoutMarkers = 0;
+    Mat gray, scaledGray;
+    Mat colorGray;                  // grey copy of a colour frame given to the integral detector
+    Mat integralImage;
+    vector<Mat> thresholdImages;
+    RunBands runBands;
+    vector<int> windowSizes;
+    vector<QuadCandidates> windowCandidates;    // per thresholded image
+    QuadCandidates candidates;      // of all the thresholded images
+    vector<int> candidateIds;
+    vector<vector<Point2f>> spareCorners;       // corner vectors of markers the last frames no longer had
+
+    // Flow mode
+    vector<MarkerTrack> tracks;
+    Mat previousGray;
+    vector<Point2f> flowFrom, flowTo;
+    vector<uchar> flowStatus;
+    vector<float> flowErrors;
+
+    // Tiled mode, per tile
+    vector<Rect> tileCores;
+    vector<Rect> tileRects;         // the cores grown by the overlap, what each tile searches
+    vector<MarkerTracker> tileTrackers;     // detection settings and scratch, one thread at a time uses a tile's
+    vector<vector<vector<Point2f>>> tileCorners;
+    vector<vector<int>> tileIds;
+
+    // Statistics
+    size_t roiFrames = 0;
+    size_t scheduledSweeps = 0;
+    size_t lostMarkerSweeps = 0;
+    size_t framesPerScale[5] = { 0, 0, 0, 0, 0 };
+    size_t flowFrames = 0;
+    size_t earlyDetections = 0;     // detections a lost or unverified track brought forward
+    size_t lostTracks = 0;
+    size_t unverifiedTracks = 0;
+    size_t tiledFrames = 0;
+    size_t tiledSweeps = 0;         // frames the tiled mode searched whole
+    size_t tilesSearched = 0;
+    size_t seamDuplicates = 0;      // markers found by a tile other than the one whose core holds their centre
+    Size tileGrid;                  // columns and rows of the last tiled frame
+    int tileOverlap = 0;            // pixels, of the last tiled frame
+    double tiledPixels = 0.0;       // pixels of the tiled frames
+    double searchedPixels = 0.0;    // pixels of their tiles, the overlaps counted by every tile searching them
+};
+
+// The corners of all the markers of a frame for the batched pose solver, one array per quantity
+struct PlanarPoseBatch
+{
+    size_t count = 0;
+    vector<double> u[4], v[4];      // undistorted normalized coordinates of corner 0..3 of each marker
+    vector<double> rotation[2];     // both IPPE solutions, entry k of marker i's row-major rotation at k * count + i
+    vector<double> translation[2][3];
+    vector<double> error[2];        // squared reprojection error of each solution
+
+    void resize(size_t markers);
+};
+
+// Stages of a frame whose latency is recorded
+enum MetricsStage
+{
+    STAGE_CAPTURE,
+    STAGE_DETECT,
+    STAGE_POSE,
+    STAGE_DRAW,
+    STAGE_DISPLAY,
+    STAGE_TOTAL,            // whole loop iteration, or capture to displayed for the pipeline
+    STAGE_AGE,              // capture to pose of the live loop, including the wait for the detection thread
+    STAGE_COUNT
+};
+
+struct StageMetrics;
+
+// Allocations per stage of the live loop, counted once the first frames have sized the buffers
+struct AllocationStats
+{
+    bool enabled = false;
+    size_t warmupFrames = 30;
+    size_t seenFrames = 0;
+    size_t frames = 0;
+    size_t framesWithAllocations = 0;
+    size_t maxPerFrame = 0;
+    size_t firstAllocatingFrame = 0;
+    size_t heapAtStart = 0, matAtStart = 0;
+    size_t perStage[STAGE_COUNT] = {};
+    bool expectNone = false;        // every call of the frame path is code of this tree that reuses its buffers
+};
+
+// A view kept by the incremental calibration: the refined board corners and the board pose of the last solve
+struct CalibrationKeyframe
+{
+    vector<Point2f> corners;
+    Vec3d rotation, translation;
+};
+
+/*
+ * State of the incremental calibration. Only the corners of the keyframes are kept, never the frames,
+ * and every solve starts from the intrinsics of the previous one.
+ */
+struct IncrementalCalibration
+{
+    Size boardSize;
+    Size imageSize;
+    vector<Point3f> boardPoints;
+
+    vector<CalibrationKeyframe> keyframes;
+    vector<Point2f> previousCorners;        // board of the previous frame, keyframes are only taken of a steady board
+
+    // Image split into cells, a cell is covered once a keyframe has a corner in it
+    int coverageColumns = 8, coverageRows = 6;
+    vector<bool> coveredCells;
+
+    int minKeyframes = 4;                   // views before the first solve
+    double maxCornerMotion = 1.5;           // pixels a corner may move between two frames for the board to count as steady
+    double minRotationChange = 10.0;        // degrees, a pose closer than this and minTranslationChange to a keyframe adds nothing
+    double minTranslationChange = 0.15;     // relative to the keyframe's distance
+    double minCornerShift = 0.05;           // of the image diagonal, compared instead of poses before the first solve
+
+    bool calibrated = false;
+    Mat cameraMatrix, distanceCoefficients;
+    double reprojectionError = 0.0;
+    double solveMilliseconds = 0.0;
+    string lastDecision;
+};
+
+// Outcome of the chessboard search in one calibration image
+struct ChessboardDetection
+{
+    bool found = false;
+    string rejectReason;            // empty when found
+    double milliseconds = 0.0;
+    vector<Point2f> corners;        // refined to sub-pixel accuracy when found
+};
+
+// A marker placed in a synthetic scene, with the corners and pose it was rendered with
+struct SyntheticMarker
+{
+    int id = -1;
+    vector<Point2f> corners;
+    Vec3d rotation, translation;
+};
+
+// Running comparison of the two pose engines on the same corners
+struct PoseEngineComparison
+{
+    vector<double> iterativeTimes, batchedTimes;    // milliseconds per frame with markers
+    vector<double> angleDifferences;                // degrees per marker
+    vector<double> translationDifferences;          // relative to the marker's distance, per marker
+};
+
+/*
+ * Markers fixed to one rigid object, from a layout file. All the corners of its markers in view go
+ * into one solvePnP, started from the pose of the previous frame when there is one.
+ */
+struct MarkerBoard
+{
+    string name;
+    map<int, int> markerIndex;      // marker id -> index of its first corner / 4
+    vector<Point3f> corners;        // 4 per marker, meters in the board's frame
+
+    bool hasPose = false;           // posed in the previous frame, its pose starts the next solve
+    Vec3d rotation, translation;
+    double maxReprojectionError = 3.0;  // pixels, worse solves are retried without the previous pose, then rejected
+
+    // Correspondences of the current frame, kept so their capacity is reused
+    vector<Point3f> objectPoints;
+    vector<Point2f> imagePoints, projectedPoints;
+
+    // Statistics
+    size_t frames = 0;
+    size_t posedFrames = 0;
+    size_t warmStarts = 0;
+    size_t coldRetries = 0;
+    size_t markersUsed = 0;
+    double errorSum = 0.0;
+};
+
+/*
+ * One streamed marker pose. The binary stream writes these as they are: fixed size fields in the
+ * machine's byte order, no padding, 104 bytes per record.
+ */
+struct PoseRecord
+{
+    uint64_t timestamp;         // microseconds of the monotonic clock when the frame was captured
+    uint64_t age;               // microseconds from the capture to the pose
+    uint32_t cameraId;
+    int32_t markerId;
+    double rotation[3];         // Rodrigues vector
+    double translation[3];      // meters
+    float corners[8];           // x, y of corner 0 to 3 in pixels
+};
+static_assert(sizeof(PoseRecord) == 104, "the binary pose record has no padding");
+static_assert(sizeof(PoseRecord) % sizeof(uint64_t) == 0, "the pose ring copies records as whole words");
+
+int startWebCameraMonitoring(const Mat& cameraMatrix, const Mat& distanceCoefficients, float arucoSquareDimensions, const TrackerOptions& options);
+bool parseTrackerOptions(int argc, char **argv, TrackerOptions& options);
+int startHeadlessReplay(const TrackerOptions& options, const Mat& cameraMatrix, const Mat& distanceCoefficients, float arucoSquareDimensions);
+void printTimingSummary(const string& label, vector<double> samples);
+int startTrackingPipeline(const TrackerOptions& options, const Mat& cameraMatrix, const Mat& distanceCoefficients, float arucoSquareDimensions);
+bool createMarkerTracker(const TrackerOptions& options, MarkerTracker& tracker);
+void detectTrackedMarkers(const Mat& frame, MarkerTracker& tracker, vector<vector<Point2f>>& markerCorners, vector<int>& markerIds);
+void detectMarkersInRegions(const Mat& frame, MarkerTracker& tracker, const vector<Rect>& regions, vector<vector<Point2f>>& markerCorners, vector<int>& markerIds);
+void detectMarkersInTiles(const Mat& frame, MarkerTracker& tracker, vector<vector<Point2f>>& markerCorners, vector<int>& markerIds);
+void followLargestMarkerSide(MarkerTracker& tracker, const vector<vector<Point2f>>& markerCorners);
+vector<Rect> predictMarkerRegions(const MarkerTracker& tracker, Size frameSize);
+void printTrackerStatistics(const MarkerTracker& tracker);
+void detectMarkersCoarseToFine(const Mat& frame, MarkerTracker& tracker, vector<vector<Point2f>>& markerCorners, vector<int>& markerIds);
+int choosePyramidScale(const MarkerTracker& tracker);
+bool sameMarkerIds(vector<int> first, vector<int> second);
+void detectMarkersWithFlow(const Mat& frame, MarkerTracker& tracker, vector<vector<Point2f>>& markerCorners, vector<int>& markerIds);
+bool trackMarkersWithFlow(MarkerTracker& tracker, vector<vector<Point2f>>& markerCorners, vector<int>& markerIds);
+void updateMarkerTracks(MarkerTracker& tracker, const vector<vector<Point2f>>& markerCorners, const vector<int>& markerIds);
+void runMarkerDetector(const Mat& image, MarkerTracker& tracker, vector<vector<Point2f>>& markerCorners, vector<int>& markerIds);
+void detectMarkersIntegral(const Mat& image, MarkerTracker& tracker, vector<vector<Point2f>>& markerCorners, vector<int>& markerIds);
+void adaptiveThresholdFromIntegral(const Mat& gray, const Mat& integralImage, const vector<int>& windowSizes, double constant, vector<Mat>& thresholdImages);
+void thresholdRowFromIntegral(const uchar* src, uchar* dst, const unsigned* top, const unsigned* bottom, int cols, int radius, int windowRows, int constant);
+void findQuadCandidates(const Mat& binary, const aruco::DetectorParameters& params, QuadCandidates& candidates);
+bool acceptQuadCandidate(const vector<Point>& approxCurve, double contourLength, Size imageSize, const aruco::DetectorParameters& params, vector<Point2f>& quad);
+void encodeRowRuns(const uchar* row, int cols, int y, vector<PixelRun>& runs);
+void joinRowRuns(const vector<PixelRun>& runs, vector<int>& parent, int aboveFirst, int aboveEnd, int rowFirst, int rowEnd);
+void convexHullOfSortedPoints(const vector<Point>& points, vector<Point>& hull);
+int outerAreaBound(const vector<PixelRun>& runs, const int* componentRuns, int count, const Rect& box, vector<int>& columnTop, vector<int>& columnBottom);
+void findQuadCandidatesFromRuns(const Mat& binary, const aruco::DetectorParameters& params, RunBands& bands, QuadCandidates& candidates);
+void filterTooCloseCandidates(QuadCandidates& candidates, double minMarkerDistanceRate);
+void resizeCornerList(vector<vector<Point2f>>& corners, size_t size, vector<vector<Point2f>>& spare);
+bool identifyCandidate(const Mat& gray, const MarkerTracker& tracker, const aruco::DetectorParameters& params, vector<Point2f>& corners, int& id);
+void identifyCandidates(const Mat& gray, const MarkerTracker& tracker, const aruco::DetectorParameters& params, vector<Point2f>* candidates, int count, int* ids);
+void sampleCandidateCells(const Mat& gray, const Matx33f& squareToFrame, int sizeWithBorders, uchar* cells);
+bool classifyCells(const uchar* cells, int cellCount, double minStdDev, Mat& bits);
+Matx33d squareToQuadHomography(const Point2f* quad, double side);
+void createBitDecoder(MarkerTracker& tracker);
+bool decodeMarkerBits(const MarkerTracker& tracker, const Mat& innerBits, double errorCorrectionRate, int& id, int& rotation);
+void estimateMarkerPoses(const vector<vector<Point2f>>& markerCorners, float markerLength, const Mat& cameraMatrix, const Mat& distanceCoefficients, PoseEngine engine, vector<Vec3d>& rotationVectors, vector<Vec3d>& translationVectors);
+void estimatePosesBatched(const vector<vector<Point2f>>& markerCorners, float markerLength, const Mat& cameraMatrix, const Mat& distanceCoefficients, vector<Vec3d>& rotationVectors, vector<Vec3d>& translationVectors);
+void solvePlanarPoses(PlanarPoseBatch& batch, double halfLength);
+Vec3d rotationMatrixToVector(const double* R);
+void startStageMetrics(const TrackerOptions& options, StageMetrics& metrics);
+inline void recordStage(StageMetrics& metrics, MetricsStage stage, chrono::steady_clock::time_point start, chrono::steady_clock::time_point end);
+void exportStageMetricsIfDue(StageMetrics& metrics);
+bool exportStageMetrics(const StageMetrics& metrics);
+void printStageMetrics(const StageMetrics& metrics);
+void startAllocationCounting(const TrackerOptions& options, AllocationStats& stats);
+void recordFrameAllocations(AllocationStats& stats, const size_t* marks);
+void printAllocationStats(const AllocationStats& stats);
+int startSyntheticBenchmark(const TrackerOptions& options, float arucoSquareDimensions);
+int startMultiCameraTracking(const TrackerOptions& options, float arucoSquareDimensions);
+void detectCameraFrame(void* context);
+int startIncrementalCalibration(const TrackerOptions& options, Mat& cameraMatrix, Mat& distanceCoefficients);
+bool loadMarkerImages(const string& directory, vector<Mat>& markerImages);
+void renderSyntheticScene(const vector<Mat>& markerImages, Size resolution, int markerCount, const string& degradation, const Mat& cameraMatrix, float markerLength, RNG& rng, Mat& frame, vector<SyntheticMarker>& truth);
+double rotationAngleBetween(const Vec3d& first, const Vec3d& second);
+void comparePoseEngines(const vector<vector<Point2f>>& markerCorners, float markerLength, const Mat& cameraMatrix, const Mat& distanceCoefficients, PoseEngineComparison& comparison);
+void printPoseEngineComparison(const PoseEngineComparison& comparison);
+bool loadBoardLayout(const string& name, MarkerBoard& board);
+bool loadBoardLayouts(const TrackerOptions& options, vector<MarkerBoard>& boards);
+void estimateBoardPoses(const vector<vector<Point2f>>& markerCorners, const vector<int>& markerIds, const Mat& cameraMatrix, const Mat& distanceCoefficients,
+                        vector<MarkerBoard>& boards, vector<vector<Point2f>>& looseCorners, vector<int>& looseIds);
+double boardReprojectionError(MarkerBoard& board, const Mat& cameraMatrix, const Mat& distanceCoefficients);
+void printBoardStatistics(const vector<MarkerBoard>& boards);
+
+// The frame to draw over: a colour frame itself, a luma frame converted into color, only when something is shown
+inline Mat& overlayFrame(Mat& frame, Mat& color)
+{
+    if(frame.channels() == 3)
+        return frame;
+
+    cvtColor(frame, color, COLOR_GRAY2BGR);
+    return color;
+}
+
+// Spins first, then yields, then sleeps, for threads polling a lock-free queue
+inline void waitBriefly(int& spins)
+{
+    if(spins < 64)
+        spins++;
+    else if(spins < 128)
+    {
+        spins++;
+        this_thread::yield();
+    }
+    else
+        this_thread::sleep_for(chrono::microseconds(100));
+}
+
+// A lambda as a loop body, parallel_for_ would wrap it into a std::function that allocates once the captures outgrow it
+template<typename Body>
+class LambdaLoopBody : public ParallelLoopBody
+{
+public:
+    explicit LambdaLoopBody(const Body& body) : body(body) {}
+
+    void operator()(const Range& range) const { body(range); }
+
+private:
+    Body body;
+};
+
+template<typename Body>
+inline void parallelFor(const Range& range, const Body& body)
+{
+    parallel_for_(range, LambdaLoopBody<Body>(body));
+}
+
+// Reads frames from a webcam, a video file or a directory of images
+class FrameSource
+{
+public:
+    bool open(const string& input);
+    bool read(Mat& frame);
+
+    // Frames come out undistorted with the maps of a binary calibration file
+    bool undistortWith(const string& calibrationFile);
+
+    // Frames come out as a single 8-bit luma channel, call after open
+    void lumaOnly();
+
+    // A live camera, whose frames go stale when they are not taken in time
+    bool isCamera() const { return camera; }
+
+private:
+    bool readFrame(Mat& frame);
+    bool extractLuma(const Mat& raw, Mat& frame);
+
+    // Layout of the raw camera data in luma mode, RAW_BGR when the capture converts to BGR
+    enum RawFormat { RAW_BGR, RAW_YUYV, RAW_NV12, RAW_MJPEG };
+
+    VideoCapture vid;
+    vector<String> imageFiles;
+    size_t nextImage = 0;
+    bool camera = false;
+
+    bool luma = false;
+    RawFormat rawFormat = RAW_BGR;
+    Size rawSize;
+    Mat raw;
+
+    CameraCalibration calibration;
+    Mat distorted;
+};
+
+// Opens the webcam when input is empty or a device index, an image directory when input is a directory and a video file otherwise
+bool FrameSource::open(const string& input)
+{
+    imageFiles.clear();
+    nextImage = 0;
+    camera = input.empty() || input.find_first_not_of("0123456789") == string::npos;
+
+    if(input.empty())
+        return vid.open(0);
+
+    if(camera)
+        return vid.open(atoi(input.c_str()));
+
+    struct stat info;
+    if(stat(input.c_str(), &info) == 0 && S_ISDIR(info.st_mode))
+    {
+        vector<String> files;
+        glob(input + "/*", files, false);
+
+        // Keep only the files imread understands, glob already returns them sorted
+        for(size_t i = 0; i < files.size(); i++)
+        {
+            string extension = files[i].substr(files[i].find_last_of('.') + 1);
+            transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+
+            if(extension == "jpg" || extension == "jpeg" || extension == "png" || extension == "bmp" ||
+               extension == "pgm" || extension == "ppm" || extension == "tif" || extension == "tiff")
+                imageFiles.push_back(files[i]);
+        }
+
+        return !imageFiles.empty();
+    }
+
+    return vid.open(input);
+}
+
+bool FrameSource::readFrame(Mat& frame)
+{
+    if(imageFiles.empty() && !luma)
+        return vid.read(frame);
+
+    if(imageFiles.empty())
+        return vid.read(raw) && extractLuma(raw, frame);
+
+    // Skip the images that fail to decode instead of ending the replay
+    while(nextImage < imageFiles.size())
+    {
+        frame = imread(imageFiles[nextImage++], luma ? IMREAD_GRAYSCALE : IMREAD_COLOR);
+        if(!frame.empty())
+            return true;
+    }
+
+    return false;
+}
+
+bool FrameSource::read(Mat& frame)
+{
+    if(calibration.undistortMap.empty())
+        return readFrame(frame);
+
+    if(!readFrame(distorted))
+        return false;
+
+    if(distorted.size() != calibration.resolution)
+    {
+        cerr << "Frame of " << distorted.cols << "x" << distorted.rows << " but the undistortion maps are for "
+             << calibration.resolution.width << "x" << calibration.resolution.height << endl;
+        return false;
+    }
+
+    remap(distorted, frame, calibration.undistortMap, calibration.undistortInterpolation, INTER_LINEAR);
+    return true;
+}
+
+// Takes the raw data of a camera from now on when it is YUYV, NV12 or MJPEG, frames then come out as one luma channel
+void FrameSource::lumaOnly()
+{
+    luma = true;
+    rawFormat = RAW_BGR;
+
+    if(!camera)
+        return;
+
+    int fourcc = int(vid.get(CAP_PROP_FOURCC));
+    RawFormat format = RAW_BGR;
+    if(fourcc == VideoWriter::fourcc('Y', 'U', 'Y', 'V') || fourcc == VideoWriter::fourcc('Y', 'U', 'Y', '2'))
+        format = RAW_YUYV;
+    else if(fourcc == VideoWriter::fourcc('N', 'V', '1', '2'))
+        format = RAW_NV12;
+    else if(fourcc == VideoWriter::fourcc('M', 'J', 'P', 'G'))
+        format = RAW_MJPEG;
+
+    // Backends that cannot hand over the raw data keep converting to BGR, the luma is then computed from that
+    if(format != RAW_BGR && vid.set(CAP_PROP_CONVERT_RGB, 0))
+    {
+        rawFormat = format;
+        rawSize = Size(int(vid.get(CAP_PROP_FRAME_WIDTH)), int(vid.get(CAP_PROP_FRAME_HEIGHT)));
+    }
+
+    const char* formatNames[] = { "BGR", "YUYV", "NV12", "MJPEG" };
+    cout << "Luma taken from the camera's " << formatNames[rawFormat] << " frames" << endl;
+}
+
+/*
+ * The luma of a raw camera frame. YUYV keeps it in every other byte and NV12 in a plane of its own
+ * ahead of the chroma, so both are a plain copy of one byte per pixel. MJPEG is decoded as greyscale,
+ * which skips the chroma upsampling and the colour conversion. BGR is converted with cvtColor's
+ * vectorized kernel, once per frame instead of once in every detector.
+ */
+bool FrameSource::extractLuma(const Mat& raw, Mat& frame)
+{
+    size_t bytes = raw.total() * raw.elemSize();
+
+    switch(rawFormat)
+    {
+        case RAW_YUYV:
+            if(!raw.isContinuous() || bytes < size_t(rawSize.area()) * 2)
+                break;
+            cvtColor(Mat(rawSize, CV_8UC2, raw.data), frame, COLOR_YUV2GRAY_YUYV);
+            return true;
+
+        case RAW_NV12:
+            if(!raw.isContinuous() || bytes < size_t(rawSize.area()) * 3 / 2)
+                break;
+            Mat(rawSize, CV_8UC1, raw.data).copyTo(frame);
+            return true;
+
+        case RAW_MJPEG:
+            imdecode(raw, IMREAD_GRAYSCALE, &frame);
+            return !frame.empty();
+
+        case RAW_BGR:
+            cvtColor(raw, frame, raw.channels() == 4 ? COLOR_BGRA2GRAY : COLOR_BGR2GRAY);
+            return true;
+    }
+
+    cerr << "A raw frame of " << bytes << " bytes does not hold a " << rawSize.width << "x" << rawSize.height << " image" << endl;
+    return false;
+}
+
+bool FrameSource::undistortWith(const string& calibrationFile)
+{
+    if(!mapCameraCalibration(calibrationFile, calibration))
+    {
+        cerr << "--undistort needs a binary calibration file with maps, " << calibrationFile << " is not one" << endl;
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Bounded lock-free queue for any number of producers and consumers (Dmitry Vyukov's array queue).
+ * Every cell carries a sequence number telling whether it is ready to be written or read, so
+ * producers and consumers only contend on their own position counter.
+ * A push that finds the queue full is counted, that is the backpressure the stage behind sees.
+ */
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity);
+
+    bool tryPush(T& item);
+    bool tryPop(T& item);
+
+    // Waits while the queue is full, gives up when stop is raised
+    bool push(T& item, const atomic<bool>& stop);
+
+    size_t size() const;
+    size_t capacity() const { return mask + 1; }
+    size_t fullCount() const { return pushesWhileFull.load(memory_order_relaxed); }
+    size_t highWaterMark() const { return deepest.load(memory_order_relaxed); }
+
+private:
+    struct Cell
+    {
+        atomic<size_t> sequence;
+        T data;
+    };
+
+    unique_ptr<Cell[]> cells;
+    size_t mask;
+
+    // Separate cache lines so producers and consumers do not invalidate each other
+    alignas(64) atomic<size_t> enqueuePosition;
+    alignas(64) atomic<size_t> dequeuePosition;
+    alignas(64) atomic<size_t> pushesWhileFull;
+    atomic<size_t> deepest;
+};
+
+template <typename T>
+BoundedQueue<T>::BoundedQueue(size_t capacity)
+{
+    // The capacity is rounded up to a power of two so positions wrap with a mask
+    size_t rounded = 2;
+    while(rounded < capacity)
+        rounded <<= 1;
+
+    cells.reset(new Cell[rounded]);
+    mask = rounded - 1;
+
+    for(size_t i = 0; i < rounded; i++)
+        cells[i].sequence.store(i, memory_order_relaxed);
+
+    enqueuePosition.store(0, memory_order_relaxed);
+    dequeuePosition.store(0, memory_order_relaxed);
+    pushesWhileFull.store(0, memory_order_relaxed);
+    deepest.store(0, memory_order_relaxed);
+}
+
+template <typename T>
+bool BoundedQueue<T>::tryPush(T& item)
+{
+    size_t position = enqueuePosition.load(memory_order_relaxed);
+
+    while(true)
+    {
+        Cell& cell = cells[position & mask];
+        size_t sequence = cell.sequence.load(memory_order_acquire);
+        intptr_t difference = intptr_t(sequence) - intptr_t(position);
+
+        if(difference == 0)
+        {
+            if(enqueuePosition.compare_exchange_weak(position, position + 1, memory_order_relaxed))
+            {
+                cell.data = std::move(item);
+                cell.sequence.store(position + 1, memory_order_release);
+
+                size_t depth = size();
+                size_t previous = deepest.load(memory_order_relaxed);
+                while(depth > previous && !deepest.compare_exchange_weak(previous, depth, memory_order_relaxed))
+                    ;
+
+                return true;
+            }
+        }
+        else if(difference < 0)
+        {
+            return false;
+        }
+        else
+        {
+            position = enqueuePosition.load(memory_order_relaxed);
+        }
+    }
+}
+
+template <typename T>
+bool BoundedQueue<T>::tryPop(T& item)
+{
+    size_t position = dequeuePosition.load(memory_order_relaxed);
+
+    while(true)
+    {
+        Cell& cell = cells[position & mask];
+        size_t sequence = cell.sequence.load(memory_order_acquire);
+        intptr_t difference = intptr_t(sequence) - intptr_t(position + 1);
+
+        if(difference == 0)
+        {
+            if(dequeuePosition.compare_exchange_weak(position, position + 1, memory_order_relaxed))
+            {
+                item = std::move(cell.data);
+                cell.sequence.store(position + mask + 1, memory_order_release);
+                return true;
+            }
+        }
+        else if(difference < 0)
+        {
+            return false;
+        }
+        else
+        {
+            position = dequeuePosition.load(memory_order_relaxed);
+        }
+    }
+}
+
+template <typename T>
+bool BoundedQueue<T>::push(T& item, const atomic<bool>& stop)
+{
+    if(tryPush(item))
+        return true;
+
+    pushesWhileFull.fetch_add(1, memory_order_relaxed);
+
+    int spins = 0;
+    while(!stop.load(memory_order_relaxed))
+    {
+        if(tryPush(item))
+            return true;
+
+        waitBriefly(spins);
+    }
+
+    return false;
+}
+
+template <typename T>
+size_t BoundedQueue<T>::size() const
+{
+    size_t enqueued = enqueuePosition.load(memory_order_relaxed);
+    size_t dequeued = dequeuePosition.load(memory_order_relaxed);
+
+    return enqueued > dequeued ? enqueued - dequeued : 0;
+}
+
+/*
+ * Hands the latest value from one producer to one consumer without either side ever waiting. Of the
+ * three slots the producer owns one and the consumer another, the third sits in the middle with a
+ * flag telling whether it holds something the consumer has not taken yet. Publishing swaps the
+ * producer's slot with the middle one, taking swaps the consumer's slot with it; a value published
+ * over one that was never taken is counted as skipped.
+ */
+template <typename T>
+class TripleBuffer
+{
+public:
+    TripleBuffer() : back(0), front(1), middle(2), skipped(0) {}
+
+    T& writeBuffer() { return slots[back]; }    // producer only
+    void publish();                             // producer only
+
+    // Takes the newest published value when there is one, consumer only
+    bool update();
+    T& readBuffer() { return slots[front]; }
+
+    // A published value the consumer has not taken yet
+    bool pending() const { return (middle.load(memory_order_acquire) & freshFlag) != 0; }
+
+    size_t skippedCount() const { return skipped.load(memory_order_relaxed); }
+
+private:
+    static const int freshFlag = 4;
+
+    T slots[3];
+    int back, front;
+    alignas(64) atomic<int> middle;
+    alignas(64) atomic<size_t> skipped;
+};
+
+template <typename T>
+void TripleBuffer<T>::publish()
+{
+    int previous = middle.exchange(back | freshFlag, memory_order_acq_rel);
+    if(previous & freshFlag)
+        skipped.fetch_add(1, memory_order_relaxed);
+
+    back = previous & ~freshFlag;
+}
+
+template <typename T>
+bool TripleBuffer<T>::update()
+{
+    if(!(middle.load(memory_order_relaxed) & freshFlag))
+        return false;
+
+    front = middle.exchange(front, memory_order_acq_rel) & ~freshFlag;
+    return true;
+}
+
+/*
+ * Ring of pose records between the thread that estimates poses and the stream writer, one producer
+ * and one consumer. The producer never waits: when the ring is full it moves the read position past
+ * the oldest record itself and counts it as dropped. The consumer copies a record before claiming it
+ * with a compare-exchange on the read position, a copy the producer overwrote in between fails the
+ * exchange and is thrown away. The slots hold the records as atomic words, so that copy may overlap
+ * the producer's write without being a data race.
+ */
+class PoseRing
+{
+public:
+    PoseRing();
+
+    // Empties the ring and sizes it, only while neither side uses it
+    void reset(size_t capacity);
+
+    void push(const PoseRecord& record);    // producer only
+    bool pop(PoseRecord& record);           // consumer only
+
+    size_t capacity() const { return mask + 1; }
+    size_t droppedCount() const { return dropped.load(memory_order_relaxed); }
+
+private:
+    struct Slot
+    {
+        atomic<uint64_t> words[sizeof(PoseRecord) / sizeof(uint64_t)];
+    };
+
+    unique_ptr<Slot[]> slots;
+    size_t mask;
+
+    alignas(64) atomic<size_t> writePosition;
+    alignas(64) atomic<size_t> readPosition;
+    alignas(64) atomic<size_t> dropped;
+};
+
+PoseRing::PoseRing()
+{
+    reset(2);
+}
+
+void PoseRing::reset(size_t capacity)
+{
+    size_t rounded = 2;
+    while(rounded < capacity)
+        rounded <<= 1;
+
+    slots.reset(new Slot[rounded]);
+    mask = rounded - 1;
+
+    writePosition.store(0, memory_order_relaxed);
+    readPosition.store(0, memory_order_relaxed);
+    dropped.store(0, memory_order_relaxed);
+}
+
+void PoseRing::push(const PoseRecord& record)
+{
+    size_t position = writePosition.load(memory_order_relaxed);
+    size_t oldest = readPosition.load(memory_order_acquire);
+
+    // A failed exchange means the consumer took the oldest record meanwhile, there is room either way
+    if(position - oldest > mask && readPosition.compare_exchange_strong(oldest, oldest + 1, memory_order_acq_rel))
+        dropped.fetch_add(1, memory_order_relaxed);
+
+    uint64_t words[sizeof(PoseRecord) / sizeof(uint64_t)];
+    memcpy(words, &record, sizeof(PoseRecord));
+
+    Slot& slot = slots[position & mask];
+    for(size_t w = 0; w < sizeof(PoseRecord) / sizeof(uint64_t); w++)
+        slot.words[w].store(words[w], memory_order_relaxed);
+
+    writePosition.store(position + 1, memory_order_release);
+}
+
+bool PoseRing::pop(PoseRecord& record)
+{
+    size_t position = readPosition.load(memory_order_acquire);
+
+    uint64_t words[sizeof(PoseRecord) / sizeof(uint64_t)];
+    while(position != writePosition.load(memory_order_acquire))
+    {
+        const Slot& slot = slots[position & mask];
+        for(size_t w = 0; w < sizeof(PoseRecord) / sizeof(uint64_t); w++)
+            words[w] = slot.words[w].load(memory_order_relaxed);
+
+        if(readPosition.compare_exchange_weak(position, position + 1, memory_order_acq_rel))
+        {
+            memcpy(&record, words, sizeof(PoseRecord));
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Streams the pose of every detected marker to a file, a named pipe or a local socket. The tracking
+ * thread neither formats nor waits, it copies the records into a PoseRing; a writer
+ * thread drains the ring, encodes the records as NDJSON lines or binary PoseRecords and writes them.
+ * A slow or missing reader makes the ring drop its oldest records instead of holding up detection.
+ */
+class PoseStream
+{
+public:
+    PoseStream() : stop(false), published(0), written(0), unsent(0) {}
+    ~PoseStream() { close(); }
+
+    // Starts the writer when options.streamTarget is set, does nothing otherwise
+    bool open(const TrackerOptions& options);
+    bool isOpen() const { return writer.joinable(); }
+
+    void publish(int cameraId, chrono::steady_clock::time_point captured, const vector<int>& markerIds, const vector<vector<Point2f>>& markerCorners,
+                 const vector<Vec3d>& rotationVectors, const vector<Vec3d>& translationVectors);
+
+    // A posed board goes out as a record with marker id -1 - its index and no corners
+    void publishBoards(int cameraId, chrono::steady_clock::time_point captured, const vector<MarkerBoard>& boards);
+
+    // Writes what is left in the ring and stops the writer
+    void close();
+    void printStatistics() const;
+
+private:
+    enum SinkKind { SINK_FILE, SINK_FIFO, SINK_UDP, SINK_UNIX };
+
+    void run();
+    bool connectFifo();
+    void appendRecord(const PoseRecord& record, string& buffer) const;
+    bool writeBuffer(const string& buffer);
+
+    string target;
+    bool binary = false;
+    SinkKind sink = SINK_FILE;
+    int descriptor = -1;
+    sockaddr_storage address;
+    socklen_t addressLength = 0;
+
+    // A member, not a pointer, so its counters keep their cache line alignment
+    PoseRing ring;
+    bool streaming = false;
+    thread writer;
+    atomic<bool> stop;
+    atomic<size_t> published, written, unsent;     // unsent: the sink refused them or had no reader
+};
+
+/*
+ * Targets: udp:<host>:<port> for a UDP datagram per record, unix:<path> for a Unix datagram socket,
+ * anything else a file, or a named pipe when the path is one.
+ */
+bool PoseStream::open(const TrackerOptions& options)
+{
+    if(options.streamTarget.empty())
+        return true;
+
+    if(options.streamFormat != "ndjson" && options.streamFormat != "binary")
+    {
+        cerr << "The stream format must be ndjson or binary" << endl;
+        return false;
+    }
+
+    target = options.streamTarget;
+    binary = options.streamFormat == "binary";
+
+    // A reader that goes away shows as a failed write, not as a signal ending the tracker
+    signal(SIGPIPE, SIG_IGN);
+
+    memset(&address, 0, sizeof(address));
+
+    if(target.compare(0, 4, "udp:") == 0)
+    {
+        size_t colon = target.rfind(':');
+        string host = target.substr(4, colon - 4);
+        int port = atoi(target.c_str() + colon + 1);
+        if(host == "localhost")
+            host = "127.0.0.1";
+
+        sockaddr_in& inet = reinterpret_cast<sockaddr_in&>(address);
+        inet.sin_family = AF_INET;
+        inet.sin_port = htons(uint16_t(port));
+        if(colon <= 4 || port <= 0 || port > 65535 || inet_pton(AF_INET, host.c_str(), &inet.sin_addr) != 1)
+        {
+            cerr << "Expected udp:<IPv4 address>:<port>, got " << target << endl;
+            return false;
+        }
+
+        sink = SINK_UDP;
+        addressLength = sizeof(sockaddr_in);
+        descriptor = socket(AF_INET, SOCK_DGRAM, 0);
+    }
+    else if(target.compare(0, 5, "unix:") == 0)
+    {
+        sockaddr_un& local = reinterpret_cast<sockaddr_un&>(address);
+        string path = target.substr(5);
+        if(path.empty() || path.size() >= sizeof(local.sun_path))
+        {
+            cerr << "Expected unix:<socket path>, got " << target << endl;
+            return false;
+        }
+
+        local.sun_family = AF_UNIX;
+        memcpy(local.sun_path, path.c_str(), path.size() + 1);
+
+        sink = SINK_UNIX;
+        addressLength = socklen_t(offsetof(sockaddr_un, sun_path) + path.size() + 1);
+        descriptor = socket(AF_UNIX, SOCK_DGRAM, 0);
+    }
+    else
+    {
+        struct stat status;
+        if(stat(target.c_str(), &status) == 0 && S_ISFIFO(status.st_mode))
+        {
+            // Opened by the writer once a reader shows up
+            sink = SINK_FIFO;
+        }
+        else
+        {
+            sink = SINK_FILE;
+            descriptor = ::open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        }
+    }
+
+    if(sink != SINK_FIFO && descriptor < 0)
+    {
+        cerr << "Could not open the pose stream " << target << ": " << strerror(errno) << endl;
+        return false;
+    }
+
+    ring.reset(size_t(max(2, options.streamCapacity)));
+    streaming = true;
+    stop.store(false);
+    writer = thread(&PoseStream::run, this);
+
+    return true;
+}
+
+void PoseStream::publish(int cameraId, chrono::steady_clock::time_point captured, const vector<int>& markerIds, const vector<vector<Point2f>>& markerCorners,
+                         const vector<Vec3d>& rotationVectors, const vector<Vec3d>& translationVectors)
+{
+    if(!streaming)
+        return;
+
+    PoseRecord record;
+    record.timestamp = uint64_t(chrono::duration_cast<chrono::microseconds>(captured.time_since_epoch()).count());
+    record.age = uint64_t(chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - captured).count());
+    record.cameraId = uint32_t(cameraId);
+
+    // Only the markers that come with a pose are streamed, and counted
+    size_t count = min(markerIds.size(), rotationVectors.size());
+    for(size_t i = 0; i < count; i++)
+    {
+        record.markerId = markerIds[i];
+        for(int k = 0; k < 3; k++)
+        {
+            record.rotation[k] = rotationVectors[i][k];
+            record.translation[k] = translationVectors[i][k];
+        }
+        for(int c = 0; c < 4; c++)
+        {
+            record.corners[2 * c] = markerCorners[i][c].x;
+            record.corners[2 * c + 1] = markerCorners[i][c].y;
+        }
+
+        ring.push(record);
+    }
+
+    published.fetch_add(count, memory_order_relaxed);
+}
+
+void PoseStream::publishBoards(int cameraId, chrono::steady_clock::time_point captured, const vector<MarkerBoard>& boards)
+{
+    if(!streaming)
+        return;
+
+    PoseRecord record;
+    memset(&record, 0, sizeof(record));
+    record.timestamp = uint64_t(chrono::duration_cast<chrono::microseconds>(captured.time_since_epoch()).count());
+    record.age = uint64_t(chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - captured).count());
+    record.cameraId = uint32_t(cameraId);
+
+    for(size_t b = 0; b < boards.size(); b++)
+    {
+        if(!boards[b].hasPose)
+            continue;
+
+        record.markerId = -1 - int32_t(b);
+        for(int k = 0; k < 3; k++)
+        {
+            record.rotation[k] = boards[b].rotation[k];
+            record.translation[k] = boards[b].translation[k];
+        }
+
+        ring.push(record);
+        published.fetch_add(1, memory_order_relaxed);
+    }
+}
+
+void PoseStream::close()
+{
+    if(!writer.joinable())
+        return;
+
+    stop.store(true, memory_order_release);
+    writer.join();
+
+    if(descriptor >= 0)
+        ::close(descriptor);
+    descriptor = -1;
+}
+
+void PoseStream::run()
+{
+    // Writing the records is not part of any frame
+    backgroundThread = true;
+
+    string buffer;
+    PoseRecord record;
+    int spins = 0;
+
+    while(true)
+    {
+        // Read before draining, so records published before close are still written
+        bool stopping = stop.load(memory_order_acquire);
+
+        size_t drained = 0;
+        while(drained < 256 && ring.pop(record))
+        {
+            drained++;
+
+            // Datagram sinks get one record per datagram, the others a batch per write
+            appendRecord(record, buffer);
+            if(sink == SINK_UDP || sink == SINK_UNIX)
+            {
+                if(writeBuffer(buffer))
+                    written.fetch_add(1, memory_order_relaxed);
+                else
+                    unsent.fetch_add(1, memory_order_relaxed);
+                buffer.clear();
+            }
+        }
+
+        if(!buffer.empty())
+        {
+            if(writeBuffer(buffer))
+                written.fetch_add(drained, memory_order_relaxed);
+            else
+                unsent.fetch_add(drained, memory_order_relaxed);
+            buffer.clear();
+        }
+
+        if(drained > 0)
+            spins = 0;
+        else if(stopping)
+            break;
+        else
+            waitBriefly(spins);
+    }
+}
+
+// Opening a pipe without a reader fails at once instead of blocking, the writer tries again with the next records
+bool PoseStream::connectFifo()
+{
+    if(descriptor >= 0)
+        return true;
+
+    descriptor = ::open(target.c_str(), O_WRONLY | O_NONBLOCK);
+    if(descriptor < 0)
+        return false;
+
+    fcntl(descriptor, F_SETFL, fcntl(descriptor, F_GETFL) & ~O_NONBLOCK);
+    return true;
+}
+
+bool PoseStream::writeBuffer(const string& buffer)
+{
+    if(sink == SINK_UDP || sink == SINK_UNIX)
+        return sendto(descriptor, buffer.data(), buffer.size(), MSG_NOSIGNAL, reinterpret_cast<const sockaddr*>(&address), addressLength) == ssize_t(buffer.size());
+
+    if(sink == SINK_FIFO && !connectFifo())
+        return false;
+
+    size_t offset = 0;
+    while(offset < buffer.size())
+    {
+        ssize_t count = ::write(descriptor, buffer.data() + offset, buffer.size() - offset);
+        if(count < 0 && errno == EINTR)
+            continue;
+
+        if(count <= 0)
+        {
+            // The reader of a pipe left, wait for the next one
+            if(sink == SINK_FIFO)
+            {
+                ::close(descriptor);
+                descriptor = -1;
+            }
+            return false;
+        }
+
+        offset += size_t(count);
+    }
+
+    return true;
+}
+
+void PoseStream::appendRecord(const PoseRecord& record, string& buffer) const
+{
+    if(binary)
+    {
+        buffer.append(reinterpret_cast<const char*>(&record), sizeof(record));
+        return;
+    }
+
+    char line[512];
+    int length = snprintf(line, sizeof(line),
+                          "{\"t\":%llu,\"age\":%llu,\"camera\":%u,\"id\":%d,\"rvec\":[%.9g,%.9g,%.9g],\"tvec\":[%.9g,%.9g,%.9g],"
+                          "\"corners\":[[%.2f,%.2f],[%.2f,%.2f],[%.2f,%.2f],[%.2f,%.2f]]}\n",
+                          (unsigned long long)record.timestamp, (unsigned long long)record.age, record.cameraId, record.markerId,
+                          record.rotation[0], record.rotation[1], record.rotation[2],
+                          record.translation[0], record.translation[1], record.translation[2],
+                          record.corners[0], record.corners[1], record.corners[2], record.corners[3],
+                          record.corners[4], record.corners[5], record.corners[6], record.corners[7]);
+    buffer.append(line, size_t(min(length, int(sizeof(line)) - 1)));
+}
+
+void PoseStream::printStatistics() const
+{
+    if(!streaming)
+        return;
+
+    cout << "Pose stream " << target << ": " << published.load() << " records published, " << written.load() << " written, "
+         << ring.droppedCount() << " dropped by the full ring (capacity " << ring.capacity() << "), "
+         << unsent.load() << " refused by the sink" << endl;
+}
+
+// A function and the data it works on, so submitting a task copies two pointers and allocates nothing
+struct PoolTask
+{
+    void (*run)(void* context) = nullptr;
+    void* context = nullptr;
+};
+
+/*
+ * Thread pool where every worker has its own ring of tasks. A worker runs its own newest task first
+ * and, when it has none, steals the oldest task of another worker, so one stream with expensive
+ * frames does not leave the other workers idle. The rings are only held for a push or a pop and
+ * hold taskCapacity tasks each, a submit waits while every ring is full.
+ */
+class WorkStealingPool
+{
+public:
+    WorkStealingPool(int workerCount, size_t taskCapacity);
+    ~WorkStealingPool();
+
+    // Submitted from outside the pool, the tasks are spread over the workers in turn
+    void submit(PoolTask task);
+
+    int workerCount() const { return int(workers.size()); }
+    size_t executedCount(int worker) const { return workers[worker]->executed.load(memory_order_relaxed); }
+    size_t stolenCount() const { return stolen.load(memory_order_relaxed); }
+
+private:
+    struct Worker
+    {
+        mutex lock;
+        vector<PoolTask> tasks;     // ring, the oldest task at first
+        size_t first = 0;
+        size_t count = 0;
+        atomic<size_t> executed;
+    };
+
+    bool takeTask(int worker, PoolTask& task);
+    void run(int worker);
+
+    vector<unique_ptr<Worker>> workers;
+    vector<thread> threads;
+    atomic<bool> stop;
+    atomic<size_t> pending;
+    atomic<size_t> nextWorker;
+    atomic<size_t> stolen;
+};
+
+WorkStealingPool::WorkStealingPool(int workerCount, size_t taskCapacity)
+{
+    stop.store(false);
+    pending.store(0);
+    nextWorker.store(0);
+    stolen.store(0);
+
+    for(int w = 0; w < max(1, workerCount); w++)
+    {
+        workers.push_back(unique_ptr<Worker>(new Worker()));
+        workers.back()->tasks.resize(max(size_t(1), taskCapacity));
+        workers.back()->executed.store(0);
+    }
+
+    for(int w = 0; w < int(workers.size()); w++)
+        threads.push_back(thread(&WorkStealingPool::run, this, w));
+}
+
+// Runs whatever was submitted before returning
+WorkStealingPool::~WorkStealingPool()
+{
+    int spins = 0;
+    while(pending.load() > 0)
+        waitBriefly(spins);
+
+    stop.store(true);
+    for(size_t t = 0; t < threads.size(); t++)
+        threads[t].join();
+}
+
+void WorkStealingPool::submit(PoolTask task)
+{
+    pending.fetch_add(1);
+
+    int spins = 0;
+    while(true)
+    {
+        // Starting with the next worker in turn, the first ring with room takes the task
+        size_t start = nextWorker.fetch_add(1, memory_order_relaxed);
+        for(size_t offset = 0; offset < workers.size(); offset++)
+        {
+            Worker& worker = *workers[(start + offset) % workers.size()];
+            lock_guard<mutex> guard(worker.lock);
+            if(worker.count < worker.tasks.size())
+            {
+                worker.tasks[(worker.first + worker.count) % worker.tasks.size()] = task;
+                worker.count++;
+                return;
+            }
+        }
+
+        waitBriefly(spins);
+    }
+}
+
+bool WorkStealingPool::takeTask(int worker, PoolTask& task)
+{
+    {
+        Worker& own = *workers[worker];
+        lock_guard<mutex> guard(own.lock);
+        if(own.count > 0)
+        {
+            own.count--;
+            task = own.tasks[(own.first + own.count) % own.tasks.size()];
+            return true;
+        }
+    }
+
+    // Steal from the others, starting with the next worker so thieves do not all pick the same victim
+    for(size_t offset = 1; offset < workers.size(); offset++)
+    {
+        Worker& victim = *workers[(worker + offset) % workers.size()];
+        lock_guard<mutex> guard(victim.lock);
+        if(victim.count > 0)
+        {
+            task = victim.tasks[victim.first];
+            victim.first = (victim.first + 1) % victim.tasks.size();
+            victim.count--;
+            stolen.fetch_add(1, memory_order_relaxed);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void WorkStealingPool::run(int worker)
+{
+    PoolTask task;
+    int spins = 0;
+
+    while(!stop.load(memory_order_relaxed))
+    {
+        if(!takeTask(worker, task))
+        {
+            waitBriefly(spins);
+            continue;
+        }
+
+        spins = 0;
+        task.run(task.context);
+
+        workers[worker]->executed.fetch_add(1, memory_order_relaxed);
+        pending.fetch_sub(1);
+    }
+}
+
+/*
+ * Searches for the chessboard in the calibration preview on its own thread, so the preview keeps
+ * the camera's frame rate whether a board is in view or not. Only the newest frame is searched:
+ * a frame handed in while the previous one is still waiting replaces it. The board is searched in
+ * a copy at most searchWidth pixels wide and its corners refined in the full resolution frame.
+ */
+class ChessboardPreview
+{
+public:
+    ChessboardPreview(Size boardSize, int searchWidth);
+    ~ChessboardPreview();
+
+    // Copies the frame, the caller can draw into it afterwards
+    void submit(const Mat& frame);
+
+    // The result of the most recent search, false when no frame was searched yet
+    bool latest(ChessboardDetection& detection, size_t& sequence);
+
+    // Copies the last frame the board was found in, the preview goes on reusing its own buffer
+    bool copyFoundFrame(Mat& saved, size_t& sequence);
+
+    size_t replacedCount() const { return replaced.load(memory_order_relaxed); }
+
+private:
+    void run();
+
+    Size boardSize;
+    int searchWidth;
+
+    mutex lock;
+    condition_variable frameReady;
+    bool stopping = false;
+    Mat pending;                    // newest frame not searched yet
+    bool hasPending = false;
+    size_t submitted = 0;
+
+    ChessboardDetection result;
+    Mat resultFrame;                // last frame the board was found in
+    size_t resultSequence = 0;
+    size_t foundSequence = 0;       // sequence of resultFrame, 0 before the board was found
+    atomic<size_t> replaced;        // frames replaced before they were searched
+
+    thread worker;
+};
+
+ChessboardPreview::ChessboardPreview(Size boardSize, int searchWidth)
+    : boardSize(boardSize), searchWidth(searchWidth), replaced(0)
+{
+    worker = thread(&ChessboardPreview::run, this);
+}
+
+ChessboardPreview::~ChessboardPreview()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    frameReady.notify_one();
+    worker.join();
+}
+
+void ChessboardPreview::submit(const Mat& frame)
+{
+    {
+        lock_guard<mutex> guard(lock);
+        if(hasPending)
+            replaced.fetch_add(1, memory_order_relaxed);
+
+        frame.copyTo(pending);
+        hasPending = true;
+        submitted++;
+    }
+    frameReady.notify_one();
+}
+
+bool ChessboardPreview::latest(ChessboardDetection& detection, size_t& sequence)
+{
+    lock_guard<mutex> guard(lock);
+    if(resultSequence == 0)
+        return false;
+
+    detection = result;
+    sequence = resultSequence;
+    return true;
+}
+
+bool ChessboardPreview::copyFoundFrame(Mat& saved, size_t& sequence)
+{
+    lock_guard<mutex> guard(lock);
+    if(foundSequence == 0)
+        return false;
+
+    resultFrame.copyTo(saved);
+    sequence = foundSequence;
+    return true;
+}
+
+void ChessboardPreview::run()
+{
+    typedef chrono::steady_clock Clock;
+
+    Mat frame, gray, small;
+    while(true)
+    {
+        size_t sequence;
+        {
+            unique_lock<mutex> guard(lock);
+            frameReady.wait(guard, [this]() { return stopping || hasPending; });
+            if(stopping)
+                return;
+
+            // The buffers are swapped, not copied, the next submit writes into the one searched before
+            swap(frame, pending);
+            hasPending = false;
+            sequence = submitted;
+        }
+
+        Clock::time_point start = Clock::now();
+
+        ChessboardDetection detection;
+        cvtColor(frame, gray, COLOR_BGR2GRAY);
+        detection.found = findChessboardCornersScaled(gray, boardSize, searchWidth, small, detection.corners);
+        if(!detection.found)
+            detection.rejectReason = "board not found";
+        detection.milliseconds = chrono::duration<double, milli>(Clock::now() - start).count();
+
+        lock_guard<mutex> guard(lock);
+        result = detection;
+        resultSequence = sequence;
+        if(detection.found)
+        {
+            // The result keeps this frame for saving and hands its previous buffer to the next frame,
+            // so frame, pending and resultFrame go round the same three buffers
+            swap(frame, resultFrame);
+            foundSequence = sequence;
+        }
+    }
+}
+
+/*
+ * Marker bit patterns packed into an integer, row by row with the first cell in the highest bit,
+ * the order the aruco dictionaries store them in. The table entries of the decoders keep the id,
+ * the rotation and the number of bits that had to be corrected in 16 bits.
+ */
+template <int MarkerSize>
+struct MarkerCode
+{
+    static const int bits = MarkerSize * MarkerSize;
+    typedef typename conditional<(bits <= 16), uint16_t, typename conditional<(bits <= 32), uint32_t, uint64_t>::type>::type Type;
+
+    static const uint16_t ambiguousId = 0xFFF;      // two markers are equally close to the pattern
+    static const uint16_t noMarker = 0xFFFF;        // ambiguousId with a distance no real entry has
+
+    static constexpr uint16_t entry(int id, int rotation, int distance) { return uint16_t((id << 4) | (distance << 2) | rotation); }
+    static constexpr int entryId(uint16_t entry) { return entry >> 4; }
+    static constexpr int entryDistance(uint16_t entry) { return (entry >> 2) & 3; }
+    static constexpr int entryRotation(uint16_t entry) { return entry & 3; }
+
+    // The pattern seen after turning the marker a quarter turn clockwise
+    static constexpr Type rotateClockwise(Type code)
+    {
+        Type rotated = 0;
+        for(int y = 0; y < MarkerSize; y++)
+        {
+            for(int x = 0; x < MarkerSize; x++)
+            {
+                if((code >> (bits - 1 - ((MarkerSize - 1 - x) * MarkerSize + y))) & 1)
+                    rotated |= Type(1) << (bits - 1 - (y * MarkerSize + x));
+            }
+        }
+        return rotated;
+    }
+
+    // The better of the entry already stored for a pattern and a new candidate for it
+    static constexpr uint16_t closerEntry(uint16_t current, int id, int rotation, int distance)
+    {
+        if(distance < entryDistance(current))
+            return entry(id, rotation, distance);
+        if(distance == entryDistance(current) && entryId(current) != id)
+            return entry(ambiguousId, 0, distance);
+        return current;
+    }
+
+    /*
+     * Stores every rotation of a code and every pattern up to maxCorrection bits away from them.
+     * The rotation is counted the way aruco::Dictionary::identify counts it: the number of quarter
+     * turns counterclockwise that bring the marker to the pattern.
+     */
+    template <class Decoder>
+    static constexpr void addMarker(Decoder& decoder, Type code, int id, int maxCorrection)
+    {
+        Type rotated = code;
+        for(int turns = 0; turns < 4; turns++)
+        {
+            int rotation = (4 - turns) % 4;
+
+            decoder.store(rotated, id, rotation, 0);
+            for(int i = 0; i < bits && maxCorrection >= 1; i++)
+            {
+                decoder.store(rotated ^ (Type(1) << i), id, rotation, 1);
+                for(int j = 0; j < i && maxCorrection >= 2; j++)
+                    decoder.store(rotated ^ (Type(1) << i) ^ (Type(1) << j), id, rotation, 2);
+            }
+
+            rotated = rotateClockwise(rotated);
+        }
+    }
+
+    // Inner cells of a candidate, one 0 or 1 byte per cell
+    static Type fromBits(const Mat& innerBits)
+    {
+        Type code = 0;
+        for(int y = 0; y < MarkerSize; y++)
+        {
+            const uchar* row = innerBits.ptr<uchar>(y);
+            for(int x = 0; x < MarkerSize; x++)
+                code = Type((code << 1) | row[x]);
+        }
+        return code;
+    }
+
+    // Unrotated code of a dictionary marker. bytesList keeps 8 cells per byte and the remaining cells right aligned in the last one
+    static Type fromDictionary(const aruco::Dictionary& dictionary, int id)
+    {
+        const uchar* bytes = dictionary.bytesList.ptr<uchar>(id);
+        Type code = 0;
+        for(int b = 0; b < dictionary.bytesList.cols; b++)
+        {
+            int cellsInByte = min(8, bits - 8 * b);
+            code = Type((code << cellsInByte) | bytes[4 * b]);
+        }
+        return code;
+    }
+};
+
+/*
+ * Constant time lookup from the bit pattern of a candidate to its marker id and rotation.
+ * Patterns within MaxCorrection bits of a marker are stored up front, so the cost does not depend on
+ * the dictionary size. Up to 16 bits (4x4 markers) the table is indexed by the pattern directly and
+ * can be built at compile time, larger markers use an open addressing hash table built at startup.
+ */
+template <int MarkerSize, int MaxCorrection>
+class BitDecoder<MarkerSize, MaxCorrection, true>
+{
+public:
+    typedef MarkerCode<MarkerSize> Codes;
+    typedef typename Codes::Type Code;
+    static_assert(MaxCorrection >= 0 && MaxCorrection <= 2, "a table entry keeps distances up to 2");
+
+    constexpr BitDecoder(const Code* codes, int count);
+
+    bool decode(Code pattern, int maxErrors, int& id, int& rotation) const;
+    constexpr void store(Code pattern, int id, int rotation, int distance);
+
+private:
+    uint16_t entries[size_t(1) << Codes::bits];
+};
+
+template <int MarkerSize, int MaxCorrection>
+constexpr BitDecoder<MarkerSize, MaxCorrection, true>::BitDecoder(const Code* codes, int count)
+    : entries()
+{
+    for(size_t p = 0; p < (size_t(1) << Codes::bits); p++)
+        entries[p] = Codes::noMarker;
+
+    for(int id = 0; id < count; id++)
+        Codes::addMarker(*this, codes[id], id, MaxCorrection);
+}
+
+template <int MarkerSize, int MaxCorrection>
+constexpr void BitDecoder<MarkerSize, MaxCorrection, true>::store(Code pattern, int id, int rotation, int distance)
+{
+    entries[pattern] = Codes::closerEntry(entries[pattern], id, rotation, distance);
+}
+
+template <int MarkerSize, int MaxCorrection>
+bool BitDecoder<MarkerSize, MaxCorrection, true>::decode(Code pattern, int maxErrors, int& id, int& rotation) const
+{
+    uint16_t entry = entries[pattern];
+    if(Codes::entryId(entry) == Codes::ambiguousId || Codes::entryDistance(entry) > maxErrors)
+        return false;
+
+    id = Codes::entryId(entry);
+    rotation = Codes::entryRotation(entry);
+    return true;
+}
+
+template <int MarkerSize, int MaxCorrection>
+class BitDecoder<MarkerSize, MaxCorrection, false>
+{
+public:
+    typedef MarkerCode<MarkerSize> Codes;
+    typedef typename Codes::Type Code;
+    static_assert(MaxCorrection >= 0 && MaxCorrection <= 2, "a table entry keeps distances up to 2");
+
+    BitDecoder(const Code* codes, int count);
+
+    bool decode(Code pattern, int maxErrors, int& id, int& rotation) const;
+    void store(Code pattern, int id, int rotation, int distance);
+
+private:
+    size_t slotOf(Code pattern) const { return size_t((uint64_t(pattern) * 0x9E3779B97F4A7C15ull) >> shift); }
+
+    vector<Code> keys;
+    vector<uint16_t> entries;   // noMarker marks an empty slot
+    size_t mask;
+    int shift;
+};
+
+template <int MarkerSize, int MaxCorrection>
+BitDecoder<MarkerSize, MaxCorrection, false>::BitDecoder(const Code* codes, int count)
+{
+    // Every pattern stored, at most half the slots used so probe chains stay short
+    size_t patternsPerRotation = 1 + (MaxCorrection >= 1 ? Codes::bits : 0) + (MaxCorrection >= 2 ? Codes::bits * (Codes::bits - 1) / 2 : 0);
+    size_t patterns = size_t(count) * 4 * patternsPerRotation;
+
+    size_t slots = 2;
+    shift = 63;
+    while(slots < 2 * patterns)
+    {
+        slots <<= 1;
+        shift--;
+    }
+
+    keys.assign(slots, 0);
+    entries.assign(slots, uint16_t(Codes::noMarker));
+    mask = slots - 1;
+
+    for(int id = 0; id < count; id++)
+        Codes::addMarker(*this, codes[id], id, MaxCorrection);
+}
+
+template <int MarkerSize, int MaxCorrection>
+void BitDecoder<MarkerSize, MaxCorrection, false>::store(Code pattern, int id, int rotation, int distance)
+{
+    size_t slot = slotOf(pattern);
+    while(entries[slot] != Codes::noMarker && keys[slot] != pattern)
+        slot = (slot + 1) & mask;
+
+    keys[slot] = pattern;
+    entries[slot] = Codes::closerEntry(entries[slot], id, rotation, distance);
+}
+
+template <int MarkerSize, int MaxCorrection>
+bool BitDecoder<MarkerSize, MaxCorrection, false>::decode(Code pattern, int maxErrors, int& id, int& rotation) const
+{
+    size_t slot = slotOf(pattern);
+    while(entries[slot] != Codes::noMarker)
+    {
+        if(keys[slot] == pattern)
+        {
+            uint16_t entry = entries[slot];
+            if(Codes::entryId(entry) == Codes::ambiguousId || Codes::entryDistance(entry) > maxErrors)
+                return false;
+
+            id = Codes::entryId(entry);
+            rotation = Codes::entryRotation(entry);
+            return true;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    return false;
+}
+
+// DICT_4X4_50, the dictionary our markers are printed from, and its table built by the compiler
+constexpr uint16_t dict4x4_50Codes[50] =
+{
+    0xB532, 0x0F9A, 0x332D, 0x9946, 0x549E, 0x79CD, 0x9E2E, 0xC4F2, 0xFEDA, 0xCF56,
+    0xF991, 0x11A7, 0x0EB7, 0x2A0F, 0x24B1, 0x263E, 0x4665, 0x6600, 0x6C5E, 0x76AF,
+    0x868B, 0xB02B, 0xCCD5, 0xDD82, 0xFE47, 0x9471, 0xACE4, 0xA554, 0x2123, 0x346F,
+    0x4415, 0x57B2, 0x9ECF, 0xF0CB, 0x08AE, 0x0929, 0x1875, 0x04FF, 0x0DF6, 0x1C5A,
+    0x1718, 0x2A28, 0x328C, 0x38B2, 0x24E8, 0x2EEB, 0x2D3F, 0x4B64, 0x502E, 0x5013
+};
+constexpr BitDecoder<4> dict4x4_50Decoder(dict4x4_50Codes, 50);
+
+/*
+ * Latency histogram that any number of threads can record into without locking. Buckets are
+ * logarithmic with 16 linear steps per power of two, so a percentile is off by at most 1/16 of its
+ * value. Recording is a handful of relaxed atomic adds, cheap enough to leave on all the time.
+ */
+class LatencyHistogram
+{
+public:
+    LatencyHistogram();
+
+    void record(chrono::steady_clock::duration elapsed);
+
+    // Readings while other threads record only miss the samples being added
+    uint64_t count() const { return samples.load(memory_order_relaxed); }
+    double meanMilliseconds() const;
+    double maxMilliseconds() const { return longest.load(memory_order_relaxed) * 1e-6; }
+    double percentileMilliseconds(double percentile) const;
+
+private:
+    static const int subBucketBits = 4;
+    static const int subBuckets = 1 << subBucketBits;
+    static const int bucketCount = (64 - subBucketBits + 1) * subBuckets;
+
+    static int bucketOf(uint64_t nanoseconds);
+    static uint64_t bucketMiddle(int bucket);
+
+    atomic<uint64_t> buckets[bucketCount];
+    atomic<uint64_t> samples;
+    atomic<uint64_t> totalNanoseconds;
+    atomic<uint64_t> longest;
+};
+
+LatencyHistogram::LatencyHistogram()
+{
+    for(int b = 0; b < bucketCount; b++)
+        buckets[b].store(0, memory_order_relaxed);
+
+    samples.store(0, memory_order_relaxed);
+    totalNanoseconds.store(0, memory_order_relaxed);
+    longest.store(0, memory_order_relaxed);
+}
+
+void LatencyHistogram::record(chrono::steady_clock::duration elapsed)
+{
+    int64_t signedNanoseconds = chrono::duration_cast<chrono::nanoseconds>(elapsed).count();
+    uint64_t nanoseconds = uint64_t(max<int64_t>(0, signedNanoseconds));
+
+    buckets[bucketOf(nanoseconds)].fetch_add(1, memory_order_relaxed);
+    samples.fetch_add(1, memory_order_relaxed);
+    totalNanoseconds.fetch_add(nanoseconds, memory_order_relaxed);
+
+    uint64_t previous = longest.load(memory_order_relaxed);
+    while(nanoseconds > previous && !longest.compare_exchange_weak(previous, nanoseconds, memory_order_relaxed))
+        ;
+}
+
+// Values below 16 ns get a bucket each, above that a power of two is split into 16 steps
+int LatencyHistogram::bucketOf(uint64_t nanoseconds)
+{
+    if(nanoseconds < uint64_t(subBuckets))
+        return int(nanoseconds);
+
+    int highestBit = 63 - __builtin_clzll(nanoseconds);
+    int step = int((nanoseconds >> (highestBit - subBucketBits)) & (subBuckets - 1));
+
+    return (highestBit - subBucketBits + 1) * subBuckets + step;
+}
+
+uint64_t LatencyHistogram::bucketMiddle(int bucket)
+{
+    if(bucket < subBuckets)
+        return uint64_t(bucket);
+
+    int highestBit = bucket / subBuckets + subBucketBits - 1;
+    int step = bucket % subBuckets;
+    int widthBits = highestBit - subBucketBits;
+
+    uint64_t lower = uint64_t(subBuckets + step) << widthBits;
+    return lower + ((uint64_t(1) << widthBits) >> 1);
+}
+
+double LatencyHistogram::meanMilliseconds() const
+{
+    uint64_t n = count();
+    return n == 0 ? 0.0 : totalNanoseconds.load(memory_order_relaxed) * 1e-6 / n;
+}
+
+double LatencyHistogram::percentileMilliseconds(double percentile) const
+{
+    uint64_t n = count();
+    if(n == 0)
+        return 0.0;
+
+    // Rank of the sample, counted the same way printTimingSummary indexes its sorted samples
+    uint64_t rank = uint64_t((n - 1) * percentile / 100.0) + 1;
+    uint64_t seen = 0;
+    for(int b = 0; b < bucketCount; b++)
+    {
+        seen += buckets[b].load(memory_order_relaxed);
+        if(seen >= rank)
+            return min(bucketMiddle(b), longest.load(memory_order_relaxed)) * 1e-6;
+    }
+
+    return maxMilliseconds();
+}
+
+// Stage histograms of a tracking loop and when to export them next
+struct StageMetrics
+{
+    LatencyHistogram stages[STAGE_COUNT];
+    string file;                    // empty when the histograms are only printed at the end
+    double interval = 10.0;
+    chrono::steady_clock::time_point started, nextExport;
+};
+
+// This function will print 50 aruco markers
+void createArucoMarkers()
+{
+    // We initialize the markers ( 50 different markers), every thread draws into its own image
+    Ptr<aruco::Dictionary> markerDictionary = aruco::getPredefinedDictionary(aruco::PREDEFINED_DICTIONARY_NAME::DICT_4X4_50);
+
+    parallelFor(Range(0, 50), [&](const Range& range)
+    {
+        Mat outputMarker;
+        for(int i = range.start; i < range.end; i++)
+        {
+            // We will these markers on the image
+            /*The first parameter is the Dictionary object previously created.
+              The second parameter is the marker id, in this case the marker 23 of the dictionary DICT_4X4_. Note that each dictionary is composed by a different number of markers. 
+              In this case, the valid ids go from 0 to 49. 
+              The third parameter is the size of output image
+              The forth parameter is the output image.
+              Finally, the last parameter is an optional parameter to specify the width of the marker black border.
+             */
+            aruco::drawMarker(markerDictionary, i, 500, outputMarker, 1);
+            ostringstream convert;
+
+            string imageName = "4x4Marker_";
+            convert << imageName << i << ".jpg";
+        
+            // We write it to the image
+            imwrite(convert.str(), outputMarker);
+        }
+    });
+}
+
+//This function  create known board position in 3D
+void createKnownBoardPosition(Size boardSize, float squareEdgeLength, vector<Point3f>& corners)
+{
+    for(int i = 0; i < boardSize.height; i++)
+    {
+        for(int j = 0 ; j < boardSize.width; j++)
+        {
+            // The corners detected are pushed into corners
+            corners.push_back(Point3f(j * squareEdgeLength, i * squareEdgeLength, 0.0f));
+        }
+    }
+}
+
+/*
+ * findChessboardCorners on a copy of the grey image at most searchWidth pixels wide, the corners are
+ * scaled back and refined in the full resolution image. The search time grows with the image area
+ * while the board is found just as well in a small copy, the refinement recovers the precision.
+ */
+bool findChessboardCornersScaled(const Mat& gray, Size boardSize, int searchWidth, Mat& small, vector<Point2f>& corners)
+{
+    double scale = 1.0;
+    const Mat* searched = &gray;
+    if(searchWidth > 0 && gray.cols > searchWidth)
+    {
+        scale = double(gray.cols) / searchWidth;
+        resize(gray, small, Size(searchWidth, cvRound(gray.rows / scale)), 0, 0, INTER_AREA);
+        searched = &small;
+    }
+
+    if(!findChessboardCorners(*searched, boardSize, corners, CV_CALIB_CB_ADAPTIVE_THRESH | CV_CALIB_CB_NORMALIZE_IMAGE | CV_CALIB_CB_FAST_CHECK))
+        return false;
+
+    for(size_t c = 0; c < corners.size(); c++)
+        corners[c] = Point2f(float((corners[c].x + 0.5) * scale - 0.5), float((corners[c].y + 0.5) * scale - 0.5));
+
+    // The scaled corners are off by up to a pixel of the small image, the window has to reach that far
+    int window = max(11, int(ceil(2 * scale)));
+    cornerSubPix(gray, corners, Size(window, window), Size(-1, -1), TermCriteria(TermCriteria::EPS | TermCriteria::COUNT, 30, 0.01));
+    return true;
+}
+
+/*
+ * We retrieve the corners from the chessboard.
+ * The images are searched in parallel, each one converted to grey once and its corners refined to
+ * sub-pixel accuracy in the same pass. detections gets one entry per image, in the images' order,
+ * with how long it took and why it was rejected. allFoundCorners only gets the accepted images.
+ */
+void getChessboardCorners(const vector<Mat>& images, Size boardSize, vector<vector<Point2f>>& allFoundCorners, vector<ChessboardDetection>& detections, bool showResults = false )
+{
+    typedef chrono::steady_clock Clock;
+
+    detections.assign(images.size(), ChessboardDetection());
+
+    parallelFor(Range(0, int(images.size())), [&](const Range& range)
+    {
+        Mat gray;
+
+        for(int i = range.start; i < range.end; i++)
+        {
+            ChessboardDetection& detection = detections[i];
+            Clock::time_point start = Clock::now();
+
+            if(images[i].empty())
+                detection.rejectReason = "empty image";
+            else
+            {
+                if(images[i].channels() == 3)
+                    cvtColor(images[i], gray, COLOR_BGR2GRAY);
+                else
+                    gray = images[i];
+
+                if(!findChessboardCorners(gray, boardSize, detection.corners, CV_CALIB_CB_ADAPTIVE_THRESH | CV_CALIB_CB_NORMALIZE_IMAGE | CV_CALIB_CB_FAST_CHECK))
+                    detection.rejectReason = "board not found";
+                else
+                {
+                    cornerSubPix(gray, detection.corners, Size(11, 11), Size(-1, -1), TermCriteria(TermCriteria::EPS | TermCriteria::COUNT, 30, 0.01));
+                    detection.found = true;
+                }
+            }
+
+            detection.milliseconds = chrono::duration<double, milli>(Clock::now() - start).count();
+        }
+    });
+
+    for(size_t i = 0; i < images.size(); i++)
+    {
+        if(detections[i].found){
+            //We save the corner in allfoundconers data structure
+            allFoundCorners.push_back(detections[i].corners);
+        }
+
+        if(showResults)
+        {
+            // We can draw the corners and show them, on a copy since the images are not ours
+            Mat drawn = images[i].clone();
+            drawChessboardCorners(drawn, boardSize, detections[i].corners, detections[i].found);
+            imshow("Looking for corners", drawn);
+            waitKey(0);
+        }
+    }
+
+}
+
+// One line per image with its time and, when it was not used, why
+void printChessboardDetections(const vector<ChessboardDetection>& detections)
+{
+    size_t accepted = 0;
+    double totalMilliseconds = 0.0;
+
+    cout << fixed << setprecision(2);
+    for(size_t i = 0; i < detections.size(); i++)
+    {
+        cout << "Image " << i << ": " << detections[i].milliseconds << " ms, "
+             << (detections[i].found ? string("used") : "rejected, " + detections[i].rejectReason) << endl;
+
+        if(detections[i].found)
+            accepted++;
+        totalMilliseconds += detections[i].milliseconds;
+    }
+
+    cout << accepted << " of " << detections.size() << " images used, " << totalMilliseconds << " ms of corner search over all the threads" << endl;
+}
+
+// This function will populate cameraMatrix which carries our camera model as well as distance coefficients
+bool saveCameraCalibration(string name, Mat cameraMatrix, Mat distanceCoeffients)
+{
+    ofstream outStream(name);
+    if(outStream)
+    {
+        // Enough digits for the doubles to read back unchanged
+        outStream << setprecision(17);
+
+        uint16_t rows = cameraMatrix.rows;
+        uint16_t columns = cameraMatrix.cols;
+
+        outStream << rows << endl;
+        outStream << columns << endl;
+
+        for(int r = 0; r < rows; r++)
+        {
+            for(int c = 0; c< columns; c++)
+            {
+                double value = cameraMatrix.at<double>(r,c);
+                outStream << value << endl;
+            }
+        }
+
+        rows = distanceCoeffients.rows;
+        columns = distanceCoeffients.cols;
+
+        outStream << rows << endl;
+        outStream << columns << endl;
+
+        for(int r = 0; r < rows; r++)
+        {
+            for(int c = 0; c< columns; c++)
+            {
+                double value = distanceCoeffients.at<double>(r,c);
+                outStream << value << endl;
+            }
+        }
+
+        outStream.close();
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * Writes a binary calibration file for frames of the given resolution, with the undistortion maps
+ * built once here instead of at every start.
+ */
+bool saveCameraCalibrationBinary(const string& name, const Mat& cameraMatrix, const Mat& distanceCoefficients, Size resolution)
+{
+    if(cameraMatrix.rows != 3 || cameraMatrix.cols != 3 || distanceCoefficients.total() > 14 || resolution.area() <= 0)
+    {
+        cerr << "Cannot write " << name << ": needs a 3x3 camera matrix, at most 14 distortion coefficients and a resolution" << endl;
+        return false;
+    }
+
+    Mat map, interpolation;
+    initUndistortRectifyMap(cameraMatrix, distanceCoefficients, Mat(), cameraMatrix, resolution, CV_16SC2, map, interpolation);
+
+    CalibrationFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, calibrationFileMagic, sizeof(header.magic));
+    header.version = calibrationFileVersion;
+    header.headerBytes = sizeof(header);
+    header.width = resolution.width;
+    header.height = resolution.height;
+
+    Mat cameraValues, distortionValues;
+    cameraMatrix.convertTo(cameraValues, CV_64F);
+    distanceCoefficients.reshape(1, 1).convertTo(distortionValues, CV_64F);
+    for(int k = 0; k < 9; k++)
+        header.cameraMatrix[k] = cameraValues.at<double>(k / 3, k % 3);
+    header.distortionCount = int(distortionValues.total());
+    for(int k = 0; k < header.distortionCount; k++)
+        header.distortion[k] = distortionValues.at<double>(0, k);
+
+    // Maps on 64 byte boundaries, remap reads them straight from the mapping
+    header.mapBytes = map.total() * map.elemSize();
+    header.interpolationBytes = interpolation.total() * interpolation.elemSize();
+    header.mapOffset = (sizeof(header) + 63) / 64 * 64;
+    header.interpolationOffset = (header.mapOffset + header.mapBytes + 63) / 64 * 64;
+
+    ofstream outStream(name, ios::binary);
+    if(!outStream)
+        return false;
+
+    const char padding[64] = { 0 };
+    outStream.write((const char*)&header, sizeof(header));
+    outStream.write(padding, header.mapOffset - sizeof(header));
+    for(int r = 0; r < map.rows; r++)
+        outStream.write(map.ptr<char>(r), map.cols * map.elemSize());
+    outStream.write(padding, header.interpolationOffset - header.mapOffset - header.mapBytes);
+    for(int r = 0; r < interpolation.rows; r++)
+        outStream.write(interpolation.ptr<char>(r), interpolation.cols * interpolation.elemSize());
+
+    return bool(outStream);
+}
+
+/*
+ * Maps a binary calibration file read-only. Nothing is parsed or copied: the matrices and the maps
+ * are Mat headers over the mapping, which stays alive as long as calibration.storage is shared.
+ * Returns false, without a message, when the file is not a binary calibration of this version, so
+ * callers can fall back to the text format.
+ */
+bool mapCameraCalibration(const string& name, CameraCalibration& calibration)
+{
+    int file = open(name.c_str(), O_RDONLY);
+    if(file < 0)
+        return false;
+
+    struct stat info;
+    if(fstat(file, &info) != 0 || size_t(info.st_size) < sizeof(CalibrationFileHeader))
+    {
+        close(file);
+        return false;
+    }
+
+    size_t length = size_t(info.st_size);
+    void* mapping = mmap(NULL, length, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if(mapping == MAP_FAILED)
+        return false;
+
+    shared_ptr<void> storage(mapping, [length](void* address) { munmap(address, length); });
+
+    const CalibrationFileHeader& header = *(const CalibrationFileHeader*)mapping;
+    uint64_t pixels = uint64_t(max(0, header.width)) * uint64_t(max(0, header.height));
+
+    if(memcmp(header.magic, calibrationFileMagic, sizeof(header.magic)) != 0 || header.version != calibrationFileVersion ||
+       header.headerBytes != sizeof(CalibrationFileHeader) || pixels == 0 ||
+       header.distortionCount < 0 || header.distortionCount > 14 ||
+       header.mapBytes != pixels * 4 || header.interpolationBytes != pixels * 2 ||
+       header.mapOffset + header.mapBytes > length || header.interpolationOffset + header.interpolationBytes > length)
+        return false;
+
+    char* base = (char*)mapping;
+
+    calibration.resolution = Size(header.width, header.height);
+    calibration.cameraMatrix = Mat(3, 3, CV_64F, (void*)header.cameraMatrix);
+    calibration.distanceCoefficients = Mat(header.distortionCount, 1, CV_64F, (void*)header.distortion);
+    calibration.undistortMap = Mat(header.height, header.width, CV_16SC2, base + header.mapOffset);
+    calibration.undistortInterpolation = Mat(header.height, header.width, CV_16UC1, base + header.interpolationOffset);
+    calibration.storage = storage;
+
+    return true;
+}
+
+bool cameraCalibration(const vector<Mat>& calibrationImages, Size boardSize, float squareEdgeLength, Mat& cameraMatrix, Mat& distanceCoefficients )
+{
+    vector<vector<Point2f>> checkerboardImageSpacePoints;
+    vector<ChessboardDetection> detections;
+
+    //false bcz we dont want to see the output
+    getChessboardCorners(calibrationImages, boardSize, checkerboardImageSpacePoints, detections, false);
+    printChessboardDetections(detections);
+
+    if(checkerboardImageSpacePoints.empty())
+    {
+        cerr << "No image shows the whole board, nothing to calibrate from" << endl;
+        return false;
+    }
+
+    // 3D coordinates
+    vector<vector<Point3f>> worldSpaceCornerPoints(1);
+
+    // Extract the 3D coordinates relative to the board size
+    createKnownBoardPosition(boardSize, squareEdgeLength, worldSpaceCornerPoints[0]);
+
+    // We resize the world space corners
+    worldSpaceCornerPoints.resize(checkerboardImageSpacePoints.size(), worldSpaceCornerPoints[0]);
+
+    vector<Mat> rVectors, tVectors;
+
+    distanceCoefficients = Mat::zeros(8,1,CV_64F);
+
+    //We calibrate the camera, all the images come from the same camera and have the same size
+    calibrateCamera(worldSpaceCornerPoints, checkerboardImageSpacePoints, calibrationImages[0].size(), cameraMatrix, distanceCoefficients, rVectors, tVectors);
+
+    return true;
+}
+
+// Raised by Ctrl+C, the live loop then stops like it does on a key press
+volatile sig_atomic_t interruptRequested = 0;
+
+void requestInterrupt(int)
+{
+    interruptRequested = 1;
+}
+
+// What the preview of the live loop draws: a frame and the poses found in it
+struct RenderSnapshot
+{
+    Mat frame;
+    vector<Vec3d> rotationVectors, translationVectors;     // markers, then the boards that have a pose
+    size_t sequence = 0;
+    chrono::steady_clock::time_point captured;
+};
+
+// A frame of the live loop's capture thread, stamped when the source returned it
+struct CapturedFrame
+{
+    Mat frame;
+    size_t sequence = 0;
+    chrono::steady_clock::time_point captured;
+};
+
+/*
+ * Tracks aruco markers live, on three threads. The capture thread reads frames as the camera delivers
+ * them and hands over only the newest through a triple buffer: a frame the detection thread did not
+ * take before the next one arrived is dropped as stale, so poses are always made from the freshest
+ * frame and come out with their age since capture. A video file or an image directory drops nothing,
+ * its capture waits for each frame to be taken. The detection thread detects and poses. The preview
+ * stays on the calling thread, highgui windows belong to the thread that created them: it takes the
+ * latest frame and poses through another triple buffer and draws them at the pace of the display, or
+ * at --preview-rate, so drawAxis, imshow and a slow X server never hold up detection. Without a
+ * display, or with --no-preview, there is no window and frames are not even handed over.
+ */
+int startWebCameraMonitoring(const Mat& cameraMatrix, const Mat& distanceCoefficients, float arucoSquareDimensions, const TrackerOptions& options)
+{
+    // Markers of a board are posed with it, the others one by one
+    vector<MarkerBoard> boards;
+    if(!loadBoardLayouts(options, boards))
+        return -1;
+
+    // The dictionary, the detector parameters and the state of the detection mode
+    MarkerTracker tracker;
+    if(!createMarkerTracker(options, tracker))
+        return -1;
+
+    // We capture the video, from the webcam unless a file or a directory is given
+    FrameSource vid;
+
+    if(!vid.open(options.input))
+    {
+        return -1;
+    }
+
+    if(options.undistort && !vid.undistortWith(options.calibrationFile))
+        return -1;
+
+    if(options.luma)
+        vid.lumaOnly();
+
+    // Poses leave through a writer thread, detection never waits on the reader
+    PoseStream poseStream;
+    if(!poseStream.open(options))
+        return -1;
+
+    bool preview = options.preview;
+    if(preview && getenv("DISPLAY") == NULL && getenv("WAYLAND_DISPLAY") == NULL)
+    {
+        cerr << "No display, tracking without a preview window, Ctrl+C stops" << endl;
+        preview = false;
+    }
+
+    // Where the time of each frame goes, exported while running when a metrics file is given
+    typedef chrono::steady_clock Clock;
+    StageMetrics metrics;
+    startStageMetrics(options, metrics);
+
+    // Allocation counts at the same points as the clock, only kept with --count-allocations
+    AllocationStats allocations;
+    startAllocationCounting(options, allocations);
+
+    TripleBuffer<CapturedFrame> capturedFrames;
+    TripleBuffer<RenderSnapshot> snapshots;
+    atomic<bool> stop(false), captureFinished(false), finished(false);
+    size_t capturedCount = 0, detectedFrames = 0;
+    bool dropStale = vid.isCamera();
+
+    interruptRequested = 0;
+    signal(SIGINT, requestInterrupt);
+
+    // Undistortion and luma extraction happen here too, off the detection thread
+    thread captureThread([&]()
+    {
+        backgroundThread = true;
+
+        int spins = 0;
+        while(!stop.load(memory_order_relaxed))
+        {
+            CapturedFrame& slot = capturedFrames.writeBuffer();
+            if(!vid.read(slot.frame))
+                break;
+
+            slot.captured = Clock::now();
+            slot.sequence = capturedCount++;
+
+            // A file has no stale frames, every one of them is detected
+            while(!dropStale && capturedFrames.pending() && !stop.load(memory_order_relaxed))
+                waitBriefly(spins);
+            spins = 0;
+
+            capturedFrames.publish();
+        }
+
+        captureFinished.store(true);
+    });
+
+    thread detectionThread([&]()
+    {
+        vector<int> markerIds, looseIds;
+        vector<vector<Point2f>> markerCorners, looseCorners;
+        vector<Vec3d> rotationVectors, translationVectors;
+        size_t allocationMarks[STAGE_DISPLAY + 2];
+
+        while(!stop.load(memory_order_relaxed))
+        {
+            Clock::time_point frameStart = Clock::now();
+            allocationMarks[0] = allocationCount();
+
+            // Waits for a frame newer than the last one, the capture may publish its last frame right before it finishes
+            bool taken = capturedFrames.update();
+            int spins = 0;
+            while(!taken && !stop.load(memory_order_relaxed))
+            {
+                bool ended = captureFinished.load();
+                taken = capturedFrames.update();
+                if(taken || ended)
+                    break;
+
+                waitBriefly(spins);
+            }
+
+            if(!taken)
+                break;
+
+            CapturedFrame& input = capturedFrames.readBuffer();
+            Mat& image = input.frame;
+            Clock::time_point captured = input.captured;
+            Clock::time_point received = Clock::now();
+            allocationMarks[1] = allocationCount();
+
+            // Detect the markers and estimate the pose of given marker
+            detectTrackedMarkers(image, tracker, markerCorners, markerIds);
+            Clock::time_point detected = Clock::now();
+            allocationMarks[2] = allocationCount();
+
+            estimateBoardPoses(markerCorners, markerIds, cameraMatrix, distanceCoefficients, boards, looseCorners, looseIds);
+            estimateMarkerPoses(looseCorners, arucoSquareDimensions, cameraMatrix, distanceCoefficients, options.poseEngine, rotationVectors, translationVectors);
+            poseStream.publish(0, captured, looseIds, looseCorners, rotationVectors, translationVectors);
+            poseStream.publishBoards(0, captured, boards);
+            Clock::time_point posed = Clock::now();
+            allocationMarks[3] = allocationCount();
+
+            if(preview)
+            {
+                // The frame changes places with the slot's previous one, the capture reads into that buffer next
+                RenderSnapshot& snapshot = snapshots.writeBuffer();
+                swap(snapshot.frame, image);
+
+                // Assignments reuse the capacity the slot kept from its previous frames. The posed boards follow
+                // the loose markers, the preview draws the axes of both the same way.
+                snapshot.rotationVectors = rotationVectors;
+                snapshot.translationVectors = translationVectors;
+                for(size_t b = 0; b < boards.size(); b++)
+                {
+                    if(!boards[b].hasPose)
+                        continue;
+
+                    snapshot.rotationVectors.push_back(boards[b].rotation);
+                    snapshot.translationVectors.push_back(boards[b].translation);
+                }
+
+                snapshot.sequence = input.sequence;
+                snapshot.captured = captured;
+                snapshots.publish();
+            }
+            detectedFrames++;
+
+            // Capture, drawing and display happen on their own threads, their allocations fall into the stage running meanwhile
+            allocationMarks[4] = allocationMarks[5] = allocationCount();
+            recordFrameAllocations(allocations, allocationMarks);
+
+            // Capture is the wait for a fresh frame, age the time from its capture to its poses
+            recordStage(metrics, STAGE_CAPTURE, frameStart, received);
+            recordStage(metrics, STAGE_DETECT, received, detected);
+            recordStage(metrics, STAGE_POSE, detected, posed);
+            recordStage(metrics, STAGE_TOTAL, frameStart, posed);
+            recordStage(metrics, STAGE_AGE, captured, posed);
+            exportStageMetricsIfDue(metrics);
+        }
+
+        finished.store(true);
+    });
+
+    size_t drawnFrames = 0;
+    backgroundThread = true;
+    if(preview)
+    {
+        namedWindow("Webcam", 1000);
+
+        Clock::duration previewPeriod = Clock::duration::zero();
+        if(options.previewRate > 0.0)
+            previewPeriod = chrono::duration_cast<Clock::duration>(chrono::duration<double>(1.0 / options.previewRate));
+
+        Mat colorFrame;     // what the overlay is drawn on when the frames are luma only
+        Clock::time_point nextDraw = Clock::now();
+        while(!finished.load() && !interruptRequested)
+        {
+            // Only pumps the window events while there is nothing new or it is too early to draw
+            if(Clock::now() < nextDraw || !snapshots.update())
+            {
+                if(waitKey(1) >= 0)
+                    break;
+                continue;
+            }
+
+            Clock::time_point drawStart = Clock::now();
+            RenderSnapshot& snapshot = snapshots.readBuffer();
+            Mat& display = overlayFrame(snapshot.frame, colorFrame);
+            for(size_t i = 0; i < snapshot.rotationVectors.size(); i++)
+            {
+                aruco::drawAxis(display, cameraMatrix, distanceCoefficients, snapshot.rotationVectors[i], snapshot.translationVectors[i], 0.1f);
+            }
+            Clock::time_point drawn = Clock::now();
+
+            imshow("Webcam", display);
+            int key = waitKey(1);
+            Clock::time_point displayed = Clock::now();
+
+            recordStage(metrics, STAGE_DRAW, drawStart, drawn);
+            recordStage(metrics, STAGE_DISPLAY, drawn, displayed);
+            drawnFrames++;
+            nextDraw = drawStart + previewPeriod;
+
+            if(key >= 0)
+                break;
+        }
+    }
+    else
+    {
+        while(!finished.load() && !interruptRequested)
+            this_thread::sleep_for(chrono::milliseconds(10));
+    }
+
+    stop.store(true);
+    captureThread.join();
+    detectionThread.join();
+    signal(SIGINT, SIG_DFL);
+    backgroundThread = false;
+
+    cout << "Capture: " << detectedFrames << " of " << capturedCount << " frames detected, "
+         << capturedFrames.skippedCount() << " dropped as stale because a newer one arrived first" << endl;
+
+    if(preview)
+    {
+        cout << "Preview: " << drawnFrames << " of " << detectedFrames << " frames drawn, "
+             << snapshots.skippedCount() << " replaced by a newer one before the preview took them" << endl;
+    }
+
+    printTrackerStatistics(tracker);
+    printBoardStatistics(boards);
+    printStageMetrics(metrics);
+    exportStageMetrics(metrics);
+    printAllocationStats(allocations);
+
+    poseStream.close();
+    poseStream.printStatistics();
+
+    return 1;
+}
+
+// Runs detection and pose estimation over a video file or an image directory as fast as possible, without any window
+int startHeadlessReplay(const TrackerOptions& options, const Mat& cameraMatrix, const Mat& distanceCoefficients, float arucoSquareDimensions)
+{
+    typedef chrono::steady_clock Clock;
+
+    Mat frame;
+
+    vector<int> markerIds;
+    vector<vector<Point2f>> markerCorners;
+    vector<Vec3d> rotationVectors, translationVectors;
+
+    vector<MarkerBoard> boards;
+    vector<int> looseIds;
+    vector<vector<Point2f>> looseCorners;
+    if(!loadBoardLayouts(options, boards))
+        return -1;
+
+    MarkerTracker tracker;
+    if(!createMarkerTracker(options, tracker))
+        return -1;
+
+    // Full-frame detection to compare the tracking mode against
+    vector<int> referenceIds;
+    vector<vector<Point2f>> referenceCorners;
+    size_t mismatchedFrames = 0;
+
+    PoseEngineComparison poseComparison;
+
+    FrameSource source;
+    if(!source.open(options.input))
+    {
+        cerr << "Could not open " << options.input << endl;
+        return -1;
+    }
+
+    if(options.undistort && !source.undistortWith(options.calibrationFile))
+        return -1;
+
+    if(options.luma)
+        source.lumaOnly();
+
+    PoseStream poseStream;
+    if(!poseStream.open(options))
+        return -1;
+
+    // Per-frame timings in milliseconds
+    vector<double> readTimes, detectTimes, poseTimes, totalTimes;
+    vector<size_t> markerCounts;
+
+    Clock::time_point replayStart = Clock::now();
+
+    while(true)
+    {
+        Clock::time_point frameStart = Clock::now();
+
+        if(!source.read(frame))
+            break;
+
+        Clock::time_point readDone = Clock::now();
+
+        detectTrackedMarkers(frame, tracker, markerCorners, markerIds);
+
+        Clock::time_point detectDone = Clock::now();
+
+        estimateBoardPoses(markerCorners, markerIds, cameraMatrix, distanceCoefficients, boards, looseCorners, looseIds);
+        estimateMarkerPoses(looseCorners, arucoSquareDimensions, cameraMatrix, distanceCoefficients, options.poseEngine, rotationVectors, translationVectors);
+        poseStream.publish(0, readDone, looseIds, looseCorners, rotationVectors, translationVectors);
+        poseStream.publishBoards(0, readDone, boards);
+
+        Clock::time_point poseDone = Clock::now();
+
+        readTimes.push_back(chrono::duration<double, milli>(readDone - frameStart).count());
+        detectTimes.push_back(chrono::duration<double, milli>(detectDone - readDone).count());
+        poseTimes.push_back(chrono::duration<double, milli>(poseDone - detectDone).count());
+        totalTimes.push_back(chrono::duration<double, milli>(poseDone - frameStart).count());
+        markerCounts.push_back(markerIds.size());
+
+        // Outside the timed section so the verification does not skew the numbers
+        if(options.verifyDetection)
+        {
+            aruco::detectMarkers(frame, tracker.dictionary, referenceCorners, referenceIds, tracker.parameters);
+
+            if(!sameMarkerIds(markerIds, referenceIds))
+            {
+                mismatchedFrames++;
+                cerr << "Frame " << totalTimes.size() - 1 << ": " << markerIds.size() << " markers, full frame finds " << referenceIds.size() << endl;
+            }
+        }
+
+        if(options.comparePoseEngines)
+            comparePoseEngines(markerCorners, arucoSquareDimensions, cameraMatrix, distanceCoefficients, poseComparison);
+    }
+
+    double elapsedSeconds = chrono::duration<double>(Clock::now() - replayStart).count();
+    size_t frameCount = totalTimes.size();
+
+    if(frameCount == 0)
+    {
+        cerr << "No frames could be read from " << options.input << endl;
+        return -1;
+    }
+
+    size_t totalMarkers = 0;
+    for(size_t i = 0; i < frameCount; i++)
+        totalMarkers += markerCounts[i];
+
+    cout << fixed << setprecision(2);
+    cout << "Frames: " << frameCount << " in " << elapsedSeconds << " s, " << frameCount / elapsedSeconds << " frames/s" << endl;
+    cout << "Markers per frame: " << double(totalMarkers) / frameCount << endl;
+    printTimingSummary("read", readTimes);
+    printTimingSummary("detect", detectTimes);
+    printTimingSummary("pose", poseTimes);
+    printTimingSummary("total", totalTimes);
+    printTrackerStatistics(tracker);
+    printBoardStatistics(boards);
+
+    if(options.verifyDetection)
+        cout << "Frames whose IDs differ from a full-frame search: " << mismatchedFrames << " of " << frameCount << endl;
+
+    if(options.comparePoseEngines)
+        printPoseEngineComparison(poseComparison);
+
+    poseStream.close();
+    poseStream.printStatistics();
+
+    // Per-frame timings for plotting
+    if(!options.timingsFile.empty())
+    {
+        ofstream outStream(options.timingsFile);
+        if(!outStream)
+        {
+            cerr << "Could not write " << options.timingsFile << endl;
+            return -1;
+        }
+
+        outStream << "frame,markers,read_ms,detect_ms,pose_ms,total_ms" << endl;
+        for(size_t i = 0; i < frameCount; i++)
+        {
+            outStream << i << "," << markerCounts[i] << "," << readTimes[i] << "," << detectTimes[i] << ","
+                      << poseTimes[i] << "," << totalTimes[i] << endl;
+        }
+    }
+
+    return 1;
+}
+
+// Prints mean, min, percentiles and max of timings given in milliseconds
+void printTimingSummary(const string& label, vector<double> samples)
+{
+    if(samples.empty())
+        return;
+
+    sort(samples.begin(), samples.end());
+
+    double sum = 0.0;
+    for(size_t i = 0; i < samples.size(); i++)
+        sum += samples[i];
+
+    size_t last = samples.size() - 1;
+
+    cout << setw(8) << label << " ms:"
+         << " mean " << sum / samples.size()
+         << " min " << samples[0]
+         << " p50 " << samples[last / 2]
+         << " p90 " << samples[last * 90 / 100]
+         << " p99 " << samples[last * 99 / 100]
+         << " max " << samples[last] << endl;
+}
+
+/*
+ * Synthetic scenes built from the 4x4Marker_*.jpg images (or .png), so detection speed and accuracy can be
+ * measured without a camera. Every marker is placed with a known pose in front of a synthetic
+ * pinhole camera, which gives exact corners and poses to compare the tracker's output against.
+ */
+int startSyntheticBenchmark(const TrackerOptions& options, float arucoSquareDimensions)
+{
+    typedef chrono::steady_clock Clock;
+
+    vector<Mat> markerImages;
+    string directory = options.input.empty() ? string(".") : options.input;
+    if(!loadMarkerImages(directory, markerImages))
+        return -1;
+
+    const Size resolutions[] = { Size(640, 480), Size(1280, 720), Size(1920, 1080), Size(3840, 2160) };
+    const int markerCounts[] = { 1, 10, 50 };
+    const char* degradations[] = { "clean", "blur", "noise", "lighting", "all" };
+    int framesPerCase = max(1, options.benchmarkFrames);
+
+    // The same seed gives the same scenes, so two builds can be compared frame for frame
+    RNG rng(options.benchmarkSeed);
+
+    ofstream csvStream;
+    if(!options.timingsFile.empty())
+    {
+        csvStream.open(options.timingsFile);
+        if(!csvStream)
+        {
+            cerr << "Could not write " << options.timingsFile << endl;
+            return -1;
+        }
+        csvStream << "width,height,markers,degradation,frames,frames_per_s,detect_ms,pose_ms,recall,false_positives,corner_rms_px,rotation_error_deg,translation_error_pct" << endl;
+    }
+
+    cout << fixed << setprecision(2);
+    cout << "Synthetic benchmark, " << framesPerCase << " frames per case, detector " << options.detector << ", mode " << options.detectionMode;
+    if(options.detector == "integral")
+        cout << ", quads from " << options.quadFinder;
+    cout << endl;
+    cout << " resolution markers degradation   frames/s  detect ms  pose ms  recall  false+  corner px  rot deg  trans %" << endl;
+
+    for(int r = 0; r < 4; r++)
+    {
+        Size resolution = resolutions[r];
+
+        // Camera with a 64 degree horizontal field of view and no distortion
+        double focal = 0.8 * resolution.width;
+        Mat cameraMatrix = (Mat_<double>(3, 3) << focal, 0, resolution.width / 2.0, 0, focal, resolution.height / 2.0, 0, 0, 1);
+        Mat distanceCoefficients = Mat::zeros(5, 1, CV_64F);
+
+        for(int c = 0; c < 3; c++)
+        {
+            int markerCount = markerCounts[c];
+
+            for(int d = 0; d < 5; d++)
+            {
+                string degradation = degradations[d];
+
+                // A fresh tracker per case so a tracking mode does not carry markers over from the previous one
+                MarkerTracker tracker;
+                if(!createMarkerTracker(options, tracker))
+                    return -1;
+
+                Mat frame;
+                vector<SyntheticMarker> truth;
+                vector<int> markerIds;
+                vector<vector<Point2f>> markerCorners;
+                vector<Vec3d> rotationVectors, translationVectors;
+
+                double detectMilliseconds = 0.0, poseMilliseconds = 0.0;
+                size_t expected = 0, found = 0, falsePositives = 0;
+                double squaredCornerError = 0.0, rotationError = 0.0, translationError = 0.0;
+
+                for(int f = 0; f < framesPerCase; f++)
+                {
+                    renderSyntheticScene(markerImages, resolution, markerCount, degradation, cameraMatrix, arucoSquareDimensions, rng, frame, truth);
+
+                    Clock::time_point start = Clock::now();
+                    detectTrackedMarkers(frame, tracker, markerCorners, markerIds);
+                    Clock::time_point detected = Clock::now();
+                    estimateMarkerPoses(markerCorners, arucoSquareDimensions, cameraMatrix, distanceCoefficients, options.poseEngine, rotationVectors, translationVectors);
+                    Clock::time_point posed = Clock::now();
+
+                    detectMilliseconds += chrono::duration<double, milli>(detected - start).count();
+                    poseMilliseconds += chrono::duration<double, milli>(posed - detected).count();
+
+                    // Every id is placed at most once, a second detection of it is as wrong as an id that is not there
+                    vector<bool> matched(truth.size(), false);
+                    expected += truth.size();
+                    for(size_t i = 0; i < markerIds.size(); i++)
+                    {
+                        size_t t = 0;
+                        while(t < truth.size() && truth[t].id != markerIds[i])
+                            t++;
+
+                        if(t == truth.size() || matched[t])
+                        {
+                            falsePositives++;
+                            continue;
+                        }
+
+                        matched[t] = true;
+                        found++;
+
+                        for(int k = 0; k < 4; k++)
+                        {
+                            Point2f error = markerCorners[i][k] - truth[t].corners[k];
+                            squaredCornerError += error.dot(error);
+                        }
+
+                        rotationError += rotationAngleBetween(rotationVectors[i], truth[t].rotation);
+                        translationError += norm(translationVectors[i] - truth[t].translation) / norm(truth[t].translation);
+                    }
+                }
+
+                double framesPerSecond = framesPerCase * 1000.0 / max(detectMilliseconds + poseMilliseconds, 1e-9);
+                double recall = expected == 0 ? 0.0 : double(found) / expected;
+                double cornerRms = found == 0 ? 0.0 : sqrt(squaredCornerError / (4.0 * found));
+                double meanRotationError = found == 0 ? 0.0 : rotationError / found;
+                double meanTranslationError = found == 0 ? 0.0 : 100.0 * translationError / found;
+
+                cout << setw(5) << resolution.width << "x" << setw(4) << left << resolution.height << right
+                     << setw(8) << markerCount << " " << setw(11) << left << degradation << right
+                     << setw(11) << framesPerSecond
+                     << setw(11) << detectMilliseconds / framesPerCase
+                     << setw(9) << poseMilliseconds / framesPerCase
+                     << setw(8) << recall
+                     << setw(8) << falsePositives
+                     << setw(11) << cornerRms
+                     << setw(9) << meanRotationError
+                     << setw(9) << meanTranslationError << endl;
+
+                if(csvStream)
+                {
+                    csvStream << resolution.width << "," << resolution.height << "," << markerCount << "," << degradation << ","
+                              << framesPerCase << "," << framesPerSecond << "," << detectMilliseconds / framesPerCase << ","
+                              << poseMilliseconds / framesPerCase << "," << recall << "," << falsePositives << ","
+                              << cornerRms << "," << meanRotationError << "," << meanTranslationError << endl;
+                }
+            }
+        }
+    }
+
+    return 1;
+}
+
+// Reads 4x4Marker_0.jpg ... 4x4Marker_49.jpg, as written by createArucoMarkers, from a directory, or the same names as .png
+bool loadMarkerImages(const string& directory, vector<Mat>& markerImages)
+{
+    markerImages.clear();
+
+    for(int id = 0; id < 50; id++)
+    {
+        ostringstream convert;
+        convert << directory << "/4x4Marker_" << id;
+
+        Mat image = imread(convert.str() + ".jpg", IMREAD_GRAYSCALE);
+        if(image.empty())
+            image = imread(convert.str() + ".png", IMREAD_GRAYSCALE);
+        if(image.empty())
+        {
+            cerr << "Could not read " << convert.str() << ".jpg nor .png" << endl;
+            return false;
+        }
+
+        // The jpeg compression leaves grey pixels, the markers are black and white
+        threshold(image, image, 127, 255, THRESH_BINARY);
+        markerImages.push_back(image);
+    }
+
+    return true;
+}
+
+/*
+ * Renders markerCount different markers, one per cell of a grid over the frame, each with a random
+ * tilt, roll and size in front of the camera. The corners and poses they were placed with are
+ * returned in truth, in the order aruco::detectMarkers and estimatePoseSingleMarkers use.
+ * Degradations: blur (Gaussian), noise (Gaussian), lighting (uneven gain and offset) or all of them.
+ */
+void renderSyntheticScene(const vector<Mat>& markerImages, Size resolution, int markerCount, const string& degradation, const Mat& cameraMatrix, float markerLength, RNG& rng, Mat& frame, vector<SyntheticMarker>& truth)
+{
+    // Background: a grey level with slow variations, nothing with straight edges
+    Mat texture(4, 4, CV_8UC1), background;
+    rng.fill(texture, RNG::UNIFORM, 60, 200);
+    resize(texture, background, resolution, 0, 0, INTER_CUBIC);
+
+    // Distinct ids, so each placed marker can only be matched once
+    vector<int> ids(markerImages.size());
+    for(size_t i = 0; i < ids.size(); i++)
+        ids[i] = int(i);
+    for(size_t i = ids.size() - 1; i > 0; i--)
+        swap(ids[i], ids[rng.uniform(0, int(i) + 1)]);
+
+    markerCount = min(markerCount, int(ids.size()));
+
+    int columns = max(1, int(ceil(sqrt(markerCount * double(resolution.width) / resolution.height))));
+    int rows = (markerCount + columns - 1) / columns;
+    double cellWidth = double(resolution.width) / columns;
+    double cellHeight = double(resolution.height) / rows;
+    double cellSize = min(cellWidth, cellHeight);
+
+    double focal = cameraMatrix.at<double>(0, 0);
+    Matx33d inverseCamera = Matx33d(cameraMatrix.ptr<double>()).inv();
+
+    float half = 0.5f * markerLength;
+    vector<Point3f> objectCorners = { Point3f(-half, half, 0), Point3f(half, half, 0), Point3f(half, -half, 0), Point3f(-half, -half, 0) };
+
+    truth.clear();
+    for(int m = 0; m < markerCount; m++)
+    {
+        SyntheticMarker marker;
+        marker.id = ids[m];
+
+        // Tilted up to 40 degrees about an axis in the marker plane, then rolled about its normal
+        double tiltAxis = rng.uniform(0.0, 2.0 * CV_PI);
+        double tilt = rng.uniform(0.0, 40.0) * CV_PI / 180.0;
+        double roll = rng.uniform(0.0, 2.0 * CV_PI);
+
+        Matx33d tiltRotation, rollRotation;
+        Rodrigues(Vec3d(cos(tiltAxis), sin(tiltAxis), 0) * tilt, tiltRotation);
+        Rodrigues(Vec3d(0, 0, roll), rollRotation);
+
+        // The marker faces the camera, whose z axis looks into the scene
+        Matx33d facing(1, 0, 0, 0, -1, 0, 0, 0, -1);
+        Matx33d rotation = tiltRotation * facing * rollRotation;
+        Rodrigues(rotation, marker.rotation);
+
+        // Centre somewhere in the middle of its cell, at the distance that gives it the chosen size
+        double side = cellSize * rng.uniform(0.35, 0.55);
+        double u = (m % columns + rng.uniform(0.4, 0.6)) * cellWidth;
+        double v = (m / columns + rng.uniform(0.4, 0.6)) * cellHeight;
+        double distance = focal * markerLength / side;
+        marker.translation = Vec3d(inverseCamera * Vec3d(u, v, 1.0)) * distance;
+
+        projectPoints(objectCorners, marker.rotation, marker.translation, cameraMatrix, noArray(), marker.corners);
+
+        // A white margin of one cell around the marker, its outer corners are the marker's corners
+        const Mat& image = markerImages[marker.id];
+        int margin = image.cols / 6;
+        Mat padded;
+        copyMakeBorder(image, padded, margin, margin, margin, margin, BORDER_CONSTANT, Scalar::all(255));
+
+        // Pixel centres sit half a pixel inside the marker's outer edges
+        float low = margin - 0.5f, high = margin + image.cols - 0.5f;
+        Point2f imageCorners[4] = { Point2f(low, low), Point2f(high, low), Point2f(high, high), Point2f(low, high) };
+        Matx33d homography = getPerspectiveTransform(imageCorners, marker.corners.data());
+
+        // Only warp over the part of the frame the padded marker covers
+        vector<Point2f> paddedCorners = { Point2f(-0.5f, -0.5f), Point2f(padded.cols - 0.5f, -0.5f),
+                                          Point2f(padded.cols - 0.5f, padded.rows - 0.5f), Point2f(-0.5f, padded.rows - 0.5f) };
+        perspectiveTransform(paddedCorners, paddedCorners, homography);
+        Rect covered = boundingRect(paddedCorners) & Rect(Point(0, 0), resolution);
+        if(covered.area() == 0)
+            continue;
+
+        Matx33d shift(1, 0, -covered.x, 0, 1, -covered.y, 0, 0, 1);
+        Mat coveredPart = background(covered);
+        warpPerspective(padded, coveredPart, shift * homography, covered.size(), INTER_LINEAR, BORDER_TRANSPARENT);
+
+        truth.push_back(marker);
+    }
+
+    bool all = degradation == "all";
+
+    if(all || degradation == "lighting")
+    {
+        // Gain from 0.4 to 1.1 across the frame and a random offset, like a lamp on one side
+        Mat gainSeeds(2, 2, CV_32FC1), gain, lit;
+        rng.fill(gainSeeds, RNG::UNIFORM, 0.4, 1.1);
+        resize(gainSeeds, gain, resolution, 0, 0, INTER_LINEAR);
+
+        background.convertTo(lit, CV_32F);
+        lit = lit.mul(gain) + rng.uniform(-20.0, 20.0);
+        lit.convertTo(background, CV_8U);
+    }
+
+    if(all || degradation == "blur")
+        GaussianBlur(background, background, Size(0, 0), 1.5);
+
+    if(all || degradation == "noise")
+    {
+        Mat noise(resolution, CV_16SC1), noisy;
+        rng.fill(noise, RNG::NORMAL, 0, 10);
+
+        background.convertTo(noisy, CV_16S);
+        noisy += noise;
+        noisy.convertTo(background, CV_8U);
+    }
+
+    // Camera frames are BGR, converting back is part of what the detector costs
+    cvtColor(background, frame, COLOR_GRAY2BGR);
+}
+
+// Angle in degrees of the rotation that takes one rotation vector to the other
+double rotationAngleBetween(const Vec3d& first, const Vec3d& second)
+{
+    Matx33d firstRotation, secondRotation;
+    Rodrigues(first, firstRotation);
+    Rodrigues(second, secondRotation);
+
+    Matx33d difference = firstRotation.t() * secondRotation;
+    double cosine = max(-1.0, min(1.0, 0.5 * (difference(0, 0) + difference(1, 1) + difference(2, 2) - 1.0)));
+
+    return acos(cosine) * 180.0 / CV_PI;
+}
+
+// One frame travelling through the pipeline stages
+struct PipelineFrame
+{
+    size_t sequence = 0;
+    Mat frame;
+    vector<int> markerIds;
+    vector<vector<Point2f>> markerCorners;
+    vector<Vec3d> rotationVectors, translationVectors;
+    int cameraId = 0;
+    chrono::steady_clock::time_point captured, posed;
+};
+
+/*
+ * Frames of the pipeline are recycled instead of built for every capture: once rendered, a frame
+ * goes back here with its image buffer and the capacity of its vectors, the capture reads the next
+ * image into it and VideoCapture reuses the buffer as long as the frame size does not change.
+ * When every frame is in flight the capture gets a new one, counted as a miss.
+ */
+class FramePool
+{
+public:
+    explicit FramePool(size_t capacity) : frames(capacity), misses(0) {}
+
+    void acquire(PipelineFrame& item);
+    void release(PipelineFrame& item);
+
+    size_t missCount() const { return misses.load(memory_order_relaxed); }
+
+private:
+    BoundedQueue<PipelineFrame> frames;
+    atomic<size_t> misses;
+};
+
+void FramePool::acquire(PipelineFrame& item)
+{
+    if(!frames.tryPop(item))
+    {
+        item = PipelineFrame();
+        misses.fetch_add(1, memory_order_relaxed);
+    }
+}
+
+void FramePool::release(PipelineFrame& item)
+{
+    // A full pool drops the frame, more frames were in flight than it was sized for
+    frames.tryPush(item);
+}
+
+/*
+ * Capture -> detect -> pose -> render on separate threads.
+ * The capture thread numbers the frames, several detection workers run detectMarkers in parallel,
+ * the pose thread puts the frames back in order before estimating poses and the calling thread
+ * renders them (or only counts them when headless). Bounded queues sit between the stages, a full
+ * queue makes the stage in front of it wait and is reported at the end.
+ */
+int startTrackingPipeline(const TrackerOptions& options, const Mat& cameraMatrix, const Mat& distanceCoefficients, float arucoSquareDimensions)
+{
+    typedef chrono::steady_clock Clock;
+
+    FrameSource source;
+    if(!source.open(options.input))
+    {
+        cerr << "Could not open " << (options.input.empty() ? string("the webcam") : options.input) << endl;
+        return -1;
+    }
+
+    if(options.undistort && !source.undistortWith(options.calibrationFile))
+        return -1;
+
+    if(options.luma)
+        source.lumaOnly();
+
+    MarkerTracker tracker;
+    if(!createMarkerTracker(options, tracker))
+        return -1;
+
+    int workerCount = max(1, options.detectionWorkers);
+
+    // A tracking mode needs the result of the previous frame, so frames cannot be spread over several workers.
+    // The pyramid mode only keeps a smoothed marker size, each worker can keep its own.
+    if((tracker.mode == DETECT_ROI_TRACKING || tracker.mode == DETECT_FLOW_TRACKING) && workerCount > 1)
+    {
+        cerr << "Detection mode " << options.detectionMode << " keeps state between frames, using 1 detection worker" << endl;
+        workerCount = 1;
+    }
+
+    // Each worker owns a copy, they only share the dictionary and the parameters, which detection does not modify
+    vector<MarkerTracker> workerTrackers(workerCount, tracker);
+
+    size_t queueDepth = size_t(max(2, options.queueDepth));
+
+    BoundedQueue<PipelineFrame> detectQueue(queueDepth), poseQueue(queueDepth), renderQueue(queueDepth);
+
+    // Frames between capture and pose: a full detect queue, one per worker, a full pose queue and the one
+    // the capture holds. The capture waits for the pose thread rather than run further ahead, so the
+    // frames waiting to be put back in order fit a ring indexed by sequence.
+    size_t framesBeforePose = 2 * queueDepth + workerCount + 1;
+
+    // Enough frames for those, a full render queue and the ones the pose and render threads hold
+    FramePool framePool(framesBeforePose + queueDepth + 2);
+
+    atomic<bool> stop(false);
+    atomic<bool> captureFinished(false);
+    atomic<size_t> capturedFrames(0);
+    atomic<size_t> posedFrames(0);
+    atomic<int> runningWorkers(workerCount);
+    atomic<bool> poseFinished(false);
+
+    // Every stage records into the same histograms, the calling thread exports them
+    StageMetrics metrics;
+    startStageMetrics(options, metrics);
+
+    // Fed by the pose thread, its only producer
+    PoseStream poseStream;
+    if(!poseStream.open(options))
+        return -1;
+
+    thread captureThread([&]()
+    {
+        size_t sequence = 0;
+
+        PipelineFrame item;
+        int spins = 0;
+        while(!stop.load())
+        {
+            while(sequence >= posedFrames.load(memory_order_acquire) + framesBeforePose && !stop.load())
+                waitBriefly(spins);
+            spins = 0;
+
+            framePool.acquire(item);
+            Clock::time_point readStart = Clock::now();
+            if(!source.read(item.frame))
+                break;
+
+            item.sequence = sequence;
+            item.captured = Clock::now();
+            recordStage(metrics, STAGE_CAPTURE, readStart, item.captured);
+
+            if(!detectQueue.push(item, stop))
+                break;
+
+            sequence++;
+        }
+
+        capturedFrames.store(sequence);
+        captureFinished.store(true);
+    });
+
+    vector<thread> detectionThreads;
+    for(int w = 0; w < workerCount; w++)
+    {
+        detectionThreads.push_back(thread([&, w]()
+        {
+            MarkerTracker& workerTracker = workerTrackers[w];
+            PipelineFrame item;
+            int spins = 0;
+
+            while(!stop.load())
+            {
+                if(!detectQueue.tryPop(item))
+                {
+                    // Check the flag before the queue so a frame pushed just before the end is not missed
+                    bool finished = captureFinished.load();
+                    if(finished && !detectQueue.tryPop(item))
+                        break;
+                    if(!finished)
+                    {
+                        waitBriefly(spins);
+                        continue;
+                    }
+                }
+
+                spins = 0;
+                Clock::time_point detectStart = Clock::now();
+                detectTrackedMarkers(item.frame, workerTracker, item.markerCorners, item.markerIds);
+                recordStage(metrics, STAGE_DETECT, detectStart, Clock::now());
+
+                if(!poseQueue.push(item, stop))
+                    break;
+            }
+
+            runningWorkers.fetch_sub(1);
+        }));
+    }
+
+    thread poseThread([&]()
+    {
+        // Frames finished out of order wait in the slot of their sequence until their predecessors arrive
+        vector<PipelineFrame> reorderSlots(framesBeforePose);
+        vector<char> slotFilled(framesBeforePose, 0);
+        size_t nextSequence = 0;
+        int spins = 0;
+
+        PipelineFrame item;
+        while(!stop.load())
+        {
+            bool workersDone = runningWorkers.load() == 0;
+
+            if(poseQueue.tryPop(item))
+            {
+                spins = 0;
+                size_t slot = item.sequence % framesBeforePose;
+                swap(reorderSlots[slot], item);
+                slotFilled[slot] = 1;
+            }
+            else if(workersDone)
+            {
+                break;
+            }
+            else
+            {
+                waitBriefly(spins);
+            }
+
+            while(slotFilled[nextSequence % framesBeforePose])
+            {
+                size_t slot = nextSequence % framesBeforePose;
+                PipelineFrame& ready = reorderSlots[slot];
+                slotFilled[slot] = 0;
+
+                Clock::time_point poseStart = Clock::now();
+                estimateMarkerPoses(ready.markerCorners, arucoSquareDimensions, cameraMatrix, distanceCoefficients, options.poseEngine, ready.rotationVectors, ready.translationVectors);
+                poseStream.publish(ready.cameraId, ready.captured, ready.markerIds, ready.markerCorners, ready.rotationVectors, ready.translationVectors);
+                recordStage(metrics, STAGE_POSE, poseStart, Clock::now());
+
+                if(!renderQueue.push(ready, stop))
+                    break;
+
+                nextSequence++;
+                posedFrames.store(nextSequence, memory_order_release);
+            }
+        }
+
+        poseFinished.store(true);
+    });
+
+    if(!options.headless)
+        namedWindow("Webcam", 1000);
+
+    vector<double> latencies;
+    size_t renderedFrames = 0;
+    size_t totalMarkers = 0;
+    Clock::time_point pipelineStart = Clock::now();
+
+    // Rendering stays on this thread because highgui windows belong to the thread that created them
+    PipelineFrame item;
+    Mat colorFrame;
+    int spins = 0;
+    while(true)
+    {
+        if(!renderQueue.tryPop(item))
+        {
+            bool finished = poseFinished.load();
+            if(finished && !renderQueue.tryPop(item))
+                break;
+            if(!finished)
+            {
+                waitBriefly(spins);
+                continue;
+            }
+        }
+
+        spins = 0;
+        renderedFrames++;
+        totalMarkers += item.markerIds.size();
+        latencies.push_back(chrono::duration<double, milli>(Clock::now() - item.captured).count());
+        exportStageMetricsIfDue(metrics);
+
+        if(options.headless)
+        {
+            framePool.release(item);
+            continue;
+        }
+
+        Clock::time_point drawStart = Clock::now();
+        Mat& display = overlayFrame(item.frame, colorFrame);
+        for(size_t i = 0; i < item.markerIds.size(); i++)
+        {
+            aruco::drawAxis(display, cameraMatrix, distanceCoefficients, item.rotationVectors[i], item.translationVectors[i], 0.1f);
+        }
+        Clock::time_point drawn = Clock::now();
+
+        imshow("Webcam", display);
+
+        // Only pumps the window events, the pace is set by the capture source
+        int key = waitKey(1);
+        Clock::time_point displayed = Clock::now();
+
+        recordStage(metrics, STAGE_DRAW, drawStart, drawn);
+        recordStage(metrics, STAGE_DISPLAY, drawn, displayed);
+        recordStage(metrics, STAGE_TOTAL, item.captured, displayed);
+        framePool.release(item);
+
+        if(key >= 0)
+        {
+            stop.store(true);
+            break;
+        }
+    }
+
+    stop.store(true);
+    captureThread.join();
+    for(size_t w = 0; w < detectionThreads.size(); w++)
+        detectionThreads[w].join();
+    poseThread.join();
+
+    double elapsedSeconds = chrono::duration<double>(Clock::now() - pipelineStart).count();
+
+    cout << fixed << setprecision(2);
+    cout << "Frames: " << renderedFrames << " of " << capturedFrames.load() << " captured in " << elapsedSeconds << " s, "
+         << renderedFrames / max(elapsedSeconds, 1e-9) << " frames/s with " << workerCount << " detection workers" << endl;
+    if(renderedFrames > 0)
+        cout << "Markers per frame: " << double(totalMarkers) / renderedFrames << endl;
+    printTimingSummary("latency", latencies);
+
+    // Pushes that found a queue full show which stage holds the pipeline back
+    const BoundedQueue<PipelineFrame>* queues[] = { &detectQueue, &poseQueue, &renderQueue };
+    const char* queueNames[] = { "detect", "pose", "render" };
+    for(int q = 0; q < 3; q++)
+    {
+        cout << setw(8) << queueNames[q] << " queue: capacity " << queues[q]->capacity()
+             << ", deepest " << queues[q]->highWaterMark()
+             << ", pushes that waited " << queues[q]->fullCount() << endl;
+    }
+    cout << "Frames built because every pooled frame was in flight: " << framePool.missCount() << endl;
+
+    poseStream.close();
+    poseStream.printStatistics();
+
+    for(size_t w = 0; w < workerTrackers.size(); w++)
+        printTrackerStatistics(workerTrackers[w]);
+
+    printStageMetrics(metrics);
+    exportStageMetrics(metrics);
+
+    return 1;
+}
+
+// One camera of the multi-camera mode, its frames are detected one at a time in capture order
+struct CameraStream
+{
+    int id = 0;
+    string source;
+    FrameSource frames;
+    Mat cameraMatrix, distanceCoefficients;
+    MarkerTracker tracker;
+    atomic<bool> busy;              // a frame of this camera is in the pool
+    PipelineFrame pooled;           // that frame, the pool task only gets a pointer to the stream
+    size_t processedFrames = 0;     // counted by the thread that renders
+    vector<double> latencies;
+
+    // Shared by the cameras, set up by startMultiCameraTracking before the first frame
+    const TrackerOptions* options = nullptr;
+    float arucoSquareDimensions = 0;
+    BoundedQueue<PipelineFrame>* resultQueue = nullptr;
+    const atomic<bool>* stop = nullptr;
+    atomic<size_t>* framesInPool = nullptr;
+};
+
+// Pool task of the multi-camera mode, detects and poses the frame pooled by the camera
+void detectCameraFrame(void* context)
+{
+    typedef chrono::steady_clock Clock;
+
+    CameraStream& stream = *static_cast<CameraStream*>(context);
+    PipelineFrame& item = stream.pooled;
+
+    detectTrackedMarkers(item.frame, stream.tracker, item.markerCorners, item.markerIds);
+    estimateMarkerPoses(item.markerCorners, stream.arucoSquareDimensions, stream.cameraMatrix, stream.distanceCoefficients, stream.options->poseEngine, item.rotationVectors, item.translationVectors);
+    item.posed = Clock::now();
+
+    // The camera's next frame may only enter the pool once this one is queued, or a faster
+    // worker could queue it first. A push that fails because of stop discards the result.
+    stream.resultQueue->push(item, *stream.stop);
+    stream.busy.store(false, memory_order_release);
+    stream.framesInPool->fetch_sub(1);
+}
+
+/*
+ * Tracks several cameras in one process. Every camera has a capture thread that reads the next
+ * frame while the previous one is detected, and hands its frames to one shared work-stealing pool.
+ * A camera only has one frame in the pool at a time, which keeps its tracker to one thread and its
+ * frames in order, so the throughput scales with the workers up to the number of cameras.
+ * The results carry the camera id and capture time and are rendered (or counted when headless)
+ * on the calling thread.
+ */
+int startMultiCameraTracking(const TrackerOptions& options, float arucoSquareDimensions)
+{
+    typedef chrono::steady_clock Clock;
+
+    vector<unique_ptr<CameraStream>> streams;
+    for(size_t c = 0; c < options.cameras.size(); c++)
+    {
+        unique_ptr<CameraStream> stream(new CameraStream());
+        stream->id = int(c);
+        stream->busy.store(false);
+
+        string calibrationFile = "CameraCalibrationFile.txt";
+        size_t comma = options.cameras[c].find(',');
+        stream->source = options.cameras[c].substr(0, comma);
+        if(comma != string::npos)
+            calibrationFile = options.cameras[c].substr(comma + 1);
+
+        if(!stream->frames.open(stream->source))
+        {
+            cerr << "Could not open camera " << c << ": " << stream->source << endl;
+            return -1;
+        }
+
+        if(!loadCameraCalibration(calibrationFile, stream->cameraMatrix, stream->distanceCoefficients))
+        {
+            cerr << "Could not load the calibration of camera " << c << " from " << calibrationFile << endl;
+            return -1;
+        }
+
+        if(options.undistort)
+        {
+            if(!stream->frames.undistortWith(calibrationFile))
+                return -1;
+            stream->distanceCoefficients = Mat::zeros(5, 1, CV_64F);
+        }
+
+        if(options.luma)
+            stream->frames.lumaOnly();
+
+        if(!createMarkerTracker(options, stream->tracker))
+            return -1;
+
+        streams.push_back(std::move(stream));
+    }
+
+    size_t queueDepth = size_t(max(2, options.queueDepth)) * streams.size();
+    BoundedQueue<PipelineFrame> resultQueue(queueDepth);
+
+    // Fed from the results on this thread, the pool workers finish in any order
+    PoseStream poseStream;
+    if(!poseStream.open(options))
+        return -1;
+
+    atomic<bool> stop(false);
+    atomic<int> runningCaptures(int(streams.size()));
+    atomic<size_t> framesInPool(0);
+
+    for(size_t c = 0; c < streams.size(); c++)
+    {
+        streams[c]->options = &options;
+        streams[c]->arucoSquareDimensions = arucoSquareDimensions;
+        streams[c]->resultQueue = &resultQueue;
+        streams[c]->stop = &stop;
+        streams[c]->framesInPool = &framesInPool;
+    }
+
+    // Frames go round from the capture threads through the pool and the result queue to the render
+    // loop and back: a full result queue, one pooled and one being read per camera and one rendered
+    FramePool framePool(queueDepth + 2 * streams.size() + 1);
+
+    Clock::time_point trackingStart = Clock::now();
+
+    // Declared after what its tasks use, so it is destroyed, and drained, first. A camera has at most
+    // one task in the pool, so every ring can take a task of each camera.
+    unique_ptr<WorkStealingPool> pool(new WorkStealingPool(options.detectionWorkers, streams.size()));
+
+    vector<thread> captureThreads;
+    for(size_t c = 0; c < streams.size(); c++)
+    {
+        captureThreads.push_back(thread([&, c]()
+        {
+            CameraStream& stream = *streams[c];
+            size_t sequence = 0;
+            int spins = 0;
+
+            PipelineFrame item;
+            while(!stop.load())
+            {
+                framePool.acquire(item);
+                if(!stream.frames.read(item.frame))
+                    break;
+
+                item.cameraId = stream.id;
+                item.sequence = sequence++;
+                item.captured = Clock::now();
+
+                // The previous frame of this camera has to leave the pool first
+                while(stream.busy.load(memory_order_acquire) && !stop.load())
+                    waitBriefly(spins);
+                spins = 0;
+
+                if(stop.load())
+                    break;
+
+                // The finished frame was moved into the result queue, so this leaves item empty
+                swap(stream.pooled, item);
+                stream.busy.store(true, memory_order_relaxed);
+                framesInPool.fetch_add(1);
+
+                PoolTask task;
+                task.run = detectCameraFrame;
+                task.context = &stream;
+                pool->submit(task);
+            }
+
+            runningCaptures.fetch_sub(1);
+        }));
+    }
+
+    size_t renderedFrames = 0;
+    PipelineFrame item;
+    Mat colorFrame;
+    int spins = 0;
+    while(true)
+    {
+        if(!resultQueue.tryPop(item))
+        {
+            // Check the counters before the queue so a result pushed just before the end is not missed
+            bool finished = runningCaptures.load() == 0 && framesInPool.load() == 0;
+            if(finished && !resultQueue.tryPop(item))
+                break;
+            if(!finished)
+            {
+                waitBriefly(spins);
+                continue;
+            }
+        }
+
+        spins = 0;
+        CameraStream& stream = *streams[item.cameraId];
+        stream.processedFrames++;
+        stream.latencies.push_back(chrono::duration<double, milli>(item.posed - item.captured).count());
+        renderedFrames++;
+
+        poseStream.publish(item.cameraId, item.captured, item.markerIds, item.markerCorners, item.rotationVectors, item.translationVectors);
+
+        if(options.headless)
+        {
+            framePool.release(item);
+            continue;
+        }
+
+        Mat& display = overlayFrame(item.frame, colorFrame);
+        for(size_t i = 0; i < item.markerIds.size(); i++)
+        {
+            aruco::drawAxis(display, stream.cameraMatrix, stream.distanceCoefficients, item.rotationVectors[i], item.translationVectors[i], 0.1f);
+        }
+
+        ostringstream windowName;
+        windowName << "Camera " << item.cameraId;
+        imshow(windowName.str(), display);
+        framePool.release(item);
+
+        if(waitKey(1) >= 0)
+        {
+            stop.store(true);
+            break;
+        }
+    }
+
+    stop.store(true);
+    for(size_t c = 0; c < captureThreads.size(); c++)
+        captureThreads[c].join();
+
+    int workerCount = pool->workerCount();
+    size_t stolenTasks = pool->stolenCount();
+    vector<size_t> executed(workerCount);
+    for(int w = 0; w < workerCount; w++)
+        executed[w] = pool->executedCount(w);
+    pool.reset();
+
+    double elapsedSeconds = chrono::duration<double>(Clock::now() - trackingStart).count();
+
+    cout << fixed << setprecision(2);
+    cout << "Frames: " << renderedFrames << " from " << streams.size() << " cameras in " << elapsedSeconds << " s, "
+         << renderedFrames / max(elapsedSeconds, 1e-9) << " frames/s with " << workerCount << " detection workers" << endl;
+
+    for(size_t c = 0; c < streams.size(); c++)
+    {
+        cout << "Camera " << c << " (" << streams[c]->source << "): " << streams[c]->processedFrames << " frames, "
+             << streams[c]->processedFrames / max(elapsedSeconds, 1e-9) << " frames/s" << endl;
+
+        ostringstream label;
+        label << "camera " << c;
+        printTimingSummary(label.str(), streams[c]->latencies);
+    }
+
+    cout << "Tasks per worker:";
+    for(int w = 0; w < workerCount; w++)
+        cout << " " << executed[w];
+    cout << ", " << stolenTasks << " stolen" << endl;
+
+    poseStream.close();
+    poseStream.printStatistics();
+
+    return 1;
+}
+
+// Sets up the dictionary, the detector parameters and the detection mode chosen on the command line
+bool createMarkerTracker(const TrackerOptions& options, MarkerTracker& tracker)
+{
+    tracker = MarkerTracker();
+    tracker.dictionary = aruco::getPredefinedDictionary(aruco::PREDEFINED_DICTIONARY_NAME::DICT_4X4_50);
+    tracker.parameters = aruco::DetectorParameters::create();
+    tracker.fullSweepInterval = max(1, options.fullSweepInterval);
+
+    if(options.pyramidScale != 0 && options.pyramidScale != 1 && options.pyramidScale != 2 && options.pyramidScale != 4)
+    {
+        cerr << "The pyramid scale must be 1, 2, 4 or 0 for automatic" << endl;
+        return false;
+    }
+    tracker.pyramidScale = options.pyramidScale;
+    tracker.maxMarkerSide = max(0, options.maxMarkerSide);
+
+    if(options.detector == "aruco")
+        tracker.detector = DETECTOR_ARUCO;
+    else if(options.detector == "integral")
+        tracker.detector = DETECTOR_INTEGRAL;
+    else
+    {
+        cerr << "Unknown detector " << options.detector << endl;
+        return false;
+    }
+
+    if(tracker.detector == DETECTOR_INTEGRAL)
+        createBitDecoder(tracker);
+
+    if(options.quadFinder == "contours")
+        tracker.quadFinder = QUADS_CONTOURS;
+    else if(options.quadFinder == "runs")
+        tracker.quadFinder = QUADS_RUNS;
+    else
+    {
+        cerr << "Unknown quad finder " << options.quadFinder << endl;
+        return false;
+    }
+
+    if(options.detectionMode == "full")
+        tracker.mode = DETECT_FULL_FRAME;
+    else if(options.detectionMode == "roi")
+        tracker.mode = DETECT_ROI_TRACKING;
+    else if(options.detectionMode == "pyramid")
+        tracker.mode = DETECT_PYRAMID;
+    else if(options.detectionMode == "flow")
+        tracker.mode = DETECT_FLOW_TRACKING;
+    else if(options.detectionMode == "tiled")
+        tracker.mode = DETECT_TILED;
+    else
+    {
+        cerr << "Unknown detection mode " << options.detectionMode << endl;
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Detects the markers of one frame with the tracker's mode.
+ * The ROI mode only searches around the markers found in the previous frame. It falls back to a
+ * full-frame sweep every fullSweepInterval frames, when nothing is tracked and, on the same frame,
+ * as soon as a tracked marker is not found in its region. New markers therefore show up at the
+ * latest on the next scheduled sweep.
+ */
+void detectTrackedMarkers(const Mat& frame, MarkerTracker& tracker, vector<vector<Point2f>>& markerCorners, vector<int>& markerIds)
+{
+    size_t frameIndex = tracker.frameIndex++;
+
+    if(tracker.mode == DETECT_FULL_FRAME)
+    {
+        runMarkerDetector(frame, tracker, markerCorners, markerIds);
+        return;
+    }
+
+    if(tracker.mode == DETECT_PYRAMID)
+    {
+        detectMarkersCoarseToFine(frame, tracker, markerCorners, markerIds);
+        return;
+    }
+
+    if(tracker.mode == DETECT_FLOW_TRACKING)
+    {
+        detectMarkersWithFlow(frame, tracker, markerCorners, markerIds);
+        return;
+    }
+
+    if(tracker.mode == DETECT_TILED)
+    {
+        detectMarkersInTiles(frame, tracker, markerCorners, markerIds);
+        return;
+    }
+
+    bool sweep = tracker.lastIds.empty() || frameIndex % tracker.fullSweepInterval == 0;
+
+    if(!sweep)
+    {
+        detectMarkersInRegions(frame, tracker, predictMarkerRegions(tracker, frame.size()), markerCorners, markerIds);
+
+        // A tracked marker missing from its region moved too far or got occluded, an extra one walked into a region
+        if(sameMarkerIds(markerIds, tracker.lastIds))
+            tracker.roiFrames++;
+        else
+        {
+            tracker.lostMarkerSweeps++;
+            sweep = true;
+        }
+    }
+    else
+    {
+        tracker.scheduledSweeps++;
+    }
+
+    if(sweep)
+        runMarkerDetector(frame, tracker, markerCorners, markerIds);
+
+    tracker.lastIds = markerIds;
+    tracker.lastCorners = markerCorners;
+}
+
+/*
+ * Full detection every fullSweepInterval frames, the frames in between only follow the markers found:
+ * the four corners of each marker are predicted by its constant velocity Kalman filter, moved with
+ * pyramidal Lucas-Kanade flow from that prediction and checked by reading the marker's bits at the
+ * new position. A track the flow loses, that folds or whose bits no longer read as its ID makes the
+ * same frame run a full detection, so markers are never reported from a drifted track.
+ */
+void detectMarkersWithFlow(const Mat& frame, MarkerTracker& tracker, vector<vector<Point2f>>& markerCorners, vector<int>& markerIds)
+{
+    // The previous frame is kept for the flow, a grey frame may be the capture's buffer so it is copied
+    if(frame.channels() == 3)
+        cvtColor(frame, tracker.gray, COLOR_BGR2GRAY);
+    else
+        frame.copyTo(tracker.gray);
+
+    bool detect = tracker.tracks.empty() || tracker.previousGray.empty() || (tracker.frameIndex - 1) % tracker.fullSweepInterval == 0;
+
+    if(!detect)
+    {
+        if(trackMarkersWithFlow(tracker, markerCorners, markerIds))
+            tracker.flowFrames++;
+        else
+        {
+            tracker.earlyDetections++;
+            detect = true;
+        }
+    }
+    else
+    {
+        tracker.scheduledSweeps++;
+    }
+
+    if(detect)
+    {
+        runMarkerDetector(tracker.gray, tracker, markerCorners, markerIds);
+        updateMarkerTracks(tracker, markerCorners, markerIds);
+    }
+
+    swap(tracker.previousGray, tracker.gray);
+}
+
+// Moves every track to the current frame, false as soon as one of them is lost or fails the bit check
+bool trackMarkersWithFlow(MarkerTracker& tracker, vector<vector<Point2f>>& markerCorners, vector<int>& markerIds)
+{
+    markerCorners.clear();
+    markerIds.clear();
+
+    // All the corners go through one flow call, the Kalman predictions are where the search starts
+    tracker.flowFrom.clear();
+    tracker.flowTo.clear();
+    for(size_t t = 0; t < tracker.tracks.size(); t++)
+    {
+        const Mat& predicted = tracker.tracks[t].filter.predict();
+        for(int c = 0; c < 4; c++)
+        {
+            tracker.flowFrom.push_back(tracker.tracks[t].corners[c]);
+            tracker.flowTo.push_back(Point2f(predicted.at<float>(2 * c), predicted.at<float>(2 * c + 1)));
+        }
+    }
+
+    calcOpticalFlowPyrLK(tracker.previousGray, tracker.gray, tracker.flowFrom, tracker.flowTo, tracker.flowStatus, tracker.flowErrors,
+                         Size(21, 21), 3, TermCriteria(TermCriteria::COUNT | TermCriteria::EPS, 20, 0.03), OPTFLOW_USE_INITIAL_FLOW);
+
+    Mat measurement(8, 1, CV_32F);
+    for(size_t t = 0; t < tracker.tracks.size(); t++)
+    {
+        MarkerTrack& track = tracker.tracks[t];
+        vector<Point2f> moved(tracker.flowTo.begin() + 4 * t, tracker.flowTo.begin() + 4 * t + 4);
+
+        bool flowed = true;
+        for(int c = 0; c < 4; c++)
+            flowed = flowed && tracker.flowStatus[4 * t + c] != 0;
+
+        // A quad that folded over or changed its size a lot in one frame has corners stuck on the background
+        if(flowed)
+        {
+            double area = contourArea(moved);
+            double previousArea = contourArea(track.corners);
+            flowed = isContourConvex(moved) && area > 0.5 * previousArea && area < 2.0 * previousArea;
+        }
+
+        if(!flowed)
+        {
+            tracker.lostTracks++;
+            return false;
+        }
+
+        // The bits have to read as the same marker in the same orientation
+        vector<Point2f> verified = moved;
+        int id;
+        if(!identifyCandidate(tracker.gray, tracker, *tracker.parameters, verified, id) || id != track.id || verified[0] != moved[0])
+        {
+            tracker.unverifiedTracks++;
+            return false;
+        }
+
+        for(int c = 0; c < 4; c++)
+        {
+            measurement.at<float>(2 * c) = moved[c].x;
+            measurement.at<float>(2 * c + 1) = moved[c].y;
+        }
+
+        const Mat& corrected = track.filter.correct(measurement);
+        for(int c = 0; c < 4; c++)
+            track.corners[c] = Point2f(corrected.at<float>(2 * c), corrected.at<float>(2 * c + 1));
+
+        markerCorners.push_back(track.corners);
+        markerIds.push_back(track.id);
+    }
+
+    return true;
+}
+
+/*
+ * Restarts the tracks from the markers of a full detection. A marker tracked in the previous frame
+ * keeps moving at the speed between its last position and the detected one, a new marker starts at rest.
+ */
+void updateMarkerTracks(MarkerTracker& tracker, const vector<vector<Point2f>>& markerCorners, const vector<int>& markerIds)
+{
+    vector<MarkerTrack> tracks(markerIds.size());
+
+    for(size_t i = 0; i < markerIds.size(); i++)
+    {
+        MarkerTrack& track = tracks[i];
+        track.id = markerIds[i];
+        track.corners = markerCorners[i];
+
+        // 8 corner coordinates followed by their velocities in pixels per frame
+        track.filter.init(16, 8, 0, CV_32F);
+        setIdentity(track.filter.transitionMatrix);
+        for(int k = 0; k < 8; k++)
+            track.filter.transitionMatrix.at<float>(k, 8 + k) = 1.0f;
+        setIdentity(track.filter.measurementMatrix);
+        setIdentity(track.filter.processNoiseCov, Scalar::all(0.5));
+        setIdentity(track.filter.measurementNoiseCov, Scalar::all(0.25));
+        setIdentity(track.filter.errorCovPost, Scalar::all(4.0));
+
+        const vector<Point2f>* previous = NULL;
+        for(size_t t = 0; t < tracker.tracks.size() && previous == NULL; t++)
+        {
+            if(tracker.tracks[t].id == track.id)
+                previous = &tracker.tracks[t].corners;
+        }
+
+        for(int c = 0; c < 4; c++)
+        {
+            Point2f velocity = previous != NULL ? track.corners[c] - (*previous)[c] : Point2f(0, 0);
+
+            track.filter.statePost.at<float>(2 * c) = track.corners[c].x;
+            track.filter.statePost.at<float>(2 * c + 1) = track.corners[c].y;
+            track.filter.statePost.at<float>(8 + 2 * c) = velocity.x;
+            track.filter.statePost.at<float>(8 + 2 * c + 1) = velocity.y;
+        }
+    }
+
+    tracker.tracks.swap(tracks);
+}
+
+// Padded bounding boxes of the last known markers, overlapping boxes are merged so no marker is searched twice
+vector<Rect> predictMarkerRegions(const MarkerTracker& tracker, Size frameSize)
+{
+    Rect frameRect(0, 0, frameSize.width, frameSize.height);
+    vector<Rect> regions;
+
+    for(size_t i = 0; i < tracker.lastCorners.size(); i++)
+    {
+        Rect box = boundingRect(tracker.lastCorners[i]);
+        int padding = max(tracker.minRoiPadding, int(max(box.width, box.height) * tracker.roiPadding));
+
+        box = Rect(box.x - padding, box.y - padding, box.width + 2 * padding, box.height + 2 * padding) & frameRect;
+        if(box.area() > 0)
+            regions.push_back(box);
+    }
+
+    bool merged = true;
+    while(merged)
+    {
+        merged = false;
+
+        for(size_t i = 0; i < regions.size() && !merged; i++)
+        {
+            for(size_t j = i + 1; j < regions.size(); j++)
+            {
+                if((regions[i] & regions[j]).area() > 0)
+                {
+                    regions[i] |= regions[j];
+                    regions.erase(regions.begin() + j);
+                    merged = true;
+                    break;
+                }
+            }
+        }
+    }
+
+    return regions;
+}
+
+// Runs the detector on each region and maps the corners back to frame coordinates
+void detectMarkersInRegions(const Mat& frame, MarkerTracker& tracker, const vector<Rect>& regions, vector<vector<Point2f>>& markerCorners, vector<int>& markerIds)
+{
+    markerCorners.clear();
+    markerIds.clear();
+
+    // The perimeter limits of the detector are relative to the image it gets, so a marker that is too
+    // small for the full frame would pass inside a small region. Apply the full-frame limit here.
+    double minPerimeter = tracker.parameters->minMarkerPerimeterRate * max(frame.cols, frame.rows);
+
+    vector<int> regionIds;
+    vector<vector<Point2f>> regionCorners;
+
+    for(size_t r = 0; r < regions.size(); r++)
+    {
+        // A region is a view into the frame, nothing is copied
+        runMarkerDetector(frame(regions[r]), tracker, regionCorners, regionIds);
+
+        Point2f offset(float(regions[r].x), float(regions[r].y));
+        for(size_t i = 0; i < regionIds.size(); i++)
+        {
+            if(arcLength(regionCorners[i], true) < minPerimeter)
+                continue;
+
+            for(size_t c = 0; c < regionCorners[i].size(); c++)
+                regionCorners[i][c] += offset;
+
+            markerIds.push_back(regionIds[i]);
+            markerCorners.push_back(regionCorners[i]);
+        }
+    }
+}
+
+/*
+ * Splits the frame into a grid of tiles, detects every tile on its own thread and merges the markers.
+ * Each tile owns a core, the cores partition the frame, and searches its core grown by the overlap on
+ * every side. With an overlap of the largest marker side, a marker whose centre is in a core lies
+ * whole inside that core's tile, so every tile keeps only the markers centred in its own core: a marker
+ * across a seam is found by each tile around it but reported once, by the tile that sees it whole.
+ * Unless --max-marker-side gives the largest marker, the overlap follows the markers found and every
+ * sweep interval the whole frame is searched instead, so a marker larger than the overlap lying across
+ * a seam is still found and widens the overlap for the frames after.
+ */
+void detectMarkersInTiles(const Mat& frame, MarkerTracker& tracker, vector<vector<Point2f>>& markerCorners, vector<int>& markerIds)
+{
+    markerCorners.clear();
+    markerIds.clear();
+
+    // Converted once instead of by every tile over its overlap
+    Mat gray = frame;
+    if(frame.channels() == 3)
+    {
+        cvtColor(frame, tracker.gray, COLOR_BGR2GRAY);
+        gray = tracker.gray;
+    }
+
+    size_t frameIndex = tracker.frameIndex - 1;
+    if(tracker.maxMarkerSide <= 0 && frameIndex % tracker.fullSweepInterval == 0)
+    {
+        runMarkerDetector(gray, tracker, markerCorners, markerIds);
+        followLargestMarkerSide(tracker, markerCorners);
+
+        tracker.tiledSweeps++;
+        tracker.tiledPixels += double(gray.cols) * gray.rows;
+        tracker.searchedPixels += double(gray.cols) * gray.rows;
+        return;
+    }
+
+    // Unless given, the overlap follows the largest marker seen lately, with room for it to grow by a quarter
+    // until the next frame, but never drops below a fixed floor. Not a quarter of the frame, which around
+    // every tile of a large frame would search several times the frame.
+    Rect frameRect(0, 0, gray.cols, gray.rows);
+    int maxMarkerSide = tracker.maxMarkerSide;
+    if(maxMarkerSide <= 0)
+    {
+        maxMarkerSide = min(tracker.defaultMaxMarkerSide, min(gray.cols, gray.rows) / 4);
+        maxMarkerSide = max(maxMarkerSide, int(1.25f * tracker.recentLargestMarkerSide) + 8);
+    }
+    int overlap = maxMarkerSide + tracker.parameters->minDistanceToBorder + 2;
+
+    // Grow the grid along the longer side of its cores until there is a tile per thread, as long as a core stays wider than the overlap
+    int columns = 1, rows = 1;
+    int threads = max(1, getNumThreads());
+    while(columns * rows < threads)
+    {
+        bool splitColumns = gray.cols / columns >= gray.rows / rows;
+        int side = splitColumns ? gray.cols / (columns + 1) : gray.rows / (rows + 1);
+        if(side < overlap)
+            break;
+
+        if(splitColumns)
+            columns++;
+        else
+            rows++;
+    }
+
+    int tileCount = columns * rows;
+
+    // A new grid gets its tile trackers set up once, they keep their buffers from frame to frame
+    if(tracker.tileTrackers.size() != size_t(tileCount))
+    {
+        tracker.tileTrackers.resize(tileCount);
+        for(int t = 0; t < tileCount; t++)
+        {
+            MarkerTracker& tileTracker = tracker.tileTrackers[t];
+            tileTracker.detector = tracker.detector;
+            tileTracker.quadFinder = tracker.quadFinder;
+            tileTracker.dictionary = tracker.dictionary;
+            tileTracker.parameters = tracker.parameters;
+            tileTracker.decoder4x4 = tracker.decoder4x4;
+            tileTracker.decoder5x5 = tracker.decoder5x5;
+            tileTracker.decoder6x6 = tracker.decoder6x6;
+        }
+    }
+
+    tracker.tileCores.resize(tileCount);
+    tracker.tileRects.resize(tileCount);
+    tracker.tileCorners.resize(tileCount);
+    tracker.tileIds.resize(tileCount);
+    for(int t = 0; t < tileCount; t++)
+    {
+        int column = t % columns, row = t / columns;
+        int x0 = gray.cols * column / columns, x1 = gray.cols * (column + 1) / columns;
+        int y0 = gray.rows * row / rows, y1 = gray.rows * (row + 1) / rows;
+        tracker.tileCores[t] = Rect(x0, y0, x1 - x0, y1 - y0);
+        tracker.tileRects[t] = Rect(x0 - overlap, y0 - overlap, x1 - x0 + 2 * overlap, y1 - y0 + 2 * overlap) & frameRect;
+        tracker.searchedPixels += tracker.tileRects[t].area();
+    }
+
+    // The perimeter limits of the detector are relative to the image it gets, apply the full-frame limit to the tiles
+    double minPerimeter = tracker.parameters->minMarkerPerimeterRate * max(gray.cols, gray.rows);
+    atomic<size_t> seamDuplicates(0);
+
+    parallelFor(Range(0, tileCount), [&](const Range& range)
+    {
+        for(int t = range.start; t < range.end; t++)
+        {
+            const Rect& core = tracker.tileCores[t];
+            const Rect& tile = tracker.tileRects[t];
+
+            vector<vector<Point2f>>& corners = tracker.tileCorners[t];
+            vector<int>& ids = tracker.tileIds[t];
+            runMarkerDetector(gray(tile), tracker.tileTrackers[t], corners, ids);
+
+            Point2f offset(float(tile.x), float(tile.y));
+            size_t kept = 0;
+            for(size_t i = 0; i < ids.size(); i++)
+            {
+                if(arcLength(corners[i], true) < minPerimeter)
+                    continue;
+
+                Point2f centre(0.0f, 0.0f);
+                for(size_t c = 0; c < corners[i].size(); c++)
+                {
+                    corners[i][c] += offset;
+                    centre += corners[i][c] * 0.25f;
+                }
+
+                // Centred in a neighbour's core, that tile reports it
+                if(centre.x < core.x || centre.y < core.y || centre.x >= core.x + core.width || centre.y >= core.y + core.height)
+                {
+                    seamDuplicates.fetch_add(1, memory_order_relaxed);
+                    continue;
+                }
+
+                if(kept != i)
+                {
+                    swap(corners[kept], corners[i]);
+                    ids[kept] = ids[i];
+                }
+                kept++;
+            }
+
+            corners.resize(kept);
+            ids.resize(kept);
+        }
+    });
+
+    for(int t = 0; t < tileCount; t++)
+    {
+        markerIds.insert(markerIds.end(), tracker.tileIds[t].begin(), tracker.tileIds[t].end());
+        markerCorners.insert(markerCorners.end(), tracker.tileCorners[t].begin(), tracker.tileCorners[t].end());
+    }
+
+    followLargestMarkerSide(tracker, markerCorners);
+
+    tracker.tiledFrames++;
+    tracker.tilesSearched += size_t(tileCount);
+    tracker.seamDuplicates += seamDuplicates.load();
+    tracker.tileGrid = Size(columns, rows);
+    tracker.tileOverlap = overlap;
+    tracker.tiledPixels += double(gray.cols) * gray.rows;
+}
+
+// The largest side of the markers found sets the next tile overlap: it grows at once and shrinks slowly,
+// and is forgotten after a sweep interval of frames without markers
+void followLargestMarkerSide(MarkerTracker& tracker, const vector<vector<Point2f>>& markerCorners)
+{
+    float largestSide = 0.0f;
+    for(size_t i = 0; i < markerCorners.size(); i++)
+    {
+        for(int c = 0; c < 4; c++)
+            largestSide = max(largestSide, float(norm(markerCorners[i][c] - markerCorners[i][(c + 1) % 4])));
+    }
+
+    if(largestSide > 0.0f)
+    {
+        tracker.recentLargestMarkerSide = max(largestSide, 0.9f * tracker.recentLargestMarkerSide + 0.1f * largestSide);
+        tracker.framesWithoutMarkers = 0;
+    }
+    else if(++tracker.framesWithoutMarkers >= size_t(tracker.fullSweepInterval))
+    {
+        tracker.recentLargestMarkerSide = 0.0f;
+    }
+}
+
+// True when both lists hold the same IDs, in any order
+bool sameMarkerIds(vector<int> first, vector<int> second)
+{
+    sort(first.begin(), first.end());
+    sort(second.begin(), second.end());
+
+    return first == second;
+}
+
+/*
+ * Finds the markers on a 1/2 or 1/4 scale copy of the frame, then refines their corners with
+ * cornerSubPix on the full resolution image. Thresholding and contour search, the bulk of the
+ * detector's time, run on a quarter or a sixteenth of the pixels while the corners handed to the
+ * pose estimation keep full-resolution accuracy.
+ */
+void detectMarkersCoarseToFine(const Mat& frame, MarkerTracker& tracker, vector<vector<Point2f>>& markerCorners, vector<int>& markerIds)
+{
+    int scale = choosePyramidScale(tracker);
+    tracker.framesPerScale[scale]++;
+
+    if(frame.channels() == 3)
+        cvtColor(frame, tracker.gray, COLOR_BGR2GRAY);
+    else
+        tracker.gray = frame;
+
+    if(scale == 1)
+    {
+        runMarkerDetector(tracker.gray, tracker, markerCorners, markerIds);
+    }
+    else
+    {
+        resize(tracker.gray, tracker.scaledGray, Size(tracker.gray.cols / scale, tracker.gray.rows / scale), 0, 0, INTER_AREA);
+        runMarkerDetector(tracker.scaledGray, tracker, markerCorners, markerIds);
+
+        // Back to full resolution, pixel centres map to pixel centres
+        for(size_t i = 0; i < markerCorners.size(); i++)
+        {
+            for(size_t c = 0; c < markerCorners[i].size(); c++)
+            {
+                markerCorners[i][c].x = (markerCorners[i][c].x + 0.5f) * scale - 0.5f;
+                markerCorners[i][c].y = (markerCorners[i][c].y + 0.5f) * scale - 0.5f;
+            }
+        }
+    }
+
+    // The coarse corners can be off by about one coarse pixel, the search window has to cover that
+    if(!markerCorners.empty())
+    {
+        int halfWindow = max(3, 2 * scale);
+        for(size_t i = 0; i < markerCorners.size(); i++)
+        {
+            cornerSubPix(tracker.gray, markerCorners[i], Size(halfWindow, halfWindow), Size(-1, -1),
+                         TermCriteria(TermCriteria::MAX_ITER | TermCriteria::EPS, 30, 0.01));
+        }
+    }
+
+    // Remember how small the markers were to pick the next scale
+    float smallestSide = 0.0f;
+    for(size_t i = 0; i < markerCorners.size(); i++)
+    {
+        for(int c = 0; c < 4; c++)
+        {
+            float side = float(norm(markerCorners[i][c] - markerCorners[i][(c + 1) % 4]));
+            if(smallestSide == 0.0f || side < smallestSide)
+                smallestSide = side;
+        }
+    }
+
+    if(smallestSide > 0.0f)
+    {
+        tracker.recentMarkerSide = tracker.recentMarkerSide == 0.0f ? smallestSide : 0.7f * tracker.recentMarkerSide + 0.3f * smallestSide;
+        tracker.framesWithoutMarkers = 0;
+    }
+    else if(++tracker.framesWithoutMarkers >= size_t(tracker.fullSweepInterval))
+    {
+        tracker.recentMarkerSide = 0.0f;
+    }
+}
+
+/*
+ * A fixed scale when one was given. Otherwise the largest scale at which the smallest marker seen
+ * lately still keeps minScaledMarkerSide pixels per side. Without recent markers every
+ * fullSweepInterval-th frame is searched at full resolution so small markers get found, the
+ * others at half resolution.
+ */
+int choosePyramidScale(const MarkerTracker& tracker)
+{
+    if(tracker.pyramidScale > 0)
+        return tracker.pyramidScale;
+
+    if(tracker.recentMarkerSide == 0.0f)
+        return tracker.frameIndex % tracker.fullSweepInterval == 1 ? 1 : 2;
+
+    int scale = 1;
+    while(scale < tracker.maxPyramidScale && tracker.recentMarkerSide / (scale * 2) >= tracker.minScaledMarkerSide)
+        scale *= 2;
+
+    return scale;
+}
+
+void printTrackerStatistics(const MarkerTracker& tracker)
+{
+    if(tracker.mode == DETECT_ROI_TRACKING)
+    {
+        cout << "ROI tracking: " << tracker.roiFrames << " frames searched in regions only, "
+             << tracker.scheduledSweeps << " scheduled full-frame sweeps, "
+             << tracker.lostMarkerSweeps << " sweeps after a lost marker" << endl;
+    }
+
+    if(tracker.mode == DETECT_PYRAMID)
+    {
+        cout << "Pyramid: " << tracker.framesPerScale[1] << " frames at full resolution, "
+             << tracker.framesPerScale[2] << " at 1/2, " << tracker.framesPerScale[4] << " at 1/4" << endl;
+    }
+
+    if(tracker.mode == DETECT_FLOW_TRACKING)
+    {
+        size_t frames = tracker.flowFrames + tracker.scheduledSweeps + tracker.earlyDetections;
+        cout << "Flow tracking: " << tracker.flowFrames << " frames followed by flow, "
+             << tracker.scheduledSweeps << " scheduled detections, " << tracker.earlyDetections << " early detections ("
+             << tracker.lostTracks << " lost tracks, " << tracker.unverifiedTracks << " tracks whose bits did not verify), detection on "
+             << fixed << setprecision(1) << 100.0 * (tracker.scheduledSweeps + tracker.earlyDetections) / max<size_t>(frames, 1) << "% of the frames" << endl;
+    }
+
+    if(tracker.mode == DETECT_TILED)
+    {
+        cout << "Tiled: " << tracker.tiledFrames << " frames in " << tracker.tileGrid.width << "x" << tracker.tileGrid.height << " tiles, "
+             << tracker.tilesSearched << " tiles searched, " << tracker.seamDuplicates << " markers across a seam reported once, "
+             << tracker.tiledSweeps << " frames searched whole" << endl;
+        cout << "Tiles searched " << fixed << setprecision(2) << tracker.searchedPixels / max(tracker.tiledPixels, 1.0)
+             << " times the frame area, last overlap " << tracker.tileOverlap << " px" << endl;
+    }
+}
+
+// Runs the detector backend chosen on the command line on a frame or a region of it
+void runMarkerDetector(const Mat& image, MarkerTracker& tracker, vector<vector<Point2f>>& markerCorners, vector<int>& markerIds)
+{
+    if(tracker.detector == DETECTOR_INTEGRAL)
+        detectMarkersIntegral(image, tracker, markerCorners, markerIds);
+    else
+        aruco::detectMarkers(image, tracker.dictionary, markerCorners, markerIds, tracker.parameters);
+}
+
+/*
+ * The same steps as aruco::detectMarkers (adaptive thresholds, quad candidates, bit extraction,
+ * identification, optional corner refinement) with one difference: the thresholds of all the
+ * window sizes come from a single integral image instead of one box filter per window size.
+ */
+void detectMarkersIntegral(const Mat& image, MarkerTracker& tracker, vector<vector<Point2f>>& markerCorners, vector<int>& markerIds)
+{
+    const aruco::DetectorParameters& params = *tracker.parameters;
+
+    markerIds.clear();
+
+    // A colour frame is converted into the tracker's buffer, a grey one is used as it is
+    Mat gray = image;
+    if(image.channels() == 3)
+    {
+        cvtColor(image, tracker.colorGray, COLOR_BGR2GRAY);
+        gray = tracker.colorGray;
+    }
+
+    // The window sizes of the sweep, forced odd like the aruco detector does
+    vector<int>& windowSizes = tracker.windowSizes;
+    windowSizes.clear();
+    for(int size = params.adaptiveThreshWinSizeMin; size <= params.adaptiveThreshWinSizeMax; size += max(1, params.adaptiveThreshWinSizeStep))
+        windowSizes.push_back(size % 2 == 0 ? size + 1 : size);
+
+    if(windowSizes.empty() || gray.empty())
+    {
+        markerCorners.clear();
+        return;
+    }
+
+    integral(gray, tracker.integralImage, CV_32S);
+    adaptiveThresholdFromIntegral(gray, tracker.integralImage, windowSizes, params.adaptiveThreshConstant, tracker.thresholdImages);
+
+    // Quad candidates of every thresholded image, searched in parallel like the aruco detector does.
+    // The run finder splits each image over the threads itself, nested it would run on one.
+    vector<QuadCandidates>& windowCandidates = tracker.windowCandidates;
+    windowCandidates.resize(windowSizes.size());
+    for(size_t w = 0; w < windowSizes.size(); w++)
+        windowCandidates[w].count = 0;
+
+    if(tracker.quadFinder == QUADS_RUNS)
+    {
+        for(size_t w = 0; w < windowSizes.size(); w++)
+            findQuadCandidatesFromRuns(tracker.thresholdImages[w], params, tracker.runBands, windowCandidates[w]);
+    }
+    else
+    {
+        parallelFor(Range(0, int(windowSizes.size())), [&](const Range& range)
+        {
+            for(int w = range.start; w < range.end; w++)
+                findQuadCandidates(tracker.thresholdImages[w], params, windowCandidates[w]);
+        });
+    }
+
+    QuadCandidates& candidates = tracker.candidates;
+    candidates.count = 0;
+    for(size_t w = 0; w < windowSizes.size(); w++)
+    {
+        for(size_t i = 0; i < windowCandidates[w].count; i++)
+            candidates.add(windowCandidates[w].corners[i], windowCandidates[w].perimeters[i]);
+    }
+
+    filterTooCloseCandidates(candidates, params.minMarkerDistanceRate);
+
+    // Read and identify the bits of the candidates, a batch at a time
+    const int batchSize = 32;
+    vector<int>& candidateIds = tracker.candidateIds;
+    candidateIds.assign(candidates.count, -1);
+
+    parallelFor(Range(0, int(candidates.count)), [&](const Range& range)
+    {
+        for(int first = range.start; first < range.end; first += batchSize)
+            identifyCandidates(gray, tracker, params, &candidates.corners[first], min(batchSize, range.end - first), &candidateIds[first]);
+    });
+
+    // The corner vectors of the previous frames are assigned to, not rebuilt
+    size_t found = 0;
+    for(size_t i = 0; i < candidates.count; i++)
+        found += candidateIds[i] >= 0 ? 1 : 0;
+    resizeCornerList(markerCorners, found, tracker.spareCorners);
+
+    found = 0;
+    for(size_t i = 0; i < candidates.count; i++)
+    {
+        if(candidateIds[i] < 0)
+            continue;
+
+        markerCorners[found].assign(candidates.corners[i].begin(), candidates.corners[i].end());
+        markerIds.push_back(candidateIds[i]);
+        found++;
+    }
+
+    if(params.cornerRefinementMethod == aruco::CORNER_REFINE_SUBPIX)
+    {
+        TermCriteria criteria(TermCriteria::MAX_ITER | TermCriteria::EPS, params.cornerRefinementMaxIterations, params.cornerRefinementMinAccuracy);
+
+        for(size_t i = 0; i < markerCorners.size(); i++)
+            cornerSubPix(gray, markerCorners[i], Size(params.cornerRefinementWinSize, params.cornerRefinementWinSize), Size(-1, -1), criteria);
+    }
+}
+
+/*
+ * Inverted binary adaptive threshold for every window size from one integral image: a pixel becomes
+ * 255 when it is at least constant below the mean of the window around it. Rows are split over the
+ * threads and every row computes all the window sizes while its integral rows are in cache.
+ * Windows are cut at the image edges instead of replicating the border, which only changes pixels
+ * closer to the edge than minDistanceToBorder allows markers anyway.
+ */
+void adaptiveThresholdFromIntegral(const Mat& gray, const Mat& integralImage, const vector<int>& windowSizes, double constant, vector<Mat>& thresholdImages)
+{
+    thresholdImages.resize(windowSizes.size());
+    for(size_t w = 0; w < windowSizes.size(); w++)
+        thresholdImages[w].create(gray.size(), CV_8UC1);
+
+    // Rounded up like cv::adaptiveThreshold does for THRESH_BINARY_INV
+    int roundedConstant = int(ceil(constant));
+
+    parallelFor(Range(0, gray.rows), [&](const Range& range)
+    {
+        for(int y = range.start; y < range.end; y++)
+        {
+            const uchar* src = gray.ptr<uchar>(y);
+
+            for(size_t w = 0; w < windowSizes.size(); w++)
+            {
+                int radius = windowSizes[w] / 2;
+                int top = max(0, y - radius);
+                int bottom = min(gray.rows, y + radius + 1);
+
+                // Unsigned so sums that wrapped around in a very large integral image still subtract correctly
+                thresholdRowFromIntegral(src, thresholdImages[w].ptr<uchar>(y),
+                                         integralImage.ptr<unsigned>(top), integralImage.ptr<unsigned>(bottom),
+                                         gray.cols, radius, bottom - top, roundedConstant);
+            }
+        }
+    });
+}
+
+// Thresholds one pixel whose window may be cut by the left or right edge
+inline void thresholdPixelFromIntegral(const uchar* src, uchar* dst, const unsigned* top, const unsigned* bottom, int x, int cols, int radius, int windowRows, int constant)
+{
+    int left = max(0, x - radius);
+    int right = min(cols, x + radius + 1);
+
+    int sum = int(bottom[right] - bottom[left] - top[right] + top[left]);
+    int area = (right - left) * windowRows;
+
+    dst[x] = (int(src[x]) + constant) * area <= sum ? 255 : 0;
+}
+
+/*
+ * One row of one window size. Comparing (pixel + constant) * area with the window sum keeps
+ * everything in integers, no division per pixel. Where the window is not cut by the edges its area
+ * is the same for the whole row and the AVX2 or NEON kernel handles 16 or 8 pixels at a time.
+ */
+void thresholdRowFromIntegral(const uchar* src, uchar* dst, const unsigned* top, const unsigned* bottom, int cols, int radius, int windowRows, int constant)
+{
+    int interiorStart = min(radius, cols);
+    int interiorEnd = max(interiorStart, cols - radius);
+    int area = (2 * radius + 1) * windowRows;
+
+    int x = 0;
+    for(; x < interiorStart; x++)
+        thresholdPixelFromIntegral(src, dst, top, bottom, x, cols, radius, windowRows, constant);
+
+#if defined(__AVX2__)
+    const __m256i areaVector = _mm256_set1_epi32(area);
+    const __m256i constantVector = _mm256_set1_epi32(constant);
+
+    for(; x + 16 <= interiorEnd; x += 16)
+    {
+        __m256i above[2];
+        for(int half = 0; half < 2; half++)
+        {
+            int left = x + half * 8 - radius;
+            int right = x + half * 8 + radius + 1;
+
+            __m256i sum = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)(bottom + right)), _mm256_loadu_si256((const __m256i*)(bottom + left)));
+            sum = _mm256_sub_epi32(sum, _mm256_loadu_si256((const __m256i*)(top + right)));
+            sum = _mm256_add_epi32(sum, _mm256_loadu_si256((const __m256i*)(top + left)));
+
+            __m256i pixels = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(src + x + half * 8)));
+            __m256i scaled = _mm256_mullo_epi32(_mm256_add_epi32(pixels, constantVector), areaVector);
+
+            above[half] = _mm256_cmpgt_epi32(scaled, sum);
+        }
+
+        // Narrow the 16 masks to bytes, the permutes undo the per-lane interleaving of the packs
+        __m256i words = _mm256_permute4x64_epi64(_mm256_packs_epi32(above[0], above[1]), 0xD8);
+        __m256i bytes = _mm256_permute4x64_epi64(_mm256_packs_epi16(words, words), 0xD8);
+
+        _mm_storeu_si128((__m128i*)(dst + x), _mm_xor_si128(_mm256_castsi256_si128(bytes), _mm_set1_epi8(-1)));
+    }
+#elif defined(__ARM_NEON)
+    const int32x4_t areaVector = vdupq_n_s32(area);
+    const int32x4_t constantVector = vdupq_n_s32(constant);
+
+    for(; x + 8 <= interiorEnd; x += 8)
+    {
+        uint16x8_t pixels = vmovl_u8(vld1_u8(src + x));
+        uint32x4_t below[2];
+
+        for(int half = 0; half < 2; half++)
+        {
+            int left = x + half * 4 - radius;
+            int right = x + half * 4 + radius + 1;
+
+            uint32x4_t sum = vsubq_u32(vld1q_u32(bottom + right), vld1q_u32(bottom + left));
+            sum = vaddq_u32(vsubq_u32(sum, vld1q_u32(top + right)), vld1q_u32(top + left));
+
+            int32x4_t widened = vreinterpretq_s32_u32(vmovl_u16(half == 0 ? vget_low_u16(pixels) : vget_high_u16(pixels)));
+            int32x4_t scaled = vmulq_s32(vaddq_s32(widened, constantVector), areaVector);
+
+            below[half] = vcleq_s32(scaled, vreinterpretq_s32_u32(sum));
+        }
+
+        vst1_u8(dst + x, vmovn_u16(vcombine_u16(vmovn_u32(below[0]), vmovn_u32(below[1]))));
+    }
+#endif
+
+    for(; x < interiorEnd; x++)
+    {
+        int sum = int(bottom[x + radius + 1] - bottom[x - radius] - top[x + radius + 1] + top[x - radius]);
+        dst[x] = (int(src[x]) + constant) * area <= sum ? 255 : 0;
+    }
+
+    for(; x < cols; x++)
+        thresholdPixelFromIntegral(src, dst, top, bottom, x, cols, radius, windowRows, constant);
+}
+
+// Convex quadrilaterals of a thresholded image that pass the detector's size and border limits, corners clockwise
+void findQuadCandidates(const Mat& binary, const aruco::DetectorParameters& params, QuadCandidates& candidates)
+{
+    int maxDimension = max(binary.cols, binary.rows);
+    size_t minPerimeterPixels = size_t(params.minMarkerPerimeterRate * maxDimension);
+    size_t maxPerimeterPixels = size_t(params.maxMarkerPerimeterRate * maxDimension);
+
+    vector<vector<Point>> contours;
+    vector<Point> approxCurve;
+    vector<Point2f> quad;
+
+    findContours(binary, contours, RETR_LIST, CHAIN_APPROX_NONE);
+
+    for(size_t i = 0; i < contours.size(); i++)
+    {
+        if(contours[i].size() < minPerimeterPixels || contours[i].size() > maxPerimeterPixels)
+            continue;
+
+        approxPolyDP(contours[i], approxCurve, double(contours[i].size()) * params.polygonalApproxAccuracyRate, true);
+        if(!acceptQuadCandidate(approxCurve, double(contours[i].size()), binary.size(), params, quad))
+            continue;
+
+        candidates.add(quad, int(contours[i].size()));
+    }
+}
+
+/*
+ * The checks every quad has to pass whichever way it was found: convex, corners not too close to each
+ * other nor to the image border. contourLength is the length of the boundary it was fitted to.
+ * The quad comes out as float corners in clockwise order.
+ */
+bool acceptQuadCandidate(const vector<Point>& approxCurve, double contourLength, Size imageSize, const aruco::DetectorParameters& params, vector<Point2f>& quad)
+{
+    if(approxCurve.size() != 4 || !isContourConvex(approxCurve))
+        return false;
+
+    // Corners too close to each other
+    int maxDimension = max(imageSize.width, imageSize.height);
+    double minDistanceSquared = double(maxDimension) * maxDimension;
+    for(int c = 0; c < 4; c++)
+    {
+        Point side = approxCurve[c] - approxCurve[(c + 1) % 4];
+        minDistanceSquared = min(minDistanceSquared, double(side.dot(side)));
+    }
+
+    double minCornerDistance = contourLength * params.minCornerDistanceRate;
+    if(minDistanceSquared < minCornerDistance * minCornerDistance)
+        return false;
+
+    // Too close to the image border
+    for(int c = 0; c < 4; c++)
+    {
+        if(approxCurve[c].x < params.minDistanceToBorder || approxCurve[c].y < params.minDistanceToBorder ||
+           approxCurve[c].x > imageSize.width - 1 - params.minDistanceToBorder ||
+           approxCurve[c].y > imageSize.height - 1 - params.minDistanceToBorder)
+            return false;
+    }
+
+    quad.resize(4);
+    for(int c = 0; c < 4; c++)
+        quad[c] = Point2f(float(approxCurve[c].x), float(approxCurve[c].y));
+
+    // Clockwise order
+    double dx1 = quad[1].x - quad[0].x, dy1 = quad[1].y - quad[0].y;
+    double dx2 = quad[2].x - quad[0].x, dy2 = quad[2].y - quad[0].y;
+    if(dx1 * dy2 - dy1 * dx2 < 0.0)
+        swap(quad[1], quad[3]);
+
+    return true;
+}
+
+/*
+ * Runs of 255 in one row of a binary image, appended as [start, end) pairs. Only the edges cost
+ * anything: AVX2 turns 32 pixels into a bit mask and walks its edges, NEON skips 16 pixel blocks of
+ * the colour of the current run, the rest goes a pixel at a time.
+ */
+void encodeRowRuns(const uchar* row, int cols, int y, vector<PixelRun>& runs)
+{
+    int x = 0;
+    int start = 0;
+    bool inside = false;
+
+#if defined(__AVX2__)
+    uint32_t previous = 0;          // last pixel of the previous block, in bit 0
+    for(; x + 32 <= cols; x += 32)
+    {
+        uint32_t pixels = uint32_t(_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i*)(row + x))));
+        uint32_t edges = pixels ^ ((pixels << 1) | previous);
+        previous = pixels >> 31;
+
+        while(edges != 0)
+        {
+            int edge = x + __builtin_ctz(edges);
+            edges &= edges - 1;
+
+            if(inside)
+                runs.push_back(PixelRun{ y, start, edge });
+            else
+                start = edge;
+            inside = !inside;
+        }
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    for(; x + 16 <= cols; x += 16)
+    {
+        uint8x16_t pixels = vld1q_u8(row + x);
+        if(inside ? vminvq_u8(pixels) != 0 : vmaxvq_u8(pixels) == 0)
+            continue;
+
+        for(int i = x; i < x + 16; i++)
+        {
+            if((row[i] != 0) == inside)
+                continue;
+
+            if(inside)
+                runs.push_back(PixelRun{ y, start, i });
+            else
+                start = i;
+            inside = !inside;
+        }
+    }
+#endif
+
+    for(; x < cols; x++)
+    {
+        if((row[x] != 0) == inside)
+            continue;
+
+        if(inside)
+            runs.push_back(PixelRun{ y, start, x });
+        else
+            start = x;
+        inside = !inside;
+    }
+
+    if(inside)
+        runs.push_back(PixelRun{ y, start, cols });
+}
+
+inline int findRunRoot(vector<int>& parent, int run)
+{
+    while(parent[run] != run)
+    {
+        parent[run] = parent[parent[run]];
+        run = parent[run];
+    }
+    return run;
+}
+
+// The smaller index stays the root, so a band only ever points into itself or an earlier band
+inline void joinRuns(vector<int>& parent, int first, int second)
+{
+    first = findRunRoot(parent, first);
+    second = findRunRoot(parent, second);
+    if(first < second)
+        parent[second] = first;
+    else if(second < first)
+        parent[first] = second;
+}
+
+// Joins the runs of one row with the 8-connected runs of the row above, both ranges sorted by start
+void joinRowRuns(const vector<PixelRun>& runs, vector<int>& parent, int aboveFirst, int aboveEnd, int rowFirst, int rowEnd)
+{
+    int above = aboveFirst;
+    for(int r = rowFirst; r < rowEnd; r++)
+    {
+        // Runs above that end before this one starts cannot touch the next runs of this row either
+        while(above < aboveEnd && runs[above].end < runs[r].start)
+            above++;
+
+        for(int a = above; a < aboveEnd && runs[a].start <= runs[r].end; a++)
+            joinRuns(parent, a, r);
+    }
+}
+
+/*
+ * Quad candidates from the connected components of a binary image instead of its contours. The image
+ * is run-length encoded in row bands on all the threads, each band joins its runs with a union-find,
+ * then the bands are joined at their seams. A component whose bounding box could hold a marker of
+ * the allowed perimeters is fitted the way the contour finder fits a contour, with approxPolyDP, to
+ * the convex hull of its run ends, which is its outer boundary without the holes. The hull would also
+ * turn an L, a notched square or two markers touching at a corner into a quad, so a component whose
+ * outer boundary encloses much less than its hull is skipped, as the contour finder would reject it.
+ */
+void findQuadCandidatesFromRuns(const Mat& binary, const aruco::DetectorParameters& params, RunBands& bands, QuadCandidates& candidates)
+{
+    int maxDimension = max(binary.cols, binary.rows);
+    double minPerimeterPixels = params.minMarkerPerimeterRate * maxDimension;
+    double maxPerimeterPixels = params.maxMarkerPerimeterRate * maxDimension;
+
+    // The band scratch is shared with the threads of the parallel loop, so it comes from the caller.
+    // The rest is only touched by this thread, reused by every image it searches.
+    vector<vector<PixelRun>>& bandRuns = bands.runs;
+    vector<vector<int>>& bandParents = bands.parents;
+    vector<int>& rowFirst = bands.rowFirst;
+    static thread_local vector<int> parent, component, componentFirst, componentRuns, componentCursor;
+    static thread_local vector<PixelRun> runs;
+    static thread_local vector<Rect> boxes;
+    static thread_local vector<Point> ends, hull, approxCurve;
+    static thread_local vector<Point2f> quad;
+    static thread_local vector<int> columnTop, columnBottom;
+
+    // Fraction of its convex hull a component's outer boundary has to enclose, below it is not convex
+    const double minHullFill = 0.85;
+
+    int bandCount = max(1, min(binary.rows / 32, 2 * getNumThreads()));
+    int bandRows = (binary.rows + bandCount - 1) / bandCount;
+    bandRuns.resize(bandCount);
+    bandParents.resize(bandCount);
+    rowFirst.resize(binary.rows + 1);
+
+    // Run-length encode and join each band, row starts relative to the band for now
+    parallelFor(Range(0, bandCount), [&](const Range& range)
+    {
+        for(int b = range.start; b < range.end; b++)
+        {
+            vector<PixelRun>& bandRun = bandRuns[b];
+            vector<int>& bandParent = bandParents[b];
+            bandRun.clear();
+
+            int firstRow = b * bandRows, lastRow = min(binary.rows, firstRow + bandRows);
+            for(int y = firstRow; y < lastRow; y++)
+            {
+                rowFirst[y] = int(bandRun.size());
+                encodeRowRuns(binary.ptr<uchar>(y), binary.cols, y, bandRun);
+            }
+
+            bandParent.resize(bandRun.size());
+            for(size_t r = 0; r < bandRun.size(); r++)
+                bandParent[r] = int(r);
+
+            for(int y = firstRow + 1; y < lastRow; y++)
+            {
+                int rowEnd = y + 1 < lastRow ? rowFirst[y + 1] : int(bandRun.size());
+                joinRowRuns(bandRun, bandParent, rowFirst[y - 1], rowFirst[y], rowFirst[y], rowEnd);
+            }
+        }
+    });
+
+    // One list of runs, the parents and row starts shifted by the runs of the bands before
+    runs.clear();
+    parent.clear();
+    for(int b = 0; b < bandCount; b++)
+    {
+        int offset = int(runs.size());
+        int firstRow = b * bandRows, lastRow = min(binary.rows, firstRow + bandRows);
+        for(int y = firstRow; y < lastRow; y++)
+            rowFirst[y] += offset;
+
+        runs.insert(runs.end(), bandRuns[b].begin(), bandRuns[b].end());
+        for(size_t r = 0; r < bandParents[b].size(); r++)
+            parent.push_back(bandParents[b][r] + offset);
+    }
+    rowFirst[binary.rows] = int(runs.size());
+
+    for(int b = 1; b < bandCount; b++)
+    {
+        int y = b * bandRows;
+        if(y < binary.rows)
+            joinRowRuns(runs, parent, rowFirst[y - 1], rowFirst[y], rowFirst[y], rowFirst[y + 1]);
+    }
+
+    // Number the components and find their bounding boxes
+    component.assign(runs.size(), -1);
+    boxes.clear();
+    for(size_t r = 0; r < runs.size(); r++)
+    {
+        int root = findRunRoot(parent, int(r));
+        if(component[root] < 0)
+        {
+            component[root] = int(boxes.size());
+            boxes.push_back(Rect(runs[r].start, runs[r].y, runs[r].end - runs[r].start, 1));
+        }
+        component[r] = component[root];
+
+        Rect& box = boxes[component[r]];
+        int right = max(box.x + box.width, runs[r].end);
+        box.x = min(box.x, runs[r].start);
+        box.width = right - box.x;
+        box.height = runs[r].y - box.y + 1;
+    }
+
+    // Runs grouped by component, a counting sort keeps them in row order
+    componentFirst.assign(boxes.size() + 1, 0);
+    for(size_t r = 0; r < runs.size(); r++)
+        componentFirst[component[r] + 1]++;
+    for(size_t c = 0; c < boxes.size(); c++)
+        componentFirst[c + 1] += componentFirst[c];
+
+    componentRuns.resize(runs.size());
+    componentCursor.assign(componentFirst.begin(), componentFirst.end() - 1);
+    for(size_t r = 0; r < runs.size(); r++)
+        componentRuns[componentCursor[component[r]]++] = int(r);
+
+    for(size_t c = 0; c < boxes.size(); c++)
+    {
+        // A square's perimeter is between 2.8 and 4 times the longer side of its bounding box
+        int longerSide = max(boxes[c].width, boxes[c].height);
+        if(4.0 * longerSide < minPerimeterPixels || 2.8 * longerSide > maxPerimeterPixels)
+            continue;
+
+        ends.clear();
+        for(int i = componentFirst[c]; i < componentFirst[c + 1]; i++)
+        {
+            const PixelRun& run = runs[componentRuns[i]];
+            ends.push_back(Point(run.start, run.y));
+            ends.push_back(Point(run.end - 1, run.y));
+        }
+
+        convexHullOfSortedPoints(ends, hull);
+        double length = arcLength(hull, true);
+        if(length < minPerimeterPixels || length > maxPerimeterPixels)
+            continue;
+
+        // The pixel count says nothing here: a marker's component is its dark border with the white cells as holes.
+        // The hull runs through pixel centres, so it is half a pixel short all around its perimeter.
+        int first = componentFirst[c];
+        int outerArea = outerAreaBound(runs, &componentRuns[first], componentFirst[c + 1] - first, boxes[c], columnTop, columnBottom);
+        if(outerArea < minHullFill * (contourArea(hull) + length / 2 + 1))
+            continue;
+
+        approxPolyDP(hull, approxCurve, length * params.polygonalApproxAccuracyRate, true);
+        if(!acceptQuadCandidate(approxCurve, length, binary.size(), params, quad))
+            continue;
+
+        candidates.add(quad, int(length));
+    }
+}
+
+inline long long crossFrom(Point origin, Point first, Point second)
+{
+    return (long long)(first.x - origin.x) * (second.y - origin.y) - (long long)(first.y - origin.y) * (second.x - origin.x);
+}
+
+/*
+ * Convex hull of points sorted by row, then column (Andrew's monotone chain), without collinear points.
+ * The run ends of a component come in that order, so unlike convexHull there is nothing to sort
+ * and no buffer to allocate once hull has grown to the largest component.
+ */
+void convexHullOfSortedPoints(const vector<Point>& points, vector<Point>& hull)
+{
+    size_t count = points.size();
+    if(count < 3)
+    {
+        hull.assign(points.begin(), points.end());
+        return;
+    }
+
+    hull.resize(2 * count);
+    size_t size = 0;
+
+    // One chain from the first point to the last, then the other one back
+    for(size_t i = 0; i < count; i++)
+    {
+        while(size >= 2 && crossFrom(hull[size - 2], hull[size - 1], points[i]) <= 0)
+            size--;
+        hull[size++] = points[i];
+    }
+
+    size_t firstChain = size + 1;
+    for(size_t i = count - 1; i-- > 0;)
+    {
+        while(size >= firstChain && crossFrom(hull[size - 2], hull[size - 1], points[i]) <= 0)
+            size--;
+        hull[size++] = points[i];
+    }
+
+    // The first point closes the second chain
+    hull.resize(size - 1);
+}
+
+/*
+ * Upper bound of the pixels inside a component's outer boundary: that boundary encloses no pixel
+ * before the first or after the last pixel of the component in a row, nor above the first or
+ * below the last one in a column. The runs come in row order, each row sorted by start.
+ */
+int outerAreaBound(const vector<PixelRun>& runs, const int* componentRuns, int count, const Rect& box, vector<int>& columnTop, vector<int>& columnBottom)
+{
+    columnTop.assign(box.width, box.y + box.height);
+    columnBottom.assign(box.width, box.y - 1);
+
+    int rowArea = 0;
+    for(int i = 0; i < count;)
+    {
+        const PixelRun& firstRun = runs[componentRuns[i]];
+        int rowEnd = firstRun.end;
+        for(; i < count && runs[componentRuns[i]].y == firstRun.y; i++)
+        {
+            const PixelRun& run = runs[componentRuns[i]];
+            rowEnd = run.end;
+            for(int x = run.start - box.x; x < run.end - box.x; x++)
+            {
+                columnTop[x] = min(columnTop[x], run.y);
+                columnBottom[x] = max(columnBottom[x], run.y);
+            }
+        }
+        rowArea += rowEnd - firstRun.start;
+    }
+
+    int columnArea = 0;
+    for(int x = 0; x < box.width; x++)
+        if(columnTop[x] <= columnBottom[x])
+            columnArea += columnBottom[x] - columnTop[x] + 1;
+
+    return min(rowArea, columnArea);
+}
+
+void QuadCandidates::add(const vector<Point2f>& quad, int perimeter)
+{
+    if(corners.size() <= count)
+    {
+        corners.resize(count + 1);
+        perimeters.resize(count + 1);
+    }
+
+    corners[count].assign(quad.begin(), quad.end());
+    perimeters[count] = perimeter;
+    count++;
+}
+
+// The same border is found by several window sizes, of candidates whose corners nearly coincide only the largest is kept
+void filterTooCloseCandidates(QuadCandidates& candidates, double minMarkerDistanceRate)
+{
+    vector<vector<Point2f>>& corners = candidates.corners;
+    vector<int>& perimeters = candidates.perimeters;
+    vector<uchar>& removed = candidates.removed;
+    size_t count = candidates.count;
+    removed.assign(count, 0);
+
+    for(size_t i = 0; i < count; i++)
+    {
+        for(size_t j = i + 1; j < count && !removed[i]; j++)
+        {
+            if(removed[j])
+                continue;
+
+            double minMarkerDistance = min(perimeters[i], perimeters[j]) * minMarkerDistanceRate;
+
+            // The two quads can start at any of their corners
+            bool tooClose = false;
+            for(int first = 0; first < 4 && !tooClose; first++)
+            {
+                double distanceSquared = 0.0;
+                for(int c = 0; c < 4; c++)
+                {
+                    Point2f difference = corners[i][(c + first) % 4] - corners[j][c];
+                    distanceSquared += difference.dot(difference);
+                }
+
+                tooClose = distanceSquared / 4.0 < minMarkerDistance * minMarkerDistance;
+            }
+
+            if(tooClose)
+            {
+                if(perimeters[i] < perimeters[j])
+                    removed[i] = true;
+                else
+                    removed[j] = true;
+            }
+        }
+    }
+
+    // Swapped rather than copied, the removed candidates' vectors are reused by the next frame
+    size_t kept = 0;
+    for(size_t i = 0; i < count; i++)
+    {
+        if(removed[i])
+            continue;
+
+        if(kept != i)
+        {
+            swap(corners[kept], corners[i]);
+            perimeters[kept] = perimeters[i];
+        }
+        kept++;
+    }
+
+    candidates.count = kept;
+}
+
+// Sets the number of corner vectors without freeing any, the ones a shorter list drops wait in spare for a longer one
+void resizeCornerList(vector<vector<Point2f>>& corners, size_t size, vector<vector<Point2f>>& spare)
+{
+    while(corners.size() > size)
+    {
+        spare.push_back(std::move(corners.back()));
+        corners.pop_back();
+    }
+
+    while(corners.size() < size)
+    {
+        if(spare.empty())
+        {
+            corners.emplace_back();
+            continue;
+        }
+
+        corners.push_back(std::move(spare.back()));
+        spare.pop_back();
+    }
+}
+
+/*
+ * Reads the cells of a candidate and looks them up in the dictionary. On success the corners are
+ * rotated so the first one is the marker's top left corner, as aruco::detectMarkers returns them.
+ * A batch of one for the callers that verify a single quad.
+ */
+bool identifyCandidate(const Mat& gray, const MarkerTracker& tracker, const aruco::DetectorParameters& params, vector<Point2f>& corners, int& id)
+{
+    identifyCandidates(gray, tracker, params, &corners, 1, &id);
+    return id >= 0;
+}
+
+/*
+ * Reads the cells of candidates straight from the frame instead of warping a patch per candidate:
+ * the centre of every cell and four points around it are projected through the candidate's
+ * homography and read with fixed point bilinear interpolation, their mean is the cell's value.
+ * A batch goes through the passes one after the other, homographies, samples, then bits, so each
+ * pass is a short loop over all the candidates. ids[i] is -1 for a rejected candidate, the corners
+ * of a marker are rotated so the first one is the marker's top left corner.
+ */
+void identifyCandidates(const Mat& gray, const MarkerTracker& tracker, const aruco::DetectorParameters& params, vector<Point2f>* candidates, int count, int* ids)
+{
+    const aruco::Dictionary& dictionary = *tracker.dictionary;
+
+    int borderBits = params.markerBorderBits;
+    int sizeWithBorders = dictionary.markerSize + 2 * borderBits;
+    int cellCount = sizeWithBorders * sizeWithBorders;
+
+    // Scratch of this thread, every batch it reads reuses them
+    static thread_local vector<Matx33f> homographies;
+    static thread_local vector<uchar> cellValues;
+    static thread_local Mat bits;
+
+    homographies.resize(count);
+    cellValues.resize(size_t(count) * cellCount);
+    bits.create(sizeWithBorders, sizeWithBorders, CV_8UC1);
+
+    // Square in cell units, cell (x, y) has its centre at (x + 0.5, y + 0.5)
+    for(int i = 0; i < count; i++)
+        homographies[i] = squareToQuadHomography(candidates[i].data(), sizeWithBorders);
+
+    for(int i = 0; i < count; i++)
+        sampleCandidateCells(gray, homographies[i], sizeWithBorders, &cellValues[size_t(i) * cellCount]);
+
+    for(int i = 0; i < count; i++)
+    {
+        ids[i] = -1;
+        if(!classifyCells(&cellValues[size_t(i) * cellCount], cellCount, params.minOtsuStdDev, bits))
+            continue;
+
+        // The border cells must be black
+        int borderErrors = 0;
+        for(int y = 0; y < sizeWithBorders; y++)
+        {
+            const uchar* row = bits.ptr<uchar>(y);
+            for(int x = 0; x < sizeWithBorders; x++)
+            {
+                bool border = y < borderBits || y >= sizeWithBorders - borderBits || x < borderBits || x >= sizeWithBorders - borderBits;
+                if(border && row[x] != 0)
+                    borderErrors++;
+            }
+        }
+
+        if(borderErrors > int(dictionary.markerSize * dictionary.markerSize * params.maxErroneousBitsInBorderRate))
+            continue;
+
+        Mat innerBits = bits(Rect(borderBits, borderBits, dictionary.markerSize, dictionary.markerSize));
+
+        int id, rotation;
+        if(!decodeMarkerBits(tracker, innerBits, params.errorCorrectionRate, id, rotation))
+            continue;
+
+        vector<Point2f>& corners = candidates[i];
+        Point2f unrotated[4] = { corners[0], corners[1], corners[2], corners[3] };
+        for(int c = 0; c < 4; c++)
+            corners[c] = unrotated[(c + 4 - rotation) % 4];
+
+        ids[i] = id;
+    }
+}
+
+// Where in a cell the samples are taken, in cells from its centre, inside the margin the aruco detector ignores
+const float cellSampleOffsets[5][2] = { { 0.0f, 0.0f }, { -0.25f, -0.25f }, { 0.25f, -0.25f }, { 0.25f, 0.25f }, { -0.25f, 0.25f } };
+
+// Grey level at (x, y) with 8 fractional bits of position, positions outside the frame are clamped to its edge
+inline int readBilinear(const uchar* data, size_t step, int cols, int rows, float x, float y)
+{
+    int fixedX = min(max(int(x * 256.0f), 0), (cols - 1) * 256 - 1);
+    int fixedY = min(max(int(y * 256.0f), 0), (rows - 1) * 256 - 1);
+    int x0 = fixedX >> 8, fx = fixedX & 255;
+    int y0 = fixedY >> 8, fy = fixedY & 255;
+
+    const uchar* top = data + size_t(y0) * step + x0;
+    const uchar* bottom = top + step;
+
+    int upper = top[0] * (256 - fx) + top[1] * fx;
+    int lower = bottom[0] * (256 - fx) + bottom[1] * fx;
+
+    return (upper * (256 - fy) + lower * fy + (1 << 15)) >> 16;
+}
+
+// Mean grey level of every cell of one candidate, row by row
+void sampleCandidateCells(const Mat& gray, const Matx33f& squareToFrame, int sizeWithBorders, uchar* cells)
+{
+    const uchar* data = gray.ptr<uchar>();
+    size_t step = gray.step[0];
+    const float* h = squareToFrame.val;
+
+    for(int y = 0; y < sizeWithBorders; y++)
+    {
+        for(int x = 0; x < sizeWithBorders; x++)
+        {
+            int sum = 0;
+            for(int s = 0; s < 5; s++)
+            {
+                float u = x + 0.5f + cellSampleOffsets[s][0];
+                float v = y + 0.5f + cellSampleOffsets[s][1];
+                float w = 1.0f / (h[6] * u + h[7] * v + h[8]);
+
+                sum += readBilinear(data, step, gray.cols, gray.rows, (h[0] * u + h[1] * v + h[2]) * w, (h[3] * u + h[4] * v + h[5]) * w);
+            }
+
+            cells[y * sizeWithBorders + x] = uchar((sum + 2) / 5);
+        }
+    }
+}
+
+/*
+ * Cell values to bits, 1 for white. Otsu's threshold over the cell values instead of the pixels of a
+ * warped patch: a few dozen values sorted once. Cells with too little spread all get the colour of
+ * their mean, like the aruco detector does for a uniform patch.
+ */
+bool classifyCells(const uchar* cells, int cellCount, double minStdDev, Mat& bits)
+{
+    uchar* out = bits.ptr<uchar>();
+
+    int sum = 0, squares = 0;
+    for(int c = 0; c < cellCount; c++)
+    {
+        sum += cells[c];
+        squares += cells[c] * cells[c];
+    }
+
+    double mean = double(sum) / cellCount;
+    double variance = double(squares) / cellCount - mean * mean;
+    if(variance < minStdDev * minStdDev)
+    {
+        memset(out, mean > 127 ? 1 : 0, size_t(cellCount));
+        return true;
+    }
+
+    uchar sorted[256];
+    if(cellCount > 256)
+        return false;
+    memcpy(sorted, cells, size_t(cellCount));
+    sort(sorted, sorted + cellCount);
+
+    // Split between sorted[k - 1] and sorted[k] with the largest between-class variance
+    int threshold = sorted[0];
+    double bestSpread = -1.0;
+    int below = 0;
+    for(int k = 1; k < cellCount; k++)
+    {
+        below += sorted[k - 1];
+        if(sorted[k] == sorted[k - 1])
+            continue;
+
+        double darkMean = double(below) / k;
+        double lightMean = double(sum - below) / (cellCount - k);
+        double spread = double(k) * (cellCount - k) * (lightMean - darkMean) * (lightMean - darkMean);
+        if(spread > bestSpread)
+        {
+            bestSpread = spread;
+            threshold = sorted[k - 1];
+        }
+    }
+
+    for(int c = 0; c < cellCount; c++)
+        out[c] = cells[c] > threshold ? 1 : 0;
+
+    return true;
+}
+
+/*
+ * Homography taking the square (0, 0), (side, 0), (side, side), (0, side) to the quad's corners, in
+ * closed form (Heckbert's square to quad mapping). Nothing is solved or allocated, unlike
+ * getPerspectiveTransform, and warpPerspective can use it as is with WARP_INVERSE_MAP.
+ */
+Matx33d squareToQuadHomography(const Point2f* quad, double side)
+{
+    double dx1 = quad[1].x - quad[2].x, dx2 = quad[3].x - quad[2].x, dx3 = quad[0].x - quad[1].x + quad[2].x - quad[3].x;
+    double dy1 = quad[1].y - quad[2].y, dy2 = quad[3].y - quad[2].y, dy3 = quad[0].y - quad[1].y + quad[2].y - quad[3].y;
+
+    // A parallelogram is affine, otherwise the projective terms come from the sides' intersections
+    double g = 0.0, h = 0.0;
+    if(dx3 != 0.0 || dy3 != 0.0)
+    {
+        double determinant = dx1 * dy2 - dx2 * dy1;
+        g = (dx3 * dy2 - dx2 * dy3) / determinant;
+        h = (dx1 * dy3 - dx3 * dy1) / determinant;
+    }
+
+    double scale = 1.0 / side;
+    return Matx33d((quad[1].x - quad[0].x + g * quad[1].x) * scale, (quad[3].x - quad[0].x + h * quad[3].x) * scale, quad[0].x,
+                   (quad[1].y - quad[0].y + g * quad[1].y) * scale, (quad[3].y - quad[0].y + h * quad[3].y) * scale, quad[0].y,
+                   g * scale, h * scale, 1.0);
+}
+
+/*
+ * Builds the bit pattern lookup for the tracker's dictionary. DICT_4X4_50 gets the table the compiler
+ * already built, other 4x4, 5x5 and 6x6 dictionaries get one built here. Other sizes keep using
+ * aruco::Dictionary::identify.
+ */
+void createBitDecoder(MarkerTracker& tracker)
+{
+    const aruco::Dictionary& dictionary = *tracker.dictionary;
+    int count = dictionary.bytesList.rows;
+
+    if(dictionary.markerSize == 4)
+    {
+        vector<uint16_t> codes(count);
+        for(int id = 0; id < count; id++)
+            codes[id] = MarkerCode<4>::fromDictionary(dictionary, id);
+
+        if(count == 50 && equal(codes.begin(), codes.end(), dict4x4_50Codes))
+            tracker.decoder4x4 = shared_ptr<const BitDecoder<4>>(&dict4x4_50Decoder, [](const BitDecoder<4>*) {});
+        else
+            tracker.decoder4x4 = make_shared<BitDecoder<4>>(codes.data(), count);
+    }
+    else if(dictionary.markerSize == 5)
+    {
+        vector<uint32_t> codes(count);
+        for(int id = 0; id < count; id++)
+            codes[id] = MarkerCode<5>::fromDictionary(dictionary, id);
+
+        tracker.decoder5x5 = make_shared<BitDecoder<5>>(codes.data(), count);
+    }
+    else if(dictionary.markerSize == 6)
+    {
+        vector<uint64_t> codes(count);
+        for(int id = 0; id < count; id++)
+            codes[id] = MarkerCode<6>::fromDictionary(dictionary, id);
+
+        tracker.decoder6x6 = make_shared<BitDecoder<6>>(codes.data(), count);
+    }
+}
+
+/*
+ * Id and rotation of a candidate's inner bits, with as many corrected bits as identify would allow.
+ * The tables only hold patterns up to one bit off, a miss that may be further off is handed to
+ * identify, which the 6x6 dictionaries need.
+ */
+bool decodeMarkerBits(const MarkerTracker& tracker, const Mat& innerBits, double errorCorrectionRate, int& id, int& rotation)
+{
+    const aruco::Dictionary& dictionary = *tracker.dictionary;
+    int maxErrors = int(dictionary.maxCorrectionBits * errorCorrectionRate);
+
+    bool found = false;
+    if(tracker.decoder4x4)
+        found = tracker.decoder4x4->decode(MarkerCode<4>::fromBits(innerBits), maxErrors, id, rotation);
+    else if(tracker.decoder5x5)
+        found = tracker.decoder5x5->decode(MarkerCode<5>::fromBits(innerBits), maxErrors, id, rotation);
+    else if(tracker.decoder6x6)
+        found = tracker.decoder6x6->decode(MarkerCode<6>::fromBits(innerBits), maxErrors, id, rotation);
+    else
+        return dictionary.identify(innerBits, id, rotation, errorCorrectionRate);
+
+    if(!found && maxErrors > 1)
+        return dictionary.identify(innerBits, id, rotation, errorCorrectionRate);
+
+    return found;
+}
+
+// Poses of all the markers of a frame with the chosen engine, in the form drawAxis takes them
+void estimateMarkerPoses(const vector<vector<Point2f>>& markerCorners, float markerLength, const Mat& cameraMatrix, const Mat& distanceCoefficients, PoseEngine engine, vector<Vec3d>& rotationVectors, vector<Vec3d>& translationVectors)
+{
+    // Nothing to solve when no marker was found
+    if(markerCorners.empty())
+    {
+        rotationVectors.clear();
+        translationVectors.clear();
+        return;
+    }
+
+    if(engine == POSE_BATCHED)
+        estimatePosesBatched(markerCorners, markerLength, cameraMatrix, distanceCoefficients, rotationVectors, translationVectors);
+    else
+        aruco::estimatePoseSingleMarkers(markerCorners, markerLength, cameraMatrix, distanceCoefficients, rotationVectors, translationVectors);
+}
+
+/*
+ * Pose of every marker of a frame at once, an alternative to estimatePoseSingleMarkers that runs
+ * an iterative solvePnP per marker. The corners are undistorted in one call and stored as one array
+ * per corner coordinate, and the solver is written as straight-line loops over all the markers so
+ * the compiler can vectorize them (with -O3 -fno-math-errno and AVX2 or NEON enabled).
+ */
+void estimatePosesBatched(const vector<vector<Point2f>>& markerCorners, float markerLength, const Mat& cameraMatrix, const Mat& distanceCoefficients, vector<Vec3d>& rotationVectors, vector<Vec3d>& translationVectors)
+{
+    size_t count = markerCorners.size();
+
+    rotationVectors.resize(count);
+    translationVectors.resize(count);
+
+    if(count == 0)
+        return;
+
+    // Kept by the thread between frames, they only grow when more markers than ever are in view
+    static thread_local vector<Point2f> imagePoints, normalizedPoints;
+    static thread_local PlanarPoseBatch batch;
+
+    imagePoints.clear();
+    for(size_t i = 0; i < count; i++)
+        imagePoints.insert(imagePoints.end(), markerCorners[i].begin(), markerCorners[i].end());
+
+    undistortPoints(imagePoints, normalizedPoints, cameraMatrix, distanceCoefficients);
+
+    batch.resize(count);
+
+    for(size_t i = 0; i < count; i++)
+    {
+        for(int c = 0; c < 4; c++)
+        {
+            batch.u[c][i] = normalizedPoints[4 * i + c].x;
+            batch.v[c][i] = normalizedPoints[4 * i + c].y;
+        }
+    }
+
+    solvePlanarPoses(batch, 0.5 * markerLength);
+
+    for(size_t i = 0; i < count; i++)
+    {
+        int best = batch.error[1][i] < batch.error[0][i] ? 1 : 0;
+
+        double rotation[9];
+        for(int k = 0; k < 9; k++)
+            rotation[k] = batch.rotation[best][k * count + i];
+
+        rotationVectors[i] = rotationMatrixToVector(rotation);
+        translationVectors[i] = Vec3d(batch.translation[best][0][i], batch.translation[best][1][i], batch.translation[best][2][i]);
+    }
+}
+
+void PlanarPoseBatch::resize(size_t markers)
+{
+    count = markers;
+
+    for(int c = 0; c < 4; c++)
+    {
+        u[c].resize(markers);
+        v[c].resize(markers);
+    }
+
+    for(int s = 0; s < 2; s++)
+    {
+        rotation[s].resize(9 * markers);
+        for(int k = 0; k < 3; k++)
+            translation[s][k].resize(markers);
+        error[s].resize(markers);
+    }
+}
+
+/*
+ * Infinitesimal plane-based pose estimation (Collins and Bartoli, IPPE) for squares of side
+ * 2 * halfLength, with the corners in the order estimatePoseSingleMarkers uses:
+ * (-h, h), (h, h), (h, -h), (-h, -h). The first pass computes, for each marker, the homography
+ * from the square to the normalized corners in closed form and from its Jacobian at the square's
+ * centre the two rotations IPPE allows. The second pass computes the least-squares translation
+ * and the reprojection error of each rotation, the caller keeps the one with the smaller error.
+ */
+void solvePlanarPoses(PlanarPoseBatch& batch, double halfLength)
+{
+    const size_t count = batch.count;
+    const double length = 2.0 * halfLength;
+
+    const double* u0 = batch.u[0].data(); const double* v0 = batch.v[0].data();
+    const double* u1 = batch.u[1].data(); const double* v1 = batch.v[1].data();
+    const double* u2 = batch.u[2].data(); const double* v2 = batch.v[2].data();
+    const double* u3 = batch.u[3].data(); const double* v3 = batch.v[3].data();
+
+    // Entry k of the rotation of marker i lives at k * count + i
+    double* first = batch.rotation[0].data();
+    double* second = batch.rotation[1].data();
+
+    // The arrays of a batch never overlap, which the compiler cannot see through the vectors
+#pragma GCC ivdep
+    for(size_t i = 0; i < count; i++)
+    {
+        // Unit square to quad homography (Heckbert), corners 0, 1, 2, 3 at (0,0), (1,0), (1,1), (0,1)
+        double sx = u0[i] - u1[i] + u2[i] - u3[i];
+        double sy = v0[i] - v1[i] + v2[i] - v3[i];
+        double dx1 = u1[i] - u2[i], dx2 = u3[i] - u2[i];
+        double dy1 = v1[i] - v2[i], dy2 = v3[i] - v2[i];
+        double denominator = dx1 * dy2 - dx2 * dy1;
+
+        double g = (sx * dy2 - dx2 * sy) / denominator;
+        double h = (dx1 * sy - sx * dy1) / denominator;
+        double a = u1[i] - u0[i] + g * u1[i];
+        double b = u3[i] - u0[i] + h * u3[i];
+        double d = v1[i] - v0[i] + g * v1[i];
+        double e = v3[i] - v0[i] + h * v3[i];
+
+        // Composed with the model to unit square map: x = X / length + 1/2, y = 1/2 - Y / length,
+        // then scaled so the bottom right entry is 1
+        double w = 1.0 / (0.5 * (g + h) + 1.0);
+        double h00 = a / length * w, h01 = -b / length * w, h02 = (0.5 * (a + b) + u0[i]) * w;
+        double h10 = d / length * w, h11 = -e / length * w, h12 = (0.5 * (d + e) + v0[i]) * w;
+        double h20 = g / length * w, h21 = -h / length * w;
+
+        // Image of the square's centre and the Jacobian of the homography there
+        double p = h02, q = h12;
+        double j00 = h00 - h20 * p, j01 = h01 - h21 * p;
+        double j10 = h10 - h20 * q, j11 = h11 - h21 * q;
+
+        // Rotation taking the optical axis onto the ray through the centre, the ray is never
+        // opposite to the axis for a point in front of the camera
+        double norm = sqrt(p * p + q * q + 1.0);
+        double ax = p / norm, ay = q / norm, az = 1.0 / norm;
+        double f = 1.0 / (1.0 + az);
+        double rv00 = 1.0 - ax * ax * f, rv01 = -ax * ay * f, rv02 = ax;
+        double rv10 = -ax * ay * f, rv11 = 1.0 - ay * ay * f, rv12 = ay;
+        double rv20 = -ax, rv21 = -ay, rv22 = 1.0 - (ax * ax + ay * ay) * f;
+
+        // A = inv(B) * J with B = [I | -v] * Rv(:, 0:1)
+        double b00 = rv00 - p * rv20, b01 = rv01 - p * rv21;
+        double b10 = rv10 - q * rv20, b11 = rv11 - q * rv21;
+        double inverseDeterminant = 1.0 / (b00 * b11 - b01 * b10);
+        double a00 = inverseDeterminant * (b11 * j00 - b01 * j10);
+        double a01 = inverseDeterminant * (b11 * j01 - b01 * j11);
+        double a10 = inverseDeterminant * (b00 * j10 - b10 * j00);
+        double a11 = inverseDeterminant * (b00 * j11 - b10 * j01);
+
+        // Largest singular value of A
+        double ata00 = a00 * a00 + a01 * a01;
+        double ata01 = a00 * a10 + a01 * a11;
+        double ata11 = a10 * a10 + a11 * a11;
+        double gamma = sqrt(0.5 * (ata00 + ata11 + sqrt((ata00 - ata11) * (ata00 - ata11) + 4.0 * ata01 * ata01)));
+
+        double r00 = a00 / gamma, r01 = a01 / gamma;
+        double r10 = a10 / gamma, r11 = a11 / gamma;
+
+        // Third row of the first two columns, the sign of c1 makes the columns orthogonal.
+        // The two solutions differ in the sign of that row.
+        double c0 = sqrt(max(0.0, 1.0 - r00 * r00 - r10 * r10));
+        double c1 = copysign(sqrt(max(0.0, 1.0 - r01 * r01 - r11 * r11)), -(r00 * r01 + r10 * r11));
+
+        // Third column, the cross product of the first two
+        double c20 = r10 * c1 - c0 * r11, c21 = c0 * r01 - r00 * c1, c22 = r00 * r11 - r10 * r01;
+
+        // R = Rv * [col0 col1 col2], row major
+        first[0 * count + i] = rv00 * r00 + rv01 * r10 + rv02 * c0;
+        first[1 * count + i] = rv00 * r01 + rv01 * r11 + rv02 * c1;
+        first[2 * count + i] = rv00 * c20 + rv01 * c21 + rv02 * c22;
+        first[3 * count + i] = rv10 * r00 + rv11 * r10 + rv12 * c0;
+        first[4 * count + i] = rv10 * r01 + rv11 * r11 + rv12 * c1;
+        first[5 * count + i] = rv10 * c20 + rv11 * c21 + rv12 * c22;
+        first[6 * count + i] = rv20 * r00 + rv21 * r10 + rv22 * c0;
+        first[7 * count + i] = rv20 * r01 + rv21 * r11 + rv22 * c1;
+        first[8 * count + i] = rv20 * c20 + rv21 * c21 + rv22 * c22;
+
+        second[0 * count + i] = rv00 * r00 + rv01 * r10 - rv02 * c0;
+        second[1 * count + i] = rv00 * r01 + rv01 * r11 - rv02 * c1;
+        second[2 * count + i] = -rv00 * c20 - rv01 * c21 + rv02 * c22;
+        second[3 * count + i] = rv10 * r00 + rv11 * r10 - rv12 * c0;
+        second[4 * count + i] = rv10 * r01 + rv11 * r11 - rv12 * c1;
+        second[5 * count + i] = -rv10 * c20 - rv11 * c21 + rv12 * c22;
+        second[6 * count + i] = rv20 * r00 + rv21 * r10 - rv22 * c0;
+        second[7 * count + i] = rv20 * r01 + rv21 * r11 - rv22 * c1;
+        second[8 * count + i] = -rv20 * c20 - rv21 * c21 + rv22 * c22;
+    }
+
+    for(int s = 0; s < 2; s++)
+    {
+        const double* R = batch.rotation[s].data();
+
+        double* tx = batch.translation[s][0].data();
+        double* ty = batch.translation[s][1].data();
+        double* tz = batch.translation[s][2].data();
+        double* error = batch.error[s].data();
+
+#pragma GCC ivdep
+        for(size_t i = 0; i < count; i++)
+        {
+            // The rotated corners, the model's corners are (-h, h), (h, h), (h, -h), (-h, -h)
+            double xPlus = R[0 * count + i] * halfLength, xMinus = R[1 * count + i] * halfLength;
+            double yPlus = R[3 * count + i] * halfLength, yMinus = R[4 * count + i] * halfLength;
+            double zPlus = R[6 * count + i] * halfLength, zMinus = R[7 * count + i] * halfLength;
+
+            double rx0 = -xPlus + xMinus, rx1 = xPlus + xMinus, rx2 = xPlus - xMinus, rx3 = -xPlus - xMinus;
+            double ry0 = -yPlus + yMinus, ry1 = yPlus + yMinus, ry2 = yPlus - yMinus, ry3 = -yPlus - yMinus;
+            double rz0 = -zPlus + zMinus, rz1 = zPlus + zMinus, rz2 = zPlus - zMinus, rz3 = -zPlus - zMinus;
+
+            // Least-squares translation: u * (Rz + tz) = Rx + tx and v * (Rz + tz) = Ry + ty for the 4 corners
+            double bx0 = u0[i] * rz0 - rx0, bx1 = u1[i] * rz1 - rx1, bx2 = u2[i] * rz2 - rx2, bx3 = u3[i] * rz3 - rx3;
+            double by0 = v0[i] * rz0 - ry0, by1 = v1[i] * rz1 - ry1, by2 = v2[i] * rz2 - ry2, by3 = v3[i] * rz3 - ry3;
+
+            double sumU = u0[i] + u1[i] + u2[i] + u3[i];
+            double sumV = v0[i] + v1[i] + v2[i] + v3[i];
+            double sumSquares = u0[i] * u0[i] + u1[i] * u1[i] + u2[i] * u2[i] + u3[i] * u3[i]
+                              + v0[i] * v0[i] + v1[i] * v1[i] + v2[i] * v2[i] + v3[i] * v3[i];
+            double rhs0 = bx0 + bx1 + bx2 + bx3;
+            double rhs1 = by0 + by1 + by2 + by3;
+            double rhs2 = -(u0[i] * bx0 + u1[i] * bx1 + u2[i] * bx2 + u3[i] * bx3
+                          + v0[i] * by0 + v1[i] * by1 + v2[i] * by2 + v3[i] * by3);
+
+            // Normal equations [4 0 -sumU; 0 4 -sumV; -sumU -sumV sumSquares] t = rhs, tx and ty eliminated
+            double z = (4.0 * rhs2 + sumU * rhs0 + sumV * rhs1) / (4.0 * sumSquares - sumU * sumU - sumV * sumV);
+            double x = 0.25 * (rhs0 + sumU * z);
+            double y = 0.25 * (rhs1 + sumV * z);
+
+            // Reprojection error in normalized coordinates
+            double du0 = (rx0 + x) / (rz0 + z) - u0[i], dv0 = (ry0 + y) / (rz0 + z) - v0[i];
+            double du1 = (rx1 + x) / (rz1 + z) - u1[i], dv1 = (ry1 + y) / (rz1 + z) - v1[i];
+            double du2 = (rx2 + x) / (rz2 + z) - u2[i], dv2 = (ry2 + y) / (rz2 + z) - v2[i];
+            double du3 = (rx3 + x) / (rz3 + z) - u3[i], dv3 = (ry3 + y) / (rz3 + z) - v3[i];
+
+            tx[i] = x;
+            ty[i] = y;
+            tz[i] = z;
+            error[i] = du0 * du0 + dv0 * dv0 + du1 * du1 + dv1 * dv1 + du2 * du2 + dv2 * dv2 + du3 * du3 + dv3 * dv3;
+        }
+    }
+}
+
+// Axis-angle form of a row-major rotation matrix, also accurate near a half turn where the usual formula divides by zero
+Vec3d rotationMatrixToVector(const double* R)
+{
+    double cosine = max(-1.0, min(1.0, 0.5 * (R[0] + R[4] + R[8] - 1.0)));
+    double angle = acos(cosine);
+    double sine = sin(angle);
+
+    if(sine > 1e-5)
+    {
+        double scale = angle / (2.0 * sine);
+        return Vec3d((R[7] - R[5]) * scale, (R[2] - R[6]) * scale, (R[3] - R[1]) * scale);
+    }
+
+    if(cosine > 0.0)
+    {
+        // Almost no rotation, angle / (2 sin(angle)) tends to 1/2
+        return Vec3d(0.5 * (R[7] - R[5]), 0.5 * (R[2] - R[6]), 0.5 * (R[3] - R[1]));
+    }
+
+    // Half turn: R = 2 * axis * axis^T - I, the largest diagonal entry gives the best conditioned component
+    int k = 0;
+    if(R[4] > R[0]) k = 1;
+    if(R[8] > R[4 * k]) k = 2;
+
+    double axis[3];
+    axis[k] = sqrt(max(0.0, 0.5 * (R[4 * k] + 1.0)));
+    for(int j = 0; j < 3; j++)
+    {
+        if(j != k)
+            axis[j] = (R[3 * j + k] + R[3 * k + j]) / (4.0 * axis[k]);
+    }
+
+    // The sign of the axis is free for a half turn, the antisymmetric part breaks the tie close to it
+    double direction = axis[0] * (R[7] - R[5]) + axis[1] * (R[2] - R[6]) + axis[2] * (R[3] - R[1]);
+    double sign = direction < 0.0 ? -1.0 : 1.0;
+
+    return Vec3d(axis[0] * angle * sign, axis[1] * angle * sign, axis[2] * angle * sign);
+}
+
+/*
+ * Reads the layout of a rigid board: one marker per line, its id then the x y z of its four corners
+ * in meters, in the order the detector returns them (top left, top right, bottom right, bottom left).
+ * Lines starting with # are comments. The atlas sheets of arucoMarkers come with such a file.
+ */
+bool loadBoardLayout(const string& name, MarkerBoard& board)
+{
+    ifstream inStream(name);
+    if(!inStream)
+    {
+        cerr << "Could not read the board layout " << name << endl;
+        return false;
+    }
+
+    board = MarkerBoard();
+    board.name = name;
+
+    string line;
+    int lineNumber = 0;
+    while(getline(inStream, line))
+    {
+        lineNumber++;
+
+        size_t first = line.find_first_not_of(" \t\r");
+        if(first == string::npos || line[first] == '#')
+            continue;
+
+        istringstream fields(line);
+        int id;
+        Point3f corners[4];
+        fields >> id;
+        for(int c = 0; c < 4; c++)
+            fields >> corners[c].x >> corners[c].y >> corners[c].z;
+
+        if(fields.fail())
+        {
+            cerr << name << ":" << lineNumber << ": expected a marker id and 12 coordinates" << endl;
+            return false;
+        }
+
+        if(board.markerIndex.count(id) > 0)
+        {
+            cerr << name << ":" << lineNumber << ": marker " << id << " is listed twice" << endl;
+            return false;
+        }
+
+        board.markerIndex[id] = int(board.corners.size() / 4);
+        board.corners.insert(board.corners.end(), corners, corners + 4);
+    }
+
+    if(board.corners.empty())
+    {
+        cerr << "The board layout " << name << " has no markers" << endl;
+        return false;
+    }
+
+    return true;
+}
+
+// One board per --board file
+bool loadBoardLayouts(const TrackerOptions& options, vector<MarkerBoard>& boards)
+{
+    boards.resize(options.boardLayouts.size());
+    for(size_t b = 0; b < boards.size(); b++)
+    {
+        if(!loadBoardLayout(options.boardLayouts[b], boards[b]))
+            return false;
+    }
+
+    return true;
+}
+
+/*
+ * Poses every board from all its markers in view with one solvePnP, and hands the markers that belong
+ * to no board back to be posed on their own. A board seen in the previous frame starts the solver from
+ * that pose; a warm start that converged far from the corners is solved again from scratch.
+ */
+void estimateBoardPoses(const vector<vector<Point2f>>& markerCorners, const vector<int>& markerIds, const Mat& cameraMatrix, const Mat& distanceCoefficients,
+                        vector<MarkerBoard>& boards, vector<vector<Point2f>>& looseCorners, vector<int>& looseIds)
+{
+    // Corner vectors of loose markers the last frames no longer had, kept by the thread like the pose scratch
+    static thread_local vector<vector<Point2f>> spareCorners;
+
+    looseIds.clear();
+
+    for(size_t b = 0; b < boards.size(); b++)
+    {
+        boards[b].objectPoints.clear();
+        boards[b].imagePoints.clear();
+    }
+
+    // A marker in several layouts belongs to the first one
+    for(size_t i = 0; i < markerIds.size(); i++)
+    {
+        bool onBoard = false;
+        for(size_t b = 0; b < boards.size() && !onBoard; b++)
+        {
+            map<int, int>::const_iterator found = boards[b].markerIndex.find(markerIds[i]);
+            if(found == boards[b].markerIndex.end())
+                continue;
+
+            const Point3f* corners = &boards[b].corners[4 * found->second];
+            boards[b].objectPoints.insert(boards[b].objectPoints.end(), corners, corners + 4);
+            boards[b].imagePoints.insert(boards[b].imagePoints.end(), markerCorners[i].begin(), markerCorners[i].end());
+            onBoard = true;
+        }
+
+        if(!onBoard)
+        {
+            // Assigned to the vectors of the previous frame, not rebuilt
+            size_t loose = looseIds.size();
+            if(looseCorners.size() <= loose)
+                resizeCornerList(looseCorners, loose + 1, spareCorners);
+            looseCorners[loose].assign(markerCorners[i].begin(), markerCorners[i].end());
+            looseIds.push_back(markerIds[i]);
+        }
+    }
+    resizeCornerList(looseCorners, looseIds.size(), spareCorners);
+
+    for(size_t b = 0; b < boards.size(); b++)
+    {
+        MarkerBoard& board = boards[b];
+        board.frames++;
+
+        if(board.imagePoints.empty())
+        {
+            // Too long ago to start from next time it shows up
+            board.hasPose = false;
+            continue;
+        }
+
+        bool warm = board.hasPose;
+        bool solved = solvePnP(board.objectPoints, board.imagePoints, cameraMatrix, distanceCoefficients, board.rotation, board.translation, warm, SOLVEPNP_ITERATIVE);
+
+        double error = solved ? boardReprojectionError(board, cameraMatrix, distanceCoefficients) : DBL_MAX;
+        if(warm && error > board.maxReprojectionError)
+        {
+            board.coldRetries++;
+            solved = solvePnP(board.objectPoints, board.imagePoints, cameraMatrix, distanceCoefficients, board.rotation, board.translation, false, SOLVEPNP_ITERATIVE);
+            error = solved ? boardReprojectionError(board, cameraMatrix, distanceCoefficients) : DBL_MAX;
+        }
+
+        board.hasPose = solved && error <= board.maxReprojectionError;
+        if(!board.hasPose)
+            continue;
+
+        board.posedFrames++;
+        board.warmStarts += warm ? 1 : 0;
+        board.markersUsed += board.imagePoints.size() / 4;
+        board.errorSum += error;
+    }
+}
+
+// Root mean square distance in pixels between the detected corners of a board and its reprojected layout
+double boardReprojectionError(MarkerBoard& board, const Mat& cameraMatrix, const Mat& distanceCoefficients)
+{
+    projectPoints(board.objectPoints, board.rotation, board.translation, cameraMatrix, distanceCoefficients, board.projectedPoints);
+
+    double sum = 0.0;
+    for(size_t p = 0; p < board.imagePoints.size(); p++)
+    {
+        Point2f difference = board.projectedPoints[p] - board.imagePoints[p];
+        sum += difference.dot(difference);
+    }
+
+    return sqrt(sum / max<size_t>(1, board.imagePoints.size()));
+}
 
-    for(int i = 0; i < 50; i++)
+void printBoardStatistics(const vector<MarkerBoard>& boards)
+{
+    for(size_t b = 0; b < boards.size(); b++)
     {
-        // We will these markers on the image
-        /*The first parameter is the Dictionary object previously created.
-          The second parameter is the marker id, in this case the marker 23 of the dictionary DICT_4X4_. Note that each dictionary is composed by a different number of markers. 
-          In this case, the valid ids go from 0 to 49. 
-          The third parameter is the size of output image
-          The forth parameter is the output image.
-          Finally, the last parameter is an optional parameter to specify the width of the marker black border.
-         */
-        aruco::drawMarker(markerDictionary, i, 500, outputMarker, 1);
-        ostringstream convert;
+        const MarkerBoard& board = boards[b];
+        size_t posed = max<size_t>(1, board.posedFrames);
 
-        string imageName = "4x4Marker_";
-        convert << imageName << i << ".jpg";
-        
-        // We write it to the image
-        imwrite(convert.str(), outputMarker);
+        cout << "Board " << board.name << ": posed in " << board.posedFrames << " of " << board.frames << " frames, "
+             << double(board.markersUsed) / posed << " markers per solve, " << board.warmStarts << " warm starts, "
+             << board.coldRetries << " solved again from scratch, mean reprojection error " << board.errorSum / posed << " px" << endl;
     }
 }
 
-//This function  create known board position in 3D
-void createKnownBoardPosition(Size boardSize, float squareEdgeLength, vector<Point3f>& corners)
+const char* metricsStageNames[STAGE_COUNT] = { "capture", "detect", "pose", "draw", "display", "total", "age" };
+
+void startStageMetrics(const TrackerOptions& options, StageMetrics& metrics)
 {
-    for(int i = 0; i < boardSize.height; i++)
-    {
-        for(int j = 0 ; j < boardSize.width; j++)
-        {
-            // The corners detected are pushed into corners
-            corners.push_back(Point3f(j * squareEdgeLength, i * squareEdgeLength, 0.0f));
-        }
-    }
+    metrics.file = options.metricsFile;
+    metrics.interval = max(0.1, options.metricsInterval);
+    metrics.started = chrono::steady_clock::now();
+    metrics.nextExport = metrics.started + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(metrics.interval));
 }
 
-//We retrieve the corners from the chessboard
-void getChessboardCorners(vector<Mat> images, vector<vector<Point2f>>& allFoundCorners, bool showResults = false )
+inline void recordStage(StageMetrics& metrics, MetricsStage stage, chrono::steady_clock::time_point start, chrono::steady_clock::time_point end)
 {
-    for (vector<Mat>::iterator iter = images.begin(); iter != images.end(); iter++)
-    {
-        vector<Point2f> pointBuf;
-        bool found = findChessboardCorners(*iter, Size(9,6), pointBuf, CV_CALIB_CB_ADAPTIVE_THRESH | CV_CALIB_CB_FAST_CHECK);
+    metrics.stages[stage].record(end - start);
+}
 
-        if(found){
-            //We save the corner in allfoundconers data structure
-            allFoundCorners.push_back(pointBuf);
-        }
+// Only one thread of a loop calls this, the export itself reads the histograms while the others keep recording
+void exportStageMetricsIfDue(StageMetrics& metrics)
+{
+    if(metrics.file.empty())
+        return;
 
-        if(showResults)
-        {
-            // We can draw the corners and show them
-            drawChessboardCorners(*iter, Size(9,6), pointBuf, found);
-            imshow("Looking for corners", *iter);
-            waitKey(0);
-        }
-    }
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    if(now < metrics.nextExport)
+        return;
 
+    exportStageMetrics(metrics);
+    metrics.nextExport = now + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(metrics.interval));
 }
 
-// This function will populate cameraMatrix which carries our camera model as well as distance coefficients
-bool saveCameraCalibration(string name, Mat cameraMatrix, Mat distanceCoeffients)
+/*
+ * Writes the histograms accumulated since the start, as CSV when the file name ends in .csv and as
+ * JSON otherwise. The file is written next to its final name and renamed over it, so whatever
+ * scrapes it never reads half an export.
+ */
+bool exportStageMetrics(const StageMetrics& metrics)
 {
-    ofstream outStream(name);
-    if(outStream)
-    {
-        uint16_t rows = cameraMatrix.rows;
-        uint16_t columns = cameraMatrix.cols;
+    if(metrics.file.empty())
+        return true;
 
-        outStream << rows << endl;
-        outStream << columns << endl;
+    string temporaryFile = metrics.file + ".tmp";
+    bool csv = metrics.file.size() >= 4 && metrics.file.compare(metrics.file.size() - 4, 4, ".csv") == 0;
+    double elapsedSeconds = chrono::duration<double>(chrono::steady_clock::now() - metrics.started).count();
 
-        for(int r = 0; r < rows; r++)
+    {
+        ofstream outStream(temporaryFile);
+        if(!outStream)
         {
-            for(int c = 0; c< columns; c++)
-            {
-                double value = cameraMatrix.at<double>(r,c);
-                outStream << value << endl;
-            }
+            cerr << "Could not write " << temporaryFile << endl;
+            return false;
         }
 
-        rows = distanceCoeffients.rows;
-        columns = distanceCoeffients.cols;
+        outStream << fixed << setprecision(3);
 
-        outStream << rows << endl;
-        outStream << columns << endl;
+        if(csv)
+            outStream << "stage,count,mean_ms,p50_ms,p90_ms,p99_ms,max_ms" << endl;
+        else
+            outStream << "{\"elapsed_s\": " << elapsedSeconds << ", \"stages\": [";
 
-        for(int r = 0; r < rows; r++)
+        bool first = true;
+        for(int s = 0; s < STAGE_COUNT; s++)
         {
-            for(int c = 0; c< columns; c++)
+            const LatencyHistogram& histogram = metrics.stages[s];
+            if(histogram.count() == 0)
+                continue;
+
+            if(csv)
             {
-                double value = distanceCoeffients.at<double>(r,c);
-                outStream << value << endl;
+                outStream << metricsStageNames[s] << "," << histogram.count() << "," << histogram.meanMilliseconds() << ","
+                          << histogram.percentileMilliseconds(50) << "," << histogram.percentileMilliseconds(90) << ","
+                          << histogram.percentileMilliseconds(99) << "," << histogram.maxMilliseconds() << endl;
+            }
+            else
+            {
+                outStream << (first ? "" : ", ") << "{\"stage\": \"" << metricsStageNames[s] << "\", \"count\": " << histogram.count()
+                          << ", \"mean_ms\": " << histogram.meanMilliseconds()
+                          << ", \"p50_ms\": " << histogram.percentileMilliseconds(50)
+                          << ", \"p90_ms\": " << histogram.percentileMilliseconds(90)
+                          << ", \"p99_ms\": " << histogram.percentileMilliseconds(99)
+                          << ", \"max_ms\": " << histogram.maxMilliseconds() << "}";
             }
+            first = false;
         }
 
-        outStream.close();
-        return true;
+        if(!csv)
+            outStream << "]}" << endl;
     }
 
-    return false;
+    if(rename(temporaryFile.c_str(), metrics.file.c_str()) != 0)
+    {
+        cerr << "Could not replace " << metrics.file << endl;
+        return false;
+    }
+
+    return true;
 }
 
-void cameraCalibration(vector<Mat> calibrationImages, Size boardSize, float squareEdgeLength, Mat& cameraMatrix, Mat& distanceCoefficients )
+// Installs the counting Mat allocator and turns the operator new counter on
+void startAllocationCounting(const TrackerOptions& options, AllocationStats& stats)
 {
-    vector<vector<Point2f>> checkerboardImageSpacePoints;
-
-    //false bcz we dont want to see the output
-    getChessboardCorners(calibrationImages, checkerboardImageSpacePoints, false);
+    stats.enabled = options.countAllocations;
+    if(!stats.enabled)
+        return;
 
-    // 3D coordinates
-    vector<vector<Point3f>> worldSpaceCornerPoints(1);
+    // Full-frame integral detection with the run finder and batched poses, without boards: after the
+    // warm-up a frame should not allocate at all
+    stats.expectNone = options.detectionMode == "full" && options.detector == "integral" && options.quadFinder == "runs" &&
+                       options.poseEngine == POSE_BATCHED && options.boardLayouts.empty();
 
-    // Extract the 3D coordinates relative to the board size
-    createKnownBoardPosition(boardSize, squareEdgeLength, worldSpaceCornerPoints[0]);
+    static CountingMatAllocator countingAllocator;
+    Mat::setDefaultAllocator(&countingAllocator);
+    allocationCounting.store(true);
+}
 
-    // We resize the world space corners
-    worldSpaceCornerPoints.resize(checkerboardImageSpacePoints.size(), worldSpaceCornerPoints[0]);
+/*
+ * marks holds allocationCount() at the start of the frame and after capture, detection, pose,
+ * drawing and display. Frames before warmupFrames only reset the split between heap and Mat counts.
+ */
+void recordFrameAllocations(AllocationStats& stats, const size_t* marks)
+{
+    if(!stats.enabled)
+        return;
 
-    vector<Mat> rVectors, tVectors;
+    if(++stats.seenFrames <= stats.warmupFrames)
+    {
+        stats.heapAtStart = heapAllocations.load(memory_order_relaxed);
+        stats.matAtStart = matAllocations.load(memory_order_relaxed);
+        return;
+    }
 
-    distanceCoefficients = Mat::zeros(8,1,CV_64F);
+    for(int s = STAGE_CAPTURE; s <= STAGE_DISPLAY; s++)
+        stats.perStage[s] += marks[s + 1] - marks[s];
 
-    //We calibrate the camera
-    calibrateCamera(worldSpaceCornerPoints, checkerboardImageSpacePoints, boardSize, cameraMatrix, distanceCoefficients, rVectors, tVectors);
+    size_t allocated = marks[STAGE_DISPLAY + 1] - marks[0];
+    stats.perStage[STAGE_TOTAL] += allocated;
+    stats.maxPerFrame = max(stats.maxPerFrame, allocated);
+    if(allocated > 0 && stats.framesWithAllocations++ == 0)
+        stats.firstAllocatingFrame = stats.seenFrames;
+    stats.frames++;
 }
 
-// Track aruco markers
-int startWebCameraMonitoring(const Mat& cameraMatrix, const Mat& distanceCoefficients, float arucoSquareDimensions)
+void printAllocationStats(const AllocationStats& stats)
 {
-    Mat frame;
+    if(!stats.enabled)
+        return;
 
-    vector<int> markerIds;
-    vector<vector<Point2f>> markerCorners, rejectedCandidates;
+    if(stats.frames == 0)
+    {
+        cout << "Allocations: no frames after the " << stats.warmupFrames << " warm-up frames" << endl;
+        return;
+    }
 
+    cout << fixed << setprecision(2);
+    cout << "Allocations per frame after " << stats.warmupFrames << " warm-up frames:";
+    for(int s = STAGE_CAPTURE; s <= STAGE_TOTAL; s++)
+        cout << " " << metricsStageNames[s] << " " << double(stats.perStage[s]) / stats.frames;
+    cout << endl;
 
-    //aruco::DetectorParameters parameters;
-    cv::Ptr<cv::aruco::DetectorParameters> parameters;
-    Ptr<aruco::Dictionary> markerDictionary = aruco::getPredefinedDictionary(aruco::PREDEFINED_DICTIONARY_NAME::DICT_4X4_50);
+    cout << "Frames that allocated: " << stats.framesWithAllocations << " of " << stats.frames << ", at most " << stats.maxPerFrame
+         << " allocations in one frame (" << heapAllocations.load() - stats.heapAtStart << " heap, "
+         << matAllocations.load() - stats.matAtStart << " Mat buffers in total, capture and preview threads included)" << endl;
 
-    // We capture the video
-    VideoCapture vid(0);
+    if(!stats.expectNone)
+        return;
 
-    if(!vid.isOpened())
+    // More markers than in any frame before still allocate their corners, otherwise this path should not allocate
+    if(stats.framesWithAllocations == 0)
+        cout << "Allocation-free: none of the " << stats.frames << " frames allocated, as expected for this configuration" << endl;
+    else
+        cout << "Allocation-free: expected 0 allocations per frame for this configuration, frame " << stats.firstAllocatingFrame
+             << " was the first of " << stats.framesWithAllocations << " that allocated" << endl;
+}
+
+void printStageMetrics(const StageMetrics& metrics)
+{
+    cout << fixed << setprecision(2);
+    for(int s = 0; s < STAGE_COUNT; s++)
     {
-        return -1;
+        const LatencyHistogram& histogram = metrics.stages[s];
+        if(histogram.count() == 0)
+            continue;
+
+        cout << setw(8) << metricsStageNames[s] << " ms:"
+             << " mean " << histogram.meanMilliseconds()
+             << " p50 " << histogram.percentileMilliseconds(50)
+             << " p90 " << histogram.percentileMilliseconds(90)
+             << " p99 " << histogram.percentileMilliseconds(99)
+             << " max " << histogram.maxMilliseconds()
+             << " (" << histogram.count() << " samples)" << endl;
     }
+}
 
-    namedWindow("Webcam", 1000);
+// Runs both pose engines on the same corners, timing each and measuring how far apart their poses are
+void comparePoseEngines(const vector<vector<Point2f>>& markerCorners, float markerLength, const Mat& cameraMatrix, const Mat& distanceCoefficients, PoseEngineComparison& comparison)
+{
+    typedef chrono::steady_clock Clock;
 
-    vector<Vec3d> rotationVectors, translationVectors;
+    if(markerCorners.empty())
+        return;
 
-    while (true)
-    {
-        if(!vid.read(frame))
-            break;
-        
-        // Detect the markers and estimate the pose of given marker
-        aruco::detectMarkers(frame, markerDictionary, markerCorners, markerIds );
-        aruco::estimatePoseSingleMarkers(markerCorners, arucoSquareDimensions, cameraMatrix, distanceCoefficients, rotationVectors, translationVectors);
+    vector<Vec3d> iterativeRotations, iterativeTranslations, batchedRotations, batchedTranslations;
 
-        for(int i = 0; i < markerIds.size(); i++)
-        {
-            aruco::drawAxis(frame, cameraMatrix, distanceCoefficients, rotationVectors[i], translationVectors[i], 0.1f);
-        }
+    Clock::time_point start = Clock::now();
+    aruco::estimatePoseSingleMarkers(markerCorners, markerLength, cameraMatrix, distanceCoefficients, iterativeRotations, iterativeTranslations);
+    Clock::time_point iterativeDone = Clock::now();
+    estimatePosesBatched(markerCorners, markerLength, cameraMatrix, distanceCoefficients, batchedRotations, batchedTranslations);
+    Clock::time_point batchedDone = Clock::now();
 
-        imshow("Webcam", frame);
+    comparison.iterativeTimes.push_back(chrono::duration<double, milli>(iterativeDone - start).count());
+    comparison.batchedTimes.push_back(chrono::duration<double, milli>(batchedDone - iterativeDone).count());
 
-        if(waitKey(30) >= 0) break;
+    for(size_t i = 0; i < markerCorners.size(); i++)
+    {
+        comparison.angleDifferences.push_back(rotationAngleBetween(iterativeRotations[i], batchedRotations[i]));
+        comparison.translationDifferences.push_back(norm(iterativeTranslations[i] - batchedTranslations[i]) / max(norm(iterativeTranslations[i]), 1e-9));
     }
+}
 
-    return 1;
+void printPoseEngineComparison(const PoseEngineComparison& comparison)
+{
+    if(comparison.iterativeTimes.empty())
+    {
+        cout << "Pose comparison: no frame had markers" << endl;
+        return;
+    }
+
+    double iterativeTotal = 0.0, batchedTotal = 0.0;
+    for(size_t i = 0; i < comparison.iterativeTimes.size(); i++)
+    {
+        iterativeTotal += comparison.iterativeTimes[i];
+        batchedTotal += comparison.batchedTimes[i];
+    }
+
+    cout << "Pose comparison over " << comparison.iterativeTimes.size() << " frames, " << comparison.angleDifferences.size() << " markers:" << endl;
+    printTimingSummary("iterative", comparison.iterativeTimes);
+    printTimingSummary("batched", comparison.batchedTimes);
+    cout << "Batched is " << iterativeTotal / max(batchedTotal, 1e-9) << "x faster" << endl;
+
+    // printTimingSummary only formats, the differences are not milliseconds
+    vector<double> angles = comparison.angleDifferences, translations = comparison.translationDifferences;
+    sort(angles.begin(), angles.end());
+    sort(translations.begin(), translations.end());
+
+    size_t last = angles.size() - 1;
+    cout << "Rotation difference deg: p50 " << angles[last / 2] << " p99 " << angles[last * 99 / 100] << " max " << angles[last] << endl;
+    cout << "Relative translation difference: p50 " << translations[last / 2] << " p99 " << translations[last * 99 / 100] << " max " << translations[last] << endl;
 }
 
 bool loadCameraCalibration(string name, Mat& cameraMatrix, Mat& distanceCoeffients)
 {
+    // A binary file only needs its two small matrices copied out of the mapping
+    CameraCalibration calibration;
+    if(mapCameraCalibration(name, calibration))
+    {
+        cameraMatrix = calibration.cameraMatrix.clone();
+        distanceCoeffients = calibration.distanceCoefficients.clone();
+        return true;
+    }
+
     ifstream inStream(name);
 
     if(inStream)
@@ -224,7 +6205,6 @@ bool loadCameraCalibration(string name, Mat& cameraMatrix, Mat& distanceCoeffien
 
                 inStream >> read;
                 cameraMatrix.at<double>(r,c) = read;
-                cout << cameraMatrix.at<double>(r, c) << "\n";
             }
         }
 
@@ -241,7 +6221,6 @@ bool loadCameraCalibration(string name, Mat& cameraMatrix, Mat& distanceCoeffien
                 double read = 0.0f;
                 inStream >> read;
                 distanceCoeffients.at<double>(r,c) = read;
-                cout << distanceCoeffients.at<double>(r, c) << "\n";
             }
         }
 
@@ -252,17 +6231,16 @@ bool loadCameraCalibration(string name, Mat& cameraMatrix, Mat& distanceCoeffien
     return false;
 }
 
+/*
+ * Live calibration from frames chosen by hand. The chessboard is searched by a ChessboardPreview
+ * thread, the preview shows every new frame with the corners of the most recent search drawn on it.
+ */
 void cameraCalibrationProcess(Mat& cameraMatrix, Mat& distanceCoeffients)
 {
     Mat frame;
-    Mat drawToFrame;
-    
-    int framePerSecond = 20;
 
     vector<Mat> savedImages;
 
-    vector<vector<Point2f>> markerCorners, rejectedCandidates;
-
     VideoCapture vid(0);
 
     if(!vid.isOpened())
@@ -272,26 +6250,31 @@ void cameraCalibrationProcess(Mat& cameraMatrix, Mat& distanceCoeffients)
 
     namedWindow("Webcam", 1000);
 
+    // Searching a 640 pixel wide copy keeps up with the camera even on 4K frames
+    ChessboardPreview preview(chessboardDimensions, 640);
+
+    ChessboardDetection detection;
+    size_t searchedSequence = 0, savedSequence = 0;
+
     while(true)
     {
        if(!vid.read(frame))
             break;
 
-        vector<Vec2f> foundPoints;
-        bool found = false;
+        preview.submit(frame);
 
-        found = findChessboardCorners(frame, chessboardDimensions, foundPoints, CV_CALIB_CB_ADAPTIVE_THRESH | CV_CALIB_CB_FAST_CHECK );
-        frame.copyTo(drawToFrame);
+        // The corners may be a frame or two old, they are drawn on the newest frame anyway
+        preview.latest(detection, searchedSequence);
+        drawChessboardCorners(frame, chessboardDimensions, detection.corners, detection.found);
 
-        drawChessboardCorners(drawToFrame, chessboardDimensions, foundPoints, found);
+        ostringstream status;
+        status << savedImages.size() << " saved, search " << fixed << setprecision(0) << detection.milliseconds << " ms";
+        putText(frame, status.str(), Point(10, 25), FONT_HERSHEY_SIMPLEX, 0.6, Scalar(0, 255, 255), 2);
+
+        imshow("Webcam", frame);
 
-        if(found)
-            imshow("Webcam", drawToFrame);
-        else
-            imshow("Webcam", frame);
-        
         // This character will help us save images for callibration
-        char character = waitKey(1000 / framePerSecond);
+        char character = waitKey(1);
 
         /*
          * Press s to save the images. First do a camera calibration, change posistion of the chessboard and press s for as many times as more than specified
@@ -302,40 +6285,464 @@ void cameraCalibrationProcess(Mat& cameraMatrix, Mat& distanceCoeffients)
         switch(character)
         {
             case 's':
-            //saving the image
-            if(found)
+            //saving a copy of the frame the board was last found in, the only buffer a save needs
+            if(detection.found && searchedSequence != savedSequence)
             {
-                Mat temp;
-                frame.copyTo(temp);
-                savedImages.push_back(temp);
+                savedImages.push_back(Mat());
+                if(!preview.copyFoundFrame(savedImages.back(), savedSequence))
+                    savedImages.pop_back();
             }
                 break;
             case 'f':
                 if(savedImages.size() > 3)
                 {
-                    cameraCalibration(savedImages, chessboardDimensions, calibrationSquareDimension, cameraMatrix, distanceCoeffients);
-                    saveCameraCalibration("CameraCalibrationFile.txt", cameraMatrix, distanceCoeffients);
+                    if(cameraCalibration(savedImages, chessboardDimensions, calibrationSquareDimension, cameraMatrix, distanceCoeffients))
+                    {
+                        saveCameraCalibration("CameraCalibrationFile.txt", cameraMatrix, distanceCoeffients);
+                        saveCameraCalibrationBinary("CameraCalibrationFile.calib", cameraMatrix, distanceCoeffients, frame.size());
+                    }
                 }
             //start calibration
                 break;
 
             case 'b':
                 //exit
+                cout << preview.replacedCount() << " preview frames were replaced before the chessboard search got to them" << endl;
                 return;
                 break;
         }
     }
 }
 
-int main(int argv, char **argc)
+/*
+ * Live calibration that picks its own keyframes. A frame with a steady board is kept when it puts
+ * corners into cells of the image no keyframe covered yet, or when it sees the board from a pose no
+ * keyframe had. Each new keyframe re-solves the calibration starting from the previous intrinsics,
+ * which takes a few iterations instead of a solve from scratch. The reprojection error and the coverage
+ * are drawn on the preview so it shows when the calibration has converged. f saves it, b or Esc leaves.
+ */
+int startIncrementalCalibration(const TrackerOptions& options, Mat& cameraMatrix, Mat& distanceCoefficients)
+{
+    FrameSource source;
+    if(!source.open(options.input))
+    {
+        cerr << "Could not open " << (options.input.empty() ? string("the webcam") : options.input) << endl;
+        return -1;
+    }
+
+    IncrementalCalibration calibration;
+    calibration.boardSize = chessboardDimensions;
+    createKnownBoardPosition(calibration.boardSize, calibrationSquareDimension, calibration.boardPoints);
+    calibration.coveredCells.assign(calibration.coverageColumns * calibration.coverageRows, false);
+
+    namedWindow("Webcam", 1000);
+
+    Mat frame, gray, small;
+    while(true)
+    {
+        if(!source.read(frame))
+            break;
+
+        calibration.imageSize = frame.size();
+        cvtColor(frame, gray, COLOR_BGR2GRAY);
+
+        vector<Point2f> corners;
+        bool found = findChessboardCornersScaled(gray, calibration.boardSize, 640, small, corners);
+
+        if(found)
+        {
+            if(addCalibrationKeyframe(calibration, corners))
+                solveIncrementalCalibration(calibration);
+        }
+        else
+        {
+            calibration.previousCorners.clear();
+        }
+
+        drawChessboardCorners(frame, calibration.boardSize, corners, found);
+        drawCalibrationStatus(frame, calibration);
+        imshow("Webcam", frame);
+
+        char character = waitKey(1);
+        if(character == 'f' && calibration.calibrated)
+        {
+            saveCameraCalibration("CameraCalibrationFile.txt", calibration.cameraMatrix, calibration.distanceCoefficients);
+            saveCameraCalibrationBinary("CameraCalibrationFile.calib", calibration.cameraMatrix, calibration.distanceCoefficients, calibration.imageSize);
+            cout << "Saved the calibration from " << calibration.keyframes.size() << " keyframes, reprojection error "
+                 << calibration.reprojectionError << " px" << endl;
+        }
+        else if(character == 'b' || character == 27)
+            break;
+    }
+
+    if(!calibration.calibrated)
+        return -1;
+
+    cameraMatrix = calibration.cameraMatrix.clone();
+    distanceCoefficients = calibration.distanceCoefficients.clone();
+    return 1;
+}
+
+// Keeps the corners as a keyframe when the board is steady and adds coverage or a new pose, the reason goes to lastDecision
+bool addCalibrationKeyframe(IncrementalCalibration& calibration, const vector<Point2f>& corners)
+{
+    // A moving board is blurred and its corners lag behind, wait until it stops
+    bool steady = calibration.previousCorners.size() == corners.size();
+    for(size_t c = 0; c < corners.size() && steady; c++)
+    {
+        Point2f motion = corners[c] - calibration.previousCorners[c];
+        steady = motion.dot(motion) <= calibration.maxCornerMotion * calibration.maxCornerMotion;
+    }
+    calibration.previousCorners = corners;
+
+    if(!steady)
+    {
+        calibration.lastDecision = "board moving";
+        return false;
+    }
+
+    int newCells = 0;
+    vector<int> cells;
+    for(size_t c = 0; c < corners.size(); c++)
+    {
+        int column = min(calibration.coverageColumns - 1, max(0, int(corners[c].x * calibration.coverageColumns / calibration.imageSize.width)));
+        int row = min(calibration.coverageRows - 1, max(0, int(corners[c].y * calibration.coverageRows / calibration.imageSize.height)));
+        int cell = row * calibration.coverageColumns + column;
+
+        if(!calibration.coveredCells[cell] && find(cells.begin(), cells.end(), cell) == cells.end())
+            newCells++;
+        cells.push_back(cell);
+    }
+
+    // Once calibrated board poses are compared, before that only where the corners are in the image
+    Vec3d rotation, translation;
+    if(calibration.calibrated)
+        solvePnP(calibration.boardPoints, corners, calibration.cameraMatrix, calibration.distanceCoefficients, rotation, translation);
+
+    double diagonal = sqrt(double(calibration.imageSize.width) * calibration.imageSize.width + double(calibration.imageSize.height) * calibration.imageSize.height);
+
+    bool newPose = true;
+    for(size_t k = 0; k < calibration.keyframes.size() && newPose; k++)
+    {
+        const CalibrationKeyframe& keyframe = calibration.keyframes[k];
+
+        if(calibration.calibrated)
+        {
+            double rotationChange = rotationAngleBetween(rotation, keyframe.rotation);
+            double translationChange = norm(translation - keyframe.translation) / max(norm(keyframe.translation), 1e-9);
+            newPose = rotationChange >= calibration.minRotationChange || translationChange >= calibration.minTranslationChange;
+        }
+        else
+        {
+            double shift = 0.0;
+            for(size_t c = 0; c < corners.size(); c++)
+                shift += norm(corners[c] - keyframe.corners[c]);
+            newPose = shift / corners.size() >= calibration.minCornerShift * diagonal;
+        }
+    }
+
+    if(newCells == 0 && !newPose)
+    {
+        calibration.lastDecision = "nothing new";
+        return false;
+    }
+
+    for(size_t c = 0; c < cells.size(); c++)
+        calibration.coveredCells[cells[c]] = true;
+
+    CalibrationKeyframe keyframe;
+    keyframe.corners = corners;
+    keyframe.rotation = rotation;
+    keyframe.translation = translation;
+    calibration.keyframes.push_back(keyframe);
+
+    ostringstream decision;
+    decision << "keyframe " << calibration.keyframes.size() << ": " << newCells << " new cells" << (newPose ? ", new pose" : "");
+    calibration.lastDecision = decision.str();
+    return true;
+}
+
+// Solves again with all the keyframes, from the previous intrinsics once there are some
+void solveIncrementalCalibration(IncrementalCalibration& calibration)
+{
+    if(int(calibration.keyframes.size()) < calibration.minKeyframes)
+        return;
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    vector<vector<Point3f>> objectPoints(calibration.keyframes.size(), calibration.boardPoints);
+    vector<vector<Point2f>> imagePoints;
+    for(size_t k = 0; k < calibration.keyframes.size(); k++)
+        imagePoints.push_back(calibration.keyframes[k].corners);
+
+    // Warm starts only have to follow the small change one more view brings
+    int flags = 0;
+    int iterations = 30;
+    if(calibration.calibrated)
+    {
+        flags |= CALIB_USE_INTRINSIC_GUESS;
+        iterations = 10;
+    }
+    else
+    {
+        calibration.cameraMatrix = Mat::eye(3, 3, CV_64F);
+        calibration.distanceCoefficients = Mat::zeros(8, 1, CV_64F);
+    }
+
+    vector<Mat> rVectors, tVectors;
+    calibration.reprojectionError = calibrateCamera(objectPoints, imagePoints, calibration.imageSize, calibration.cameraMatrix, calibration.distanceCoefficients,
+                                                    rVectors, tVectors, flags, TermCriteria(TermCriteria::COUNT | TermCriteria::EPS, iterations, DBL_EPSILON));
+    calibration.calibrated = true;
+
+    // The poses of this solve are what the next frames are compared against
+    for(size_t k = 0; k < calibration.keyframes.size(); k++)
+    {
+        calibration.keyframes[k].rotation = rVectors[k];
+        calibration.keyframes[k].translation = tVectors[k];
+    }
+
+    calibration.solveMilliseconds = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+void drawCalibrationStatus(Mat& frame, const IncrementalCalibration& calibration)
+{
+    // Covered cells get a green outline
+    int covered = 0;
+    for(int row = 0; row < calibration.coverageRows; row++)
+    {
+        for(int column = 0; column < calibration.coverageColumns; column++)
+        {
+            if(!calibration.coveredCells[row * calibration.coverageColumns + column])
+                continue;
+
+            covered++;
+            Point topLeft(column * frame.cols / calibration.coverageColumns, row * frame.rows / calibration.coverageRows);
+            Point bottomRight((column + 1) * frame.cols / calibration.coverageColumns - 1, (row + 1) * frame.rows / calibration.coverageRows - 1);
+            rectangle(frame, topLeft, bottomRight, Scalar(0, 200, 0), 1);
+        }
+    }
+
+    ostringstream status;
+    status << calibration.keyframes.size() << " keyframes, coverage " << fixed << setprecision(0) << 100.0 * covered / calibration.coveredCells.size() << "%";
+    if(calibration.calibrated)
+        status << ", error " << setprecision(3) << calibration.reprojectionError << " px, solve " << setprecision(0) << calibration.solveMilliseconds << " ms";
+
+    putText(frame, status.str(), Point(10, 25), FONT_HERSHEY_SIMPLEX, 0.6, Scalar(0, 255, 255), 2);
+    putText(frame, calibration.lastDecision, Point(10, 50), FONT_HERSHEY_SIMPLEX, 0.6, Scalar(0, 255, 255), 2);
+}
+
+/*
+ * Command line:
+ *   --input <path>     video file or directory of images instead of the webcam
+ *   --headless         no window and no frame pacing, prints frames/s and timings at the end (needs --input)
+ *   --timings <file>   also write the per-frame timings of the headless replay as CSV
+ *   --pipeline         capture, detection, pose and rendering on their own threads, works with or without --headless
+ *   --workers <n>      detection threads of the pipeline and of the multi-camera mode (2)
+ *   --queue-depth <n>  frames held between two pipeline stages (8)
+ *   --mode <name>      full: search the whole frame every time (default)
+ *                      roi: search around the markers of the previous frame only
+ *                      pyramid: search a downscaled frame, refine the corners at full resolution
+ *                      flow: detect every --sweep-interval frames, follow the markers with optical flow in between
+ *                      tiled: overlapping tiles of the frame searched in parallel, for large frames
+ *   --max-marker-side <px>  largest marker the tiled mode must find, the overlap of its tiles (0: a quarter more than
+ *                      the largest marker seen lately, at least 256 px or a quarter of the frame if smaller, and
+ *                      the whole frame searched every --sweep-interval frames to find larger markers across a seam)
+ *   --pyramid-scale <n>   1, 2 or 4 for a fixed downscale, 0 to pick it from the recent marker sizes (0)
+ *   --sweep-interval <n>  frames between two full-frame sweeps of a tracking mode (10)
+ *   --detector <name>  aruco: aruco::detectMarkers (default)
+ *                      integral: same steps, all adaptive thresholds computed from one integral image
+ *   --quads <name>     how the integral detector finds quads, runs: run-length encoded rows joined into components
+ *                      in parallel row bands (default), contours: findContours and approxPolyDP
+ *   --verify           headless replay also runs a full-frame aruco::detectMarkers and reports frames whose IDs differ
+ *   --pose <name>      iterative: estimatePoseSingleMarkers (default)
+ *                      batched: closed-form planar solver for all the markers of a frame at once
+ *   --compare-pose     headless replay also times both pose engines on the same corners and reports how far apart they are
+ *   --benchmark        detection and pose accuracy and speed on synthetic scenes built from the 4x4Marker_*.jpg images
+ *                      (4x4Marker_*.png when there is no .jpg)
+ *                      in --input (current directory), VGA to 4K, 1 to 50 markers, with blur, noise and lighting changes.
+ *                      --timings writes one CSV row per case
+ *   --benchmark-frames <n>  frames per benchmark case (10)
+ *   --benchmark-seed <n>    seed of the synthetic scenes (1)
+ *   --camera <source>[,<calibration file>]  repeat for every camera to track in one process. The source is a
+ *                      device index, a video file or an image directory, the calibration defaults to
+ *                      CameraCalibrationFile.txt. Detection of all the cameras shares --workers threads
+ *   --calibrate <mode> calibrate the camera from a chessboard instead of tracking
+ *                      batch: s keeps the frame, f calibrates from all the kept frames
+ *                      incremental: frames of a steady board that add coverage or a new pose become keyframes
+ *                      on their own and refine the calibration, f saves it, b leaves
+ *   --calibration <file>  camera calibration, text or binary (CameraCalibrationFile.txt)
+ *   --undistort        undistort the frames with the maps of a binary calibration before detecting, poses then use no distortion
+ *   --write-calibration <file>  write --calibration as a binary file with undistortion maps and exit
+ *   --resolution <w>x<h>  frame size the maps of --write-calibration are built for (640x480)
+ *   --metrics <file>   export the per-stage latency histograms of the live loop or the pipeline, CSV when the name ends in .csv, JSON otherwise
+ *   --metrics-interval <s>  seconds between two exports while running, the last one is written at shutdown (10)
+ *   --count-allocations  count the heap and Mat allocations of each stage of the live loop, printed at the end.
+ *                      With --detector integral --quads runs --pose batched and no board a frame should allocate nothing
+ *   --preview-rate <fps>  frames/s the live window is drawn at, detection runs at its own rate (0: every frame the display takes)
+ *   --no-preview       live loop without a window, also the default when there is no display, Ctrl+C stops it
+ *   --luma             capture and detect on the luma channel only, taken from the raw YUYV, NV12 or MJPEG data of a camera
+ *                      when it gives it, BGR is only built for the overlay of a shown frame
+ *   --board <layout>   pose the markers of a layout file, as written with the atlas sheets of arucoMarkers, together as
+ *                      one rigid board, repeat for more boards; live loop and headless replay
+ *   --stream <target>  stream every marker pose to a file, a named pipe, udp:<host>:<port> or unix:<socket path>,
+ *                      written by its own thread, the oldest poses are dropped when the reader falls behind;
+ *                      a board replaces its markers with one record of id -1 - its index
+ *   --stream-format <name>  ndjson, one JSON object per line, or binary, 104 byte records (ndjson)
+ *   --stream-capacity <n>  poses buffered for the stream writer (4096)
+ */
+bool parseTrackerOptions(int argc, char **argv, TrackerOptions& options)
+{
+    for(int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if(arg == "--input" && hasValue)
+            options.input = argv[++i];
+        else if(arg == "--headless")
+            options.headless = true;
+        else if(arg == "--timings" && hasValue)
+            options.timingsFile = argv[++i];
+        else if(arg == "--pipeline")
+            options.pipeline = true;
+        else if(arg == "--workers" && hasValue)
+            options.detectionWorkers = atoi(argv[++i]);
+        else if(arg == "--queue-depth" && hasValue)
+            options.queueDepth = atoi(argv[++i]);
+        else if(arg == "--mode" && hasValue)
+            options.detectionMode = argv[++i];
+        else if(arg == "--sweep-interval" && hasValue)
+            options.fullSweepInterval = atoi(argv[++i]);
+        else if(arg == "--verify")
+            options.verifyDetection = true;
+        else if(arg == "--pyramid-scale" && hasValue)
+            options.pyramidScale = atoi(argv[++i]);
+        else if(arg == "--max-marker-side" && hasValue)
+            options.maxMarkerSide = atoi(argv[++i]);
+        else if(arg == "--detector" && hasValue)
+            options.detector = argv[++i];
+        else if(arg == "--quads" && hasValue)
+            options.quadFinder = argv[++i];
+        else if(arg == "--pose" && hasValue && string(argv[i + 1]) == "iterative")
+        {
+            options.poseEngine = POSE_ITERATIVE;
+            i++;
+        }
+        else if(arg == "--pose" && hasValue && string(argv[i + 1]) == "batched")
+        {
+            options.poseEngine = POSE_BATCHED;
+            i++;
+        }
+        else if(arg == "--compare-pose")
+            options.comparePoseEngines = true;
+        else if(arg == "--benchmark")
+            options.benchmark = true;
+        else if(arg == "--benchmark-frames" && hasValue)
+            options.benchmarkFrames = atoi(argv[++i]);
+        else if(arg == "--benchmark-seed" && hasValue)
+            options.benchmarkSeed = strtoull(argv[++i], NULL, 10);
+        else if(arg == "--camera" && hasValue)
+            options.cameras.push_back(argv[++i]);
+        else if(arg == "--calibrate" && hasValue)
+            options.calibrationMode = argv[++i];
+        else if(arg == "--calibration" && hasValue)
+            options.calibrationFile = argv[++i];
+        else if(arg == "--undistort")
+            options.undistort = true;
+        else if(arg == "--write-calibration" && hasValue)
+            options.writeCalibration = argv[++i];
+        else if(arg == "--resolution" && hasValue && sscanf(argv[i + 1], "%dx%d", &options.calibrationResolution.width, &options.calibrationResolution.height) == 2)
+            i++;
+        else if(arg == "--metrics" && hasValue)
+            options.metricsFile = argv[++i];
+        else if(arg == "--metrics-interval" && hasValue)
+            options.metricsInterval = atof(argv[++i]);
+        else if(arg == "--preview-rate" && hasValue)
+            options.previewRate = atof(argv[++i]);
+        else if(arg == "--no-preview")
+            options.preview = false;
+        else if(arg == "--count-allocations")
+            options.countAllocations = true;
+        else if(arg == "--luma")
+            options.luma = true;
+        else if(arg == "--board" && hasValue)
+            options.boardLayouts.push_back(argv[++i]);
+        else if(arg == "--stream" && hasValue)
+            options.streamTarget = argv[++i];
+        else if(arg == "--stream-format" && hasValue)
+            options.streamFormat = argv[++i];
+        else if(arg == "--stream-capacity" && hasValue)
+            options.streamCapacity = atoi(argv[++i]);
+        else
+        {
+            cerr << "Unknown or incomplete option " << arg << endl;
+            return false;
+        }
+    }
+
+    if(options.headless && !options.pipeline && !options.benchmark && options.cameras.empty() && options.input.empty())
+    {
+        cerr << "--headless needs --input, there is no camera to replay" << endl;
+        return false;
+    }
+
+    if(!options.boardLayouts.empty() && (options.pipeline || !options.cameras.empty() || options.benchmark))
+    {
+        cerr << "--board works with the live loop and the headless replay, not with --pipeline, --camera or --benchmark" << endl;
+        return false;
+    }
+
+    return true;
+}
+
+int main(int argc, char **argv)
 {
     Mat cameraMatrix = Mat::eye(3,3, CV_64F);
     Mat distanceCoefficients;
+
+    TrackerOptions options;
+    if(!parseTrackerOptions(argc, argv, options))
+        return 1;
     
-    // Uncomment this line and comment the two lines below
-    //cameraCalibrationProcess(cameraMatrix, distanceCoefficients);
-    loadCameraCalibration("CameraCalibrationFile.txt", cameraMatrix, distanceCoefficients);
-    startWebCameraMonitoring(cameraMatrix, distanceCoefficients, 0.099f);
+    if(options.calibrationMode == "batch")
+    {
+        cameraCalibrationProcess(cameraMatrix, distanceCoefficients);
+        return 0;
+    }
+
+    if(options.calibrationMode == "incremental")
+        return startIncrementalCalibration(options, cameraMatrix, distanceCoefficients) > 0 ? 0 : 1;
+
+    if(!options.calibrationMode.empty())
+    {
+        cerr << "Unknown calibration mode " << options.calibrationMode << endl;
+        return 1;
+    }
+
+    if(!loadCameraCalibration(options.calibrationFile, cameraMatrix, distanceCoefficients) && options.cameras.empty() && !options.benchmark)
+        cerr << "Could not load " << options.calibrationFile << ", poses use an identity camera matrix" << endl;
+
+    if(!options.writeCalibration.empty())
+        return saveCameraCalibrationBinary(options.writeCalibration, cameraMatrix, distanceCoefficients, options.calibrationResolution) ? 0 : 1;
+
+    // Undistorted frames are seen through the same camera matrix without any distortion
+    if(options.undistort)
+        distanceCoefficients = Mat::zeros(5, 1, CV_64F);
+
+    if(options.benchmark)
+        return startSyntheticBenchmark(options, 0.099f) > 0 ? 0 : 1;
+
+    // Every camera loads its own calibration
+    if(!options.cameras.empty())
+        return startMultiCameraTracking(options, 0.099f) > 0 ? 0 : 1;
+
+    if(options.pipeline)
+        return startTrackingPipeline(options, cameraMatrix, distanceCoefficients, 0.099f) > 0 ? 0 : 1;
+
+    if(options.headless)
+        return startHeadlessReplay(options, cameraMatrix, distanceCoefficients, 0.099f) > 0 ? 0 : 1;
+
+    startWebCameraMonitoring(cameraMatrix, distanceCoefficients, 0.099f, options);
 
     return 0;
 }